@@ -1,10 +1,28 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 #include "src/TcpConnectionAcceptor.h"
 #include "src/TcpConnectionPool.h"
+#include "src/client.h"
+#include "bench/bench_common.h"
 
-int main()
+int main(int argc, char **argv)
 {
-    std::cout << "Hello World!\n";
-}
+    // Usage: backend-server [ip] [port] [pools] [--huge-pages]
+    const char *ip = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 5000;
+    int pools = argc > 3 ? atoi(argv[3]) : 4;
+    bool huge_pages = argc > 4 && strcmp(argv[4], "--huge-pages") == 0;
+
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        printf("WSAStartup failed with error %d\n", WSAGetLastError());
+        return 1;
+    }
 
+    TcpConnectionAcceptor acceptor(echoPacket, ip, port, pools, 4096, huge_pages);
+    acceptor.serveForever();
 
+    WSACleanup();
+    return 0;
+}
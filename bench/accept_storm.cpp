@@ -0,0 +1,178 @@
+/*  Accept storm benchmark.
+    Runs a TcpConnectionAcceptor with an echo handler in process and opens --connections connections
+    from --threads threads as fast as possible, like clients reconnecting after a deploy.
+    Every client sends a one byte packet right after connect() and waits for the echo, which only arrives once the
+    connection went through handleNewConnection, getConnectionPool, newConnectionsQueue and checkNewConnections.
+
+    Reports accept rate, connect() to first echoed byte latency, dropped connections and how evenly
+    clients were spread across pools, as JSON on stdout.
+
+    Usage:
+        accept_storm --connections 20000 --threads 8 --pools 4 --port 5001 --timeout-ms 5000
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+    Build:
+        cl /O2 /EHsc /std:c++17 bench\accept_storm.cpp src\TcpConnectionAcceptor.cpp src\TcpConnectionPool.cpp src\client.cpp
+           src\HandlerWatchdog.cpp src\TopKSketch.cpp src\RequestTracer.cpp src\BufferPool.cpp src\EpochReclaimer.cpp src\HugePages.cpp src\Numa.cpp src\SharedPayload.cpp src\PacketPool.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib advapi32.lib
+*/
+
+#include "bench_common.h"
+#include "../src/imports/wepoll/wepoll.h"
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/client.h"
+
+#include <thread>
+#include <atomic>
+#include <cmath>
+
+
+struct StormConnection{
+	SOCKET socket = INVALID_SOCKET;
+	unsigned long long connect_start_us = 0;
+	bool echoed = false;
+};
+
+struct StormResult{
+	LatencyHistogram first_byte;
+	int connected = 0;
+	int connect_failures = 0;
+	int echoed = 0;
+	unsigned long long last_echo_us = 0;
+	std::vector<StormConnection> connections;
+};
+
+static void pollEchoes(HANDLE ep, int timeout_ms, StormResult *result){
+    struct epoll_event events[256];
+    int eventCount = epoll_wait(ep, events, 256, timeout_ms);
+    unsigned long long now = getMonotonicTimeUS();
+    for (int i = 0; i < eventCount; i++){
+        StormConnection *c = (StormConnection *)events[i].data.ptr;
+        char byte;
+        if (c->echoed || recv(c->socket, &byte, 1, 0) != 1) continue;
+        c->echoed = true;
+        result->echoed++;
+        result->first_byte.record(now - c->connect_start_us);
+        result->last_echo_us = now;
+        // Keep the connection open so pool sizes can be read at the end, but stop polling it
+        epoll_ctl(ep, EPOLL_CTL_DEL, c->socket, nullptr);
+    }
+}
+
+static void runStorm(const char *ip, int port, int count, int timeout_ms, std::atomic<bool> *start, StormResult *result){
+    HANDLE ep = epoll_create(1);
+    result->connections.resize(count);
+    while (!start->load()) std::this_thread::yield();
+
+    for (StormConnection &c : result->connections){
+        c.connect_start_us = getMonotonicTimeUS();
+        c.socket = connectTo(ip, port);
+        if (c.socket == INVALID_SOCKET){
+            result->connect_failures++;
+            continue;
+        }
+        result->connected++;
+        char packet[packet_header_size + 1];
+        writePacketHeader(packet, 1);
+        packet[packet_header_size] = 'x';
+        send(c.socket, packet, sizeof(packet), 0);
+        setNonBlocking(c.socket);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &c;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.socket, &event);
+        // Collect echoes that already arrived without slowing down the storm
+        pollEchoes(ep, 0, result);
+    }
+
+    // Wait for the remaining echoes
+    unsigned long long deadline = getMonotonicTimeUS() + (unsigned long long)timeout_ms * 1000;
+    while (result->echoed < result->connected && getMonotonicTimeUS() < deadline){
+        pollEchoes(ep, 10, result);
+    }
+    epoll_close(ep);
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    const char *ip = args.getString("ip", "127.0.0.1");
+    int port = (int)args.getInt("port", 5001);
+    int connections = (int)args.getInt("connections", 20000);
+    int threads = (int)args.getInt("threads", 8);
+    int pools = (int)args.getInt("pools", 4);
+    int timeout_ms = (int)args.getInt("timeout-ms", 5000);
+    if (threads < 1) threads = 1;
+
+    if (!initSockets()) return 1;
+
+    TcpConnectionAcceptor *acceptor = new TcpConnectionAcceptor(echoPacket, ip, port, pools, connections);
+    std::thread acceptor_thread(&TcpConnectionAcceptor::serveForever, acceptor);
+    acceptor_thread.detach();
+
+    std::atomic<bool> start(false);
+    std::vector<StormResult> results(threads);
+    std::vector<std::thread> storm_threads;
+    for (int i = 0; i < threads; i++){
+        int count = connections / threads + (i < connections % threads ? 1 : 0);
+        storm_threads.emplace_back(runStorm, ip, port, count, timeout_ms, &start, &results[i]);
+    }
+
+    unsigned long long begin = getMonotonicTimeUS();
+    start = true;
+    for (std::thread &t : storm_threads) t.join();
+
+    StormResult total;
+    for (StormResult &r : results){
+        total.first_byte.merge(r.first_byte);
+        total.connected += r.connected;
+        total.connect_failures += r.connect_failures;
+        total.echoed += r.echoed;
+        if (r.last_echo_us > total.last_echo_us) total.last_echo_us = r.last_echo_us;
+    }
+    double elapsed_s = total.last_echo_us > begin ? (total.last_echo_us - begin) / 1e6 : 0;
+    int dropped = connections - total.echoed;
+
+    // Spread of clients over pools while all clients are still connected
+    std::vector<PoolStats> stats = acceptor->getPoolStats();
+    double mean = 0, variance = 0;
+    int min_size = INT32_MAX, max_size = 0;
+    for (const PoolStats &s : stats){
+        mean += s.size;
+        if (s.size < min_size) min_size = s.size;
+        if (s.size > max_size) max_size = s.size;
+    }
+    mean /= stats.size();
+    for (const PoolStats &s : stats) variance += (s.size - mean) * (s.size - mean);
+    double stddev = sqrt(variance / stats.size());
+
+    std::string details;
+    appendf(details, "{\"benchmark\":\"accept_storm\",\"connections\":%d,\"threads\":%d,\"pools\":%d,", connections, threads, pools);
+    appendf(details, "\"connected\":%d,\"connect_failures\":%d,\"echoed\":%d,\"dropped\":%d,", total.connected, total.connect_failures, total.echoed, dropped);
+    appendf(details, "\"elapsed_s\":%.3f,\"accepted_per_s\":%.0f,", elapsed_s, elapsed_s > 0 ? total.echoed / elapsed_s : 0);
+    appendf(details, "\"first_byte_us\":{\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},",
+        total.first_byte.mean(), total.first_byte.percentile(0.5), total.first_byte.percentile(0.9),
+        total.first_byte.percentile(0.99), total.first_byte.percentile(0.999), total.first_byte.max);
+    appendf(details, "\"pool_sizes\":[");
+    for (size_t i = 0; i < stats.size(); i++) appendf(details, "%s%d", i ? "," : "", stats[i].size);
+    appendf(details, "],\"pool_size_min\":%d,\"pool_size_max\":%d,\"pool_size_stddev\":%.1f,\"pool_imbalance\":%.3f}",
+        min_size, max_size, stddev, mean > 0 ? max_size / mean : 0);
+    printf("%s\n", details.c_str());
+
+    BenchReport report("accept_storm", args);
+    report.addMetric("accepted_per_s", elapsed_s > 0 ? total.echoed / elapsed_s : 0, "1/s", true, 0.10);
+    report.addMetric("first_byte_p99_us", (double)total.first_byte.percentile(0.99), "us", false, 0.20);
+    report.addMetric("dropped", dropped, "connections", false, 0);
+    report.addMetric("pool_imbalance", mean > 0 ? max_size / mean : 0, "max/mean", false, 0.05);
+    report.setDetails(details);
+    report.write();
+
+    for (StormResult &r : results){
+        for (StormConnection &c : r.connections){
+            if (c.socket != INVALID_SOCKET) closesocket(c.socket);
+        }
+    }
+    // The acceptor and its pools are left running, the process exits here
+    fflush(stdout);
+    std::_Exit(0);
+}
@@ -0,0 +1,454 @@
+#ifndef _BENCH_COMMON_H
+#define _BENCH_COMMON_H
+
+/*  Helpers shared by the benchmark executables in bench/.
+    Every benchmark is a single .cpp file, build it together with the sources it uses, e.g.
+        cl /O2 /EHsc /std:c++17 bench\loadgen.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib
+*/
+
+#include <winsock2.h>
+#include <windows.h>
+#include <psapi.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <cstdarg>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#include "../src/clock.h"
+#include "../src/client.h"
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+
+/* Requests use the server's packet framing (client.h).
+   The first 8 bytes of the payload hold the monotonic send time in microseconds. */
+static const int frame_min_payload = 8;
+
+
+// Command line options of the form --name value
+class BenchArgs{
+public:
+	BenchArgs(int argc, char **argv){
+		for (int i = 1; i + 1 < argc; i += 2){
+			if (strncmp(argv[i], "--", 2) != 0){
+				printf("Unexpected argument %s, options are --name value\n", argv[i]);
+				exit(1);
+			}
+			this->names.push_back(argv[i] + 2);
+			this->values.push_back(argv[i + 1]);
+		}
+	}
+	const char *getString(const char *name, const char *default_value) const{
+		for (int i = (int)this->names.size() - 1; i >= 0; i--){
+			if (this->names[i] == name) return this->values[i].c_str();
+		}
+		return default_value;
+	}
+	long long getInt(const char *name, long long default_value) const{
+		const char *v = this->getString(name, nullptr);
+		return v != nullptr ? atoll(v) : default_value;
+	}
+	double getDouble(const char *name, double default_value) const{
+		const char *v = this->getString(name, nullptr);
+		return v != nullptr ? atof(v) : default_value;
+	}
+	// Every option given, in command line order
+	const std::vector<std::string> &getNames() const{ return this->names; }
+	const std::vector<std::string> &getValues() const{ return this->values; }
+
+protected:
+	std::vector<std::string> names, values;
+};
+
+
+/*  Log-linear latency histogram (HDR style), 32 sub-buckets per power of two (~3% precision).
+    Recording is a few instructions and histograms of different threads can be merged. */
+class LatencyHistogram{
+public:
+	static const int sub_bits = 5;
+	static const int sub_count = 1 << sub_bits;
+	static const int num_buckets = 64 * sub_count;
+
+	LatencyHistogram() : buckets(num_buckets, 0) {}
+
+	void record(unsigned long long value){
+		this->buckets[bucketIndex(value)]++;
+		this->count++;
+		this->sum += value;
+		if (value > this->max) this->max = value;
+	}
+	void merge(const LatencyHistogram &other){
+		for (int i = 0; i < num_buckets; i++) this->buckets[i] += other.buckets[i];
+		this->count += other.count;
+		this->sum += other.sum;
+		if (other.max > this->max) this->max = other.max;
+	}
+	// q in [0, 1]
+	unsigned long long percentile(double q) const{
+		if (this->count == 0) return 0;
+		unsigned long long rank = (unsigned long long)(q * (this->count - 1)) + 1;
+		unsigned long long seen = 0;
+		for (int i = 0; i < num_buckets; i++){
+			seen += this->buckets[i];
+			if (seen >= rank){
+				unsigned long long v = bucketValue(i);
+				return v < this->max ? v : this->max;
+			}
+		}
+		return this->max;
+	}
+	double mean() const{ return this->count > 0 ? (double)this->sum / this->count : 0; }
+
+	unsigned long long count = 0, sum = 0, max = 0;
+
+	static int bucketIndex(unsigned long long v){
+		if (v < (unsigned long long)sub_count) return (int)v;
+		int msb = 0;
+		while ((v >> (msb + 1)) != 0) msb++;
+		int shift = msb - sub_bits;
+		return (shift + 1) * sub_count + (int)((v >> shift) - sub_count);
+	}
+	// Midpoint of the values falling into bucket idx
+	static unsigned long long bucketValue(int idx){
+		if (idx < sub_count) return idx;
+		int shift = idx / sub_count - 1;
+		unsigned long long low = (unsigned long long)(idx % sub_count + sub_count) << shift;
+		return low + (((1ull << shift) - 1) / 2);
+	}
+
+protected:
+	std::vector<unsigned long long> buckets;
+};
+
+inline void printLatency(const char *label, const LatencyHistogram &h){
+	printf("%s (us): mean %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu  (n=%llu)\n", label,
+		h.mean(), h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.percentile(0.999), h.max, h.count);
+}
+
+
+/*  Request size distribution given as
+        fixed:N  uniform:MIN:MAX  exp:MEAN  bimodal:SMALL:LARGE:P_LARGE
+    Sizes are payload bytes, never smaller than frame_min_payload nor larger than max_packet_size. */
+class SizeDistribution{
+public:
+	SizeDistribution(const char *spec){
+		this->spec = spec;
+		if (sscanf(spec, "fixed:%d", &this->a) == 1) this->type = 0;
+		else if (sscanf(spec, "uniform:%d:%d", &this->a, &this->b) == 2) this->type = 1;
+		else if (sscanf(spec, "exp:%d", &this->a) == 1) this->type = 2;
+		else if (sscanf(spec, "bimodal:%d:%d:%lf", &this->a, &this->b, &this->p) == 3) this->type = 3;
+		else {
+			printf("Invalid size distribution '%s'\n", spec);
+			exit(1);
+		}
+	}
+	int sample(std::mt19937_64 &rng){
+		int size = this->a;
+		if (this->type == 1) size = std::uniform_int_distribution<int>(this->a, this->b)(rng);
+		else if (this->type == 2) size = (int)std::exponential_distribution<double>(1.0 / this->a)(rng);
+		else if (this->type == 3) size = std::bernoulli_distribution(this->p)(rng) ? this->b : this->a;
+		if (size > max_packet_size) size = max_packet_size;
+		return size < frame_min_payload ? frame_min_payload : size;
+	}
+	int maxSize() const{ return this->type == 2 ? this->a * 20 : (this->b > this->a ? this->b : this->a); }
+
+	const char *spec;
+
+protected:
+	int type = 0, a = 0, b = 0;
+	double p = 0;
+};
+
+
+// Resident memory of this process in bytes (working set)
+inline unsigned long long getProcessRSS(){
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&counters, sizeof(counters))) return 0;
+	return counters.WorkingSetSize;
+}
+
+// Open kernel handles of this process (sockets included), what an fd count is elsewhere
+inline unsigned long long getProcessHandleCount(){
+	DWORD count = 0;
+	if (!GetProcessHandleCount(GetCurrentProcess(), &count)) return 0;
+	return count;
+}
+
+// Time stamp counter, ticks at the nominal CPU frequency on current x86 processors
+inline unsigned long long readCycleCounter(){
+	return __rdtsc();
+}
+
+// Pins the calling thread to one core, ignored when core < 0
+inline void pinThread(int core){
+	if (core < 0) return;
+	if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) == 0){
+		printf("Could not pin thread to core %d\n", core);
+	}
+}
+
+inline bool initSockets(){
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+		printf("WSAStartup failed with error %d\n", WSAGetLastError());
+		return false;
+	}
+	return true;
+}
+
+inline bool setNonBlocking(SOCKET s){
+	u_long mode = 1;
+	return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+
+// Blocking connect to ip:port with TCP_NODELAY, returns INVALID_SOCKET on failure
+inline SOCKET connectTo(const char *ip, int port){
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET) return s;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	addr.sin_port = htons(port);
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR){
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	int val = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(int));
+	return s;
+}
+
+// Blocking connect to ip:port from source_ip, e.g. one of several 127.0.0.x addresses when a single source
+// address runs out of ephemeral ports. Returns INVALID_SOCKET on failure.
+inline SOCKET connectFrom(const char *source_ip, const char *ip, int port){
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET) return s;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(source_ip);
+	addr.sin_port = 0;
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR){
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	addr.sin_addr.s_addr = inet_addr(ip);
+	addr.sin_port = htons(port);
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR){
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+}
+
+// Waits until the pools of an in-process acceptor have exactly expected clients registered, false on timeout
+inline bool waitForClients(TcpConnectionAcceptor *acceptor, int expected, int timeout_ms){
+	unsigned long long deadline = getMonotonicTimeUS() + (unsigned long long)timeout_ms * 1000;
+	while (getMonotonicTimeUS() < deadline){
+		int registered = 0;
+		for (const PoolStats &s : acceptor->getPoolStats()) registered += s.size;
+		if (registered == expected) return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	return false;
+}
+
+/*  handle_function echoing every packet back, used by backend-server and the in-process benchmarks.
+    The reply comes from the batch's arena, which returns nullptr when out of memory: the client is closed
+    then rather than left waiting for an echo that never comes. */
+inline void echoPacket(Client *client, Packet *packet){
+	int reply_size = packet_header_size + packet->size;
+	char *reply = packet->arena->allocateArray<char>(reply_size);
+	if (reply == nullptr){
+		client->close();
+		return;
+	}
+	writePacketHeader(reply, packet->size);
+	memcpy(reply + packet_header_size, packet->data, packet->size);
+	// Whatever the socket doesn't take right away is queued by the pool
+	client->send(reply, reply_size);
+}
+
+
+// printf into a std::string
+inline void appendf(std::string &out, const char *format, ...){
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	if (n < (int)sizeof(buffer)){
+		out.append(buffer, n > 0 ? n : 0);
+		return;
+	}
+	std::vector<char> large(n + 1);
+	va_start(args, format);
+	vsnprintf(large.data(), large.size(), format, args);
+	va_end(args);
+	out.append(large.data(), n);
+}
+
+inline std::string jsonString(const std::string &value){
+	std::string out = "\"";
+	for (char c : value){
+		if (c == '"' || c == '\\') out += '\\';
+		if ((unsigned char)c < 0x20) appendf(out, "\\u%04x", c);
+		else out += c;
+	}
+	return out + "\"";
+}
+
+inline std::string getCpuName(){
+	unsigned int regs[4] = {0, 0, 0, 0};
+	char brand[49] = {0};
+#ifdef _MSC_VER
+	__cpuid((int *)regs, 0x80000000);
+	if (regs[0] < 0x80000004) return "unknown";
+	for (unsigned int i = 0; i < 3; i++){
+		__cpuid((int *)regs, 0x80000002 + i);
+		memcpy(brand + 16*i, regs, 16);
+	}
+#else
+	if (__get_cpuid_max(0x80000000, nullptr) < 0x80000004) return "unknown";
+	for (unsigned int i = 0; i < 3; i++){
+		__get_cpuid(0x80000002 + i, &regs[0], &regs[1], &regs[2], &regs[3]);
+		memcpy(brand + 16*i, regs, 16);
+	}
+#endif
+	std::string name = brand;
+	size_t start = name.find_first_not_of(' ');
+	return start == std::string::npos ? "unknown" : name.substr(start);
+}
+
+inline std::string getOsVersion(){
+	// GetVersionEx lies to unmanifested executables, RtlGetVersion doesn't
+	typedef LONG (WINAPI *RtlGetVersion_t)(RTL_OSVERSIONINFOW *);
+	RtlGetVersion_t rtl_get_version = (RtlGetVersion_t)GetProcAddress(GetModuleHandleA("ntdll.dll"), "RtlGetVersion");
+	RTL_OSVERSIONINFOW info;
+	memset(&info, 0, sizeof(info));
+	info.dwOSVersionInfoSize = sizeof(info);
+	if (rtl_get_version == nullptr || rtl_get_version(&info) != 0) return "Windows";
+	char version[64];
+	snprintf(version, sizeof(version), "Windows %lu.%lu.%lu", info.dwMajorVersion, info.dwMinorVersion, info.dwBuildNumber);
+	return version;
+}
+
+inline std::string getCompilerVersion(){
+	char version[128];
+#if defined(_MSC_FULL_VER)
+	snprintf(version, sizeof(version), "MSVC %d", _MSC_FULL_VER);
+#elif defined(__clang__)
+	snprintf(version, sizeof(version), "clang %s", __clang_version__);
+#elif defined(__GNUC__)
+	snprintf(version, sizeof(version), "gcc %s", __VERSION__);
+#else
+	snprintf(version, sizeof(version), "unknown");
+#endif
+	return version;
+}
+
+
+/*  Result document shared by every benchmark, written to the file given with --json (- for stdout):
+        {
+          "schema": "tcpserver-bench/1",
+          "benchmark": "loadgen",
+          "meta": {"timestamp", "label", "host", "cpu", "logical_cores", "memory_bytes", "os", "compiler", "build"},
+          "config": {"connections": "1000", ...},     every --name value given on the command line
+          "metrics": [{"name", "value", "unit", "better": "higher"|"lower", "tolerance", "samples": [...]}],
+          "details": {...}                            benchmark specific, e.g. a latency curve
+        }
+    tolerance is the relative change a metric shows between identical runs, used by bench_compare when
+    there are no samples to estimate the noise from. samples are repeated measurements within the run
+    (for example throughput per second). --label names the run, e.g. a commit. */
+class BenchReport{
+public:
+	BenchReport(const char *benchmark, const BenchArgs &args) : args(args){
+		this->benchmark = benchmark;
+	}
+
+	void addMetric(const std::string &name, double value, const char *unit, bool higher_is_better, double tolerance,
+	               const std::vector<double> &samples = std::vector<double>()){
+		std::string m;
+		appendf(m, "{\"name\":%s,\"value\":%.17g,\"unit\":%s,\"better\":\"%s\",\"tolerance\":%g",
+			jsonString(name).c_str(), value, jsonString(unit).c_str(), higher_is_better ? "higher" : "lower", tolerance);
+		if (!samples.empty()){
+			m += ",\"samples\":[";
+			for (size_t i = 0; i < samples.size(); i++) appendf(m, "%s%.17g", i ? "," : "", samples[i]);
+			m += "]";
+		}
+		this->metrics.push_back(m + "}");
+	}
+	// JSON value placed under "details"
+	void setDetails(const std::string &json){ this->details = json; }
+
+	// Writes the document to the file given with --json, does nothing without --json
+	bool write(){
+		const char *path = this->args.getString("json", nullptr);
+		if (path == nullptr) return true;
+		FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+		if (f == nullptr){
+			fprintf(stderr, "Could not write %s\n", path);
+			return false;
+		}
+		std::string doc = this->toJson();
+		fprintf(f, "%s\n", doc.c_str());
+		if (f != stdout) fclose(f);
+		return true;
+	}
+
+	std::string toJson(){
+		char host[256] = "unknown";
+		DWORD host_size = sizeof(host);
+		GetComputerNameA(host, &host_size);
+		MEMORYSTATUSEX memory;
+		memory.dwLength = sizeof(memory);
+		unsigned long long memory_bytes = GlobalMemoryStatusEx(&memory) ? memory.ullTotalPhys : 0;
+		char timestamp[32];
+		time_t now = time(nullptr);
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+#ifdef NDEBUG
+		const char *build = "release";
+#else
+		const char *build = "debug";
+#endif
+
+		std::string out;
+		appendf(out, "{\"schema\":\"tcpserver-bench/1\",\"benchmark\":%s,", jsonString(this->benchmark).c_str());
+		appendf(out, "\"meta\":{\"timestamp\":\"%s\",\"label\":%s,\"host\":%s,\"cpu\":%s,\"logical_cores\":%u,\"memory_bytes\":%llu,",
+			timestamp, jsonString(this->args.getString("label", "")).c_str(), jsonString(host).c_str(), jsonString(getCpuName()).c_str(),
+			std::thread::hardware_concurrency(), memory_bytes);
+		appendf(out, "\"os\":%s,\"compiler\":%s,\"build\":\"%s\"},", jsonString(getOsVersion()).c_str(),
+			jsonString(getCompilerVersion()).c_str(), build);
+		out += "\"config\":{";
+		const std::vector<std::string> &names = this->args.getNames();
+		for (size_t i = 0; i < names.size(); i++){
+			if (names[i] == "json" || names[i] == "label") continue;
+			appendf(out, "%s%s:%s", out.back() == '{' ? "" : ",", jsonString(names[i]).c_str(), jsonString(this->args.getValues()[i]).c_str());
+		}
+		out += "},\"metrics\":[";
+		for (size_t i = 0; i < this->metrics.size(); i++) out += (i ? "," : "") + this->metrics[i];
+		out += "],\"details\":" + (this->details.empty() ? std::string("{}") : this->details) + "}";
+		return out;
+	}
+
+protected:
+	std::string benchmark;
+	const BenchArgs &args;
+	std::vector<std::string> metrics;
+	std::string details;
+};
+
+#endif
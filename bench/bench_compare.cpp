@@ -0,0 +1,350 @@
+/*  Compares benchmark results written with --json (format in bench_common.h) and flags regressions.
+
+    Every metric of the base runs is compared with the same metric of the new runs. A change counts
+    when it is larger than the metric's tolerance (or --threshold when given) and, when both sides
+    have at least two samples, also larger than --sigma standard errors of the difference of means.
+    With two or more files on both sides the samples are one value per file (the mean of the run's own samples),
+    since samples within a run vary less than runs do and would make normal run to run differences look
+    significant. Otherwise both sides use the metric's own samples (e.g. throughput per second), the two are
+    never mixed. Running a benchmark a few times on each side makes the comparison aware of run to run noise,
+    the noise column shows which of the two a metric was compared on.
+
+    Runs from different machines, builds or configurations are compared but reported with a warning.
+
+    Usage:
+        bench_compare --base before1.json,before2.json,before3.json --new after1.json,after2.json,after3.json
+                      [--threshold 5] [--sigma 3]
+    Exit code 0 if nothing regressed, 1 if a metric regressed, 2 on bad input.
+*/
+
+#include "bench_common.h"
+
+#include <cmath>
+#include <map>
+
+
+// Just enough JSON for the result files
+struct JsonValue{
+	enum Type{ NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+	double number = 0;
+	std::string str;
+	std::vector<JsonValue> items;
+	std::vector<std::pair<std::string, JsonValue>> members;
+
+	const JsonValue *get(const char *key) const{
+		for (const auto &m : this->members){
+			if (m.first == key) return &m.second;
+		}
+		return nullptr;
+	}
+	std::string getString(const char *key) const{
+		const JsonValue *v = this->get(key);
+		if (v == nullptr) return "";
+		if (v->type == STRING) return v->str;
+		if (v->type == NUMBER){
+			char buffer[64];
+			snprintf(buffer, sizeof(buffer), "%.17g", v->number);
+			return buffer;
+		}
+		return "";
+	}
+};
+
+class JsonParser{
+public:
+	JsonParser(const std::string &text) : text(text) {}
+
+	bool parse(JsonValue &out){
+		if (!this->parseValue(out)) return false;
+		this->skipSpace();
+		return this->pos == this->text.size();
+	}
+
+protected:
+	const std::string &text;
+	size_t pos = 0;
+
+	void skipSpace(){
+		while (this->pos < this->text.size() && isspace((unsigned char)this->text[this->pos])) this->pos++;
+	}
+	bool consume(char c){
+		this->skipSpace();
+		if (this->pos < this->text.size() && this->text[this->pos] == c){
+			this->pos++;
+			return true;
+		}
+		return false;
+	}
+	bool parseString(std::string &out){
+		if (!this->consume('"')) return false;
+		while (this->pos < this->text.size()){
+			char c = this->text[this->pos++];
+			if (c == '"') return true;
+			if (c != '\\'){
+				out += c;
+				continue;
+			}
+			if (this->pos >= this->text.size()) return false;
+			char e = this->text[this->pos++];
+			if (e == 'n') out += '\n';
+			else if (e == 't') out += '\t';
+			else if (e == 'r') out += '\r';
+			else if (e == 'b') out += '\b';
+			else if (e == 'f') out += '\f';
+			else if (e == 'u'){
+				// Only used for control characters by the benchmarks, keep ASCII and replace the rest
+				if (this->pos + 4 > this->text.size()) return false;
+				unsigned int code = (unsigned int)strtoul(this->text.substr(this->pos, 4).c_str(), nullptr, 16);
+				out += code < 0x80 ? (char)code : '?';
+				this->pos += 4;
+			}
+			else out += e;
+		}
+		return false;
+	}
+	bool parseValue(JsonValue &out){
+		this->skipSpace();
+		if (this->pos >= this->text.size()) return false;
+		char c = this->text[this->pos];
+		if (c == '{'){
+			this->pos++;
+			out.type = JsonValue::OBJECT;
+			if (this->consume('}')) return true;
+			do {
+				std::string key;
+				JsonValue value;
+				this->skipSpace();
+				if (!this->parseString(key) || !this->consume(':') || !this->parseValue(value)) return false;
+				out.members.emplace_back(key, value);
+			} while (this->consume(','));
+			return this->consume('}');
+		}
+		if (c == '['){
+			this->pos++;
+			out.type = JsonValue::ARRAY;
+			if (this->consume(']')) return true;
+			do {
+				JsonValue value;
+				if (!this->parseValue(value)) return false;
+				out.items.push_back(value);
+			} while (this->consume(','));
+			return this->consume(']');
+		}
+		if (c == '"'){
+			out.type = JsonValue::STRING;
+			return this->parseString(out.str);
+		}
+		if (this->text.compare(this->pos, 4, "true") == 0 || this->text.compare(this->pos, 5, "false") == 0){
+			out.type = JsonValue::BOOL;
+			out.number = c == 't';
+			this->pos += c == 't' ? 4 : 5;
+			return true;
+		}
+		if (this->text.compare(this->pos, 4, "null") == 0){
+			this->pos += 4;
+			return true;
+		}
+		char *end;
+		out.type = JsonValue::NUMBER;
+		out.number = strtod(this->text.c_str() + this->pos, &end);
+		if (end == this->text.c_str() + this->pos) return false;
+		this->pos = end - this->text.c_str();
+		return true;
+	}
+};
+
+
+struct MetricSamples{
+	std::string unit;
+	bool higher_is_better = true;
+	double tolerance = 0.05;
+	// Samples of every run, and one value per run
+	std::vector<double> samples;
+	std::vector<double> run_values;
+	bool present = false;
+
+	// What the comparison uses, the same kind on both sides, see the top of the file
+	static bool compareRuns(const MetricSamples &base, const MetricSamples &changed){
+		return base.run_values.size() >= 2 && changed.run_values.size() >= 2;
+	}
+	const std::vector<double> &compared(bool runs) const{ return runs ? this->run_values : this->samples; }
+
+	static double mean(const std::vector<double> &values){
+		double sum = 0;
+		for (double v : values) sum += v;
+		return values.empty() ? 0 : sum / values.size();
+	}
+	static double variance(const std::vector<double> &values){
+		if (values.size() < 2) return 0;
+		double m = mean(values), sum = 0;
+		for (double v : values) sum += (v - m) * (v - m);
+		return sum / (values.size() - 1);
+	}
+};
+
+struct RunSet{
+	std::vector<JsonValue> runs;
+	std::vector<std::string> metric_order;
+	std::map<std::string, MetricSamples> metrics;
+};
+
+static std::vector<std::string> splitList(const char *list){
+    std::vector<std::string> out;
+    std::string current;
+    for (const char *p = list; *p != 0; p++){
+        if (*p == ','){
+            if (!current.empty()) out.push_back(current);
+            current.clear();
+        }
+        else current += *p;
+    }
+    if (!current.empty()) out.push_back(current);
+    return out;
+}
+
+static bool loadRuns(const char *list, RunSet &set){
+    for (const std::string &path : splitList(list)){
+        FILE *f = fopen(path.c_str(), "rb");
+        if (f == nullptr){
+            fprintf(stderr, "Could not open %s\n", path.c_str());
+            return false;
+        }
+        std::string text;
+        char buffer[65536];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) text.append(buffer, n);
+        fclose(f);
+
+        JsonValue run;
+        if (!JsonParser(text).parse(run) || run.type != JsonValue::OBJECT || run.getString("schema") != "tcpserver-bench/1"){
+            fprintf(stderr, "%s is not a benchmark result (schema tcpserver-bench/1)\n", path.c_str());
+            return false;
+        }
+        const JsonValue *metrics = run.get("metrics");
+        if (metrics != nullptr){
+            for (const JsonValue &m : metrics->items){
+                std::string name = m.getString("name");
+                const JsonValue *value = m.get("value");
+                if (name.empty() || value == nullptr) continue;
+                MetricSamples &ms = set.metrics[name];
+                if (!ms.present){
+                    ms.present = true;
+                    set.metric_order.push_back(name);
+                    ms.unit = m.getString("unit");
+                    ms.higher_is_better = m.getString("better") != "lower";
+                    const JsonValue *tolerance = m.get("tolerance");
+                    if (tolerance != nullptr) ms.tolerance = tolerance->number;
+                }
+                const JsonValue *samples = m.get("samples");
+                if (samples != nullptr && samples->items.size() >= 2){
+                    std::vector<double> run;
+                    for (const JsonValue &s : samples->items) run.push_back(s.number);
+                    ms.samples.insert(ms.samples.end(), run.begin(), run.end());
+                    ms.run_values.push_back(MetricSamples::mean(run));
+                }
+                else {
+                    ms.samples.push_back(value->number);
+                    ms.run_values.push_back(value->number);
+                }
+            }
+        }
+        set.runs.push_back(run);
+    }
+    if (set.runs.empty()){
+        fprintf(stderr, "No result files in '%s'\n", list);
+        return false;
+    }
+    return true;
+}
+
+static void warnDifferences(const RunSet &base, const RunSet &changed){
+    /* Comparisons across machines, builds or configurations are allowed but rarely meaningful */
+    const JsonValue *base_meta = base.runs[0].get("meta");
+    const JsonValue *new_meta = changed.runs[0].get("meta");
+    const char *meta_keys[] = {"host", "cpu", "logical_cores", "memory_bytes", "os", "compiler", "build"};
+    for (const char *key : meta_keys){
+        std::string a = base_meta != nullptr ? base_meta->getString(key) : "";
+        std::string b = new_meta != nullptr ? new_meta->getString(key) : "";
+        if (a != b) printf("warning: %s differs: '%s' vs '%s'\n", key, a.c_str(), b.c_str());
+    }
+    const JsonValue *base_config = base.runs[0].get("config");
+    const JsonValue *new_config = changed.runs[0].get("config");
+    std::map<std::string, std::pair<std::string, std::string>> config;
+    if (base_config != nullptr) for (const auto &m : base_config->members) config[m.first].first = base_config->getString(m.first.c_str());
+    if (new_config != nullptr) for (const auto &m : new_config->members) config[m.first].second = new_config->getString(m.first.c_str());
+    for (const auto &c : config){
+        if (c.second.first != c.second.second){
+            printf("warning: option --%s differs: '%s' vs '%s'\n", c.first.c_str(), c.second.first.c_str(), c.second.second.c_str());
+        }
+    }
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    const char *base_list = args.getString("base", nullptr);
+    const char *new_list = args.getString("new", nullptr);
+    double threshold = args.getDouble("threshold", -1) / 100;
+    double sigma = args.getDouble("sigma", 3);
+    if (base_list == nullptr || new_list == nullptr){
+        printf("Usage: bench_compare --base a.json[,b.json...] --new c.json[,d.json...] [--threshold PCT] [--sigma N]\n");
+        return 2;
+    }
+
+    RunSet base, changed;
+    if (!loadRuns(base_list, base) || !loadRuns(new_list, changed)) return 2;
+    std::string benchmark = base.runs[0].getString("benchmark");
+    if (benchmark != changed.runs[0].getString("benchmark")){
+        fprintf(stderr, "Can't compare %s with %s\n", benchmark.c_str(), changed.runs[0].getString("benchmark").c_str());
+        return 2;
+    }
+
+    const JsonValue *base_meta = base.runs[0].get("meta");
+    const JsonValue *new_meta = changed.runs[0].get("meta");
+    printf("%s: base %d run(s) '%s', new %d run(s) '%s'\n", benchmark.c_str(),
+        (int)base.runs.size(), base_meta != nullptr ? base_meta->getString("label").c_str() : "",
+        (int)changed.runs.size(), new_meta != nullptr ? new_meta->getString("label").c_str() : "");
+    warnDifferences(base, changed);
+
+    printf("%-32s %14s %14s %9s %9s %-8s %s\n", "metric", "base", "new", "change", "threshold", "noise", "verdict");
+    int regressions = 0;
+    std::vector<std::string> names = base.metric_order;
+    for (const std::string &name : changed.metric_order){
+        if (base.metrics.find(name) == base.metrics.end()) names.push_back(name);
+    }
+    for (const std::string &name : names){
+        auto b = base.metrics.find(name);
+        auto n = changed.metrics.find(name);
+        if (b == base.metrics.end() || n == changed.metrics.end()){
+            printf("%-32s %s\n", name.c_str(), b == base.metrics.end() ? "only in new" : "only in base");
+            continue;
+        }
+        const MetricSamples &bs = b->second, &ns = n->second;
+        bool runs = MetricSamples::compareRuns(bs, ns);
+        const std::vector<double> &bv = bs.compared(runs), &nv = ns.compared(runs);
+        double base_mean = MetricSamples::mean(bv), new_mean = MetricSamples::mean(nv);
+        double diff = new_mean - base_mean;
+        double change = base_mean != 0 ? diff / fabs(base_mean) : (diff == 0 ? 0 : (diff > 0 ? INFINITY : -INFINITY));
+        double tolerance = threshold >= 0 ? threshold : bs.tolerance;
+
+        // With enough samples on both sides the difference also has to stand out from the noise
+        bool significant = true;
+        if (bv.size() >= 2 && nv.size() >= 2){
+            double standard_error = sqrt(MetricSamples::variance(bv) / bv.size() + MetricSamples::variance(nv) / nv.size());
+            significant = fabs(diff) > sigma * standard_error;
+        }
+        const char *verdict = "same";
+        if (fabs(change) > tolerance && significant){
+            bool worse = bs.higher_is_better ? diff < 0 : diff > 0;
+            verdict = worse ? "REGRESSION" : "improved";
+            if (worse) regressions++;
+        }
+        else if (fabs(change) > tolerance) verdict = "noise";
+
+        printf("%-32s %14.6g %14.6g %8.1f%% %8.1f%% %-8s %s\n", name.c_str(), base_mean, new_mean, change * 100, tolerance * 100,
+            runs ? "runs" : "samples", verdict);
+    }
+
+    if (regressions > 0) printf("%d metric(s) regressed\n", regressions);
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+/*  Cache line sharing between the pool and acceptor threads, previous versus current object layouts.
+
+    A pool thread runs the per-event accesses of ConnectionPool::serveOnce() (find the client by socket,
+    check closed, look at its partial packet, count the request, read tracer/watchdog, allocate the packet
+    from the arena) on --clients clients picked at random, while an acceptor thread runs its own accesses
+    (read the pool's size and queue for every accept and, in the legacy layout, scan the clients' reference
+    counts like the acceptor used to prune closed clients, taking and dropping a reference now and then).
+    Every layout is timed with the acceptor thread idle and running: the difference is what the two threads
+    cost each other through shared cache lines.
+
+        legacy      Client and ConnectionPool fields as they were laid out before (copied below): the reference
+                    count shares a line with the per-event client fields, the pool's size with its arena
+        current     the real Client (from a ClientSlab) and ConnectionPool. Clients are freed through epoch
+                    reclamation, the acceptor doesn't touch them after handing them to a pool.
+
+    shared_lines is the number of cache lines the pool thread writes per event that the acceptor thread also
+    touches, read from the field addresses. Every such line is a coherence miss for one of the threads
+    whenever the other touched it in between. Windows has no user mode access to cache miss counters, run
+    under VTune or perf (e.g. perf c2c) to count the misses themselves.
+
+    Pin the threads to different physical cores (not two hyperthreads of one core, they share the L1),
+    results on a single core mean nothing.
+
+    Usage:
+        cache_layout --clients 10000 --events 20000000 --pool-core 0 --acceptor-core 2
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+    Build:
+        cl /O2 /EHsc /std:c++17 bench\cache_layout.cpp src\TcpConnectionAcceptor.cpp src\TcpConnectionPool.cpp src\client.cpp
+           src\HandlerWatchdog.cpp src\TopKSketch.cpp src\RequestTracer.cpp src\BufferPool.cpp src\EpochReclaimer.cpp src\HugePages.cpp src\Numa.cpp src\SharedPayload.cpp src\PacketPool.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib advapi32.lib
+*/
+
+#include "bench_common.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/client.h"
+
+#include <thread>
+#include <atomic>
+#include <random>
+
+
+// Client as laid out before, in declaration order
+struct LegacyClient{
+	SOCKET client_socket;
+	ConnectionPool *connection_pool = nullptr;
+	int request_count = 0;
+	int client_id = 0;
+	std::atomic<int> referenceCount = 0;
+	bool closed = false;
+	ClientSlab *slab = nullptr;
+	PooledBuffer recv_partial;
+};
+
+// Public fields of ConnectionPool as laid out before, the arena directly follows the pool's size.
+// Line aligned so shared_lines doesn't depend on where new happens to put it.
+struct alignas(64) LegacyPool{
+	void *vtable;
+	int id = 0;
+	std::atomic<int> size = 0;
+	moodycamel::ReaderWriterQueue<Client *> *newConnectionsQueue = nullptr;
+	int running = 1;
+	std::atomic<HandlerSlot *> watchdog_slot = nullptr;
+	std::atomic<RequestTracer *> tracer = nullptr;
+	RequestArena arena;
+};
+
+static const int event_payload_size = 64;
+
+// What the pool thread does with a client for one readable event, up to dispatching the packet
+template<class C, class P>
+static inline int poolEvent(C *c, P *pool, SOCKET s){
+    if (c->client_socket != s || c->closed) return 0;
+    if (pool->tracer.load(std::memory_order_relaxed) != nullptr) return 0;
+    if (pool->watchdog_slot.load(std::memory_order_relaxed) != nullptr) return 0;
+    int partial = c->recv_partial.size;
+    c->request_count++;
+    char *packet = (char *)pool->arena.allocate(event_payload_size);
+    packet[0] = (char)c->client_id;
+    return partial + packet[0];
+}
+
+static inline uintptr_t lineOf(const void *p){ return (uintptr_t)p / 64; }
+
+// The acceptor's accesses to a client: scan its reference count, take and drop a reference now and then
+static inline int acceptorTouch(LegacyClient *c, unsigned long long ops){
+    int seen = c->referenceCount.load(std::memory_order_relaxed) <= 0;
+    if ((ops & 63) == 0){
+        c->referenceCount++;
+        c->referenceCount--;
+    }
+    return seen;
+}
+static inline int acceptorTouch(Client *c, unsigned long long ops){ return 0; }
+
+// Cache lines of a client the acceptor touches, 0 for none
+static inline uintptr_t acceptorClientLine(LegacyClient *c){ return lineOf(&c->referenceCount); }
+static inline uintptr_t acceptorClientLine(Client *c){ return 0; }
+
+// Cache lines written by the pool thread for an event that the acceptor thread also touches
+template<class C, class P>
+static int sharedLines(C *c, P *pool){
+    const char *arena = (const char *)&pool->arena;
+    std::vector<uintptr_t> pool_writes = {lineOf(&c->request_count), lineOf(arena)};
+    if (lineOf(arena + sizeof(pool->arena) - 1) != lineOf(arena)) pool_writes.push_back(lineOf(arena + sizeof(pool->arena) - 1));
+    uintptr_t acceptor_touches[] = {acceptorClientLine(c), lineOf(&pool->size), lineOf(&pool->newConnectionsQueue)};
+    int shared = 0;
+    for (uintptr_t w : pool_writes){
+        for (uintptr_t a : acceptor_touches){
+            if (w == a){
+                shared++;
+                break;
+            }
+        }
+    }
+    return shared;
+}
+
+struct LayoutResult{
+	double ns_alone = 0, ns_contended = 0;
+	double cycles_alone = 0, cycles_contended = 0;
+	unsigned long long acceptor_ops = 0;
+	int shared_lines = 0;
+};
+
+template<class C, class P>
+static void timeEvents(std::vector<C *> &clients, P *pool, const std::vector<int> &order, unsigned long long events,
+                       bool contended, int pool_core, int acceptor_core, LayoutResult &result){
+    std::atomic<bool> stop = false;
+    std::atomic<unsigned long long> acceptor_ops = 0;
+    std::thread acceptor;
+    if (contended){
+        acceptor = std::thread([&](){
+            pinThread(acceptor_core);
+            unsigned long long ops = 0;
+            size_t scan = 0;
+            int picked = 0;
+            while (!stop.load(std::memory_order_relaxed)){
+                // Pick a pool for the next connection (getConnectionPool())
+                picked += pool->size.load(std::memory_order_relaxed) + (pool->newConnectionsQueue != nullptr);
+                picked += acceptorTouch(clients[scan], ops);
+                if (++scan == clients.size()) scan = 0;
+                ops++;
+            }
+            acceptor_ops = ops;
+            if (picked == -1) printf("\n");
+        });
+        // Let the acceptor thread get going
+        sleepForMS(10);
+    }
+
+    pinThread(pool_core);
+    int sink = 0;
+    unsigned long long start_us = getMonotonicTimeUS(), start_cycles = readCycleCounter();
+    size_t next = 0;
+    for (unsigned long long i = 0; i < events; i++){
+        C *c = clients[order[next]];
+        if (++next == order.size()) next = 0;
+        sink += poolEvent(c, pool, c->client_socket);
+        // A batch is at most num_epoll_events long
+        if ((i & 15) == 15) pool->arena.reset();
+    }
+    unsigned long long cycles = readCycleCounter() - start_cycles;
+    unsigned long long ns = (getMonotonicTimeUS() - start_us) * 1000;
+    stop = true;
+    if (acceptor.joinable()) acceptor.join();
+    if (sink == -1) printf("\n");
+
+    if (contended){
+        result.ns_contended = (double)ns / events;
+        result.cycles_contended = (double)cycles / events;
+        result.acceptor_ops = acceptor_ops;
+    }
+    else {
+        result.ns_alone = (double)ns / events;
+        result.cycles_alone = (double)cycles / events;
+    }
+}
+
+template<class C, class P>
+static LayoutResult runLayout(const char *name, std::vector<C *> &clients, P *pool, const std::vector<int> &order,
+                              unsigned long long events, int pool_core, int acceptor_core){
+    LayoutResult result;
+    result.shared_lines = sharedLines(clients[0], pool);
+    timeEvents(clients, pool, order, events, false, pool_core, acceptor_core, result);
+    timeEvents(clients, pool, order, events, true, pool_core, acceptor_core, result);
+    printf("%-8s %4d bytes/client  %d shared line(s)/event  alone %7.2f ns %7.1f cycles  with acceptor %7.2f ns %7.1f cycles  (+%.2f ns)\n",
+        name, (int)sizeof(C), result.shared_lines, result.ns_alone, result.cycles_alone, result.ns_contended, result.cycles_contended,
+        result.ns_contended - result.ns_alone);
+    return result;
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    int num_clients = (int)args.getInt("clients", 10000);
+    unsigned long long events = args.getInt("events", 20000000);
+    int pool_core = (int)args.getInt("pool-core", -1);
+    int acceptor_core = (int)args.getInt("acceptor-core", -1);
+    if (num_clients < 1) num_clients = 1;
+    if (!initSockets()) return 1;
+
+    // Same random event order for both layouts
+    std::vector<int> order(1 << 20);
+    std::mt19937 rng(12345);
+    for (int &o : order) o = (int)(rng() % num_clients);
+
+    LegacyPool *legacy_pool = new LegacyPool();
+    std::vector<LegacyClient> legacy_storage(num_clients);
+    std::vector<LegacyClient *> legacy_clients;
+    for (int i = 0; i < num_clients; i++){
+        LegacyClient *c = &legacy_storage[i];
+        c->client_socket = (SOCKET)(i + 1);
+        c->client_id = i;
+        c->referenceCount = 1;
+        legacy_clients.push_back(c);
+    }
+
+    ConnectionPool *pool = new ConnectionPool(0, "cache_layout");
+    ClientSlab slab(num_clients);
+    std::vector<Client *> clients;
+    for (int i = 0; i < num_clients; i++){
+        Client *c = slab.create((SOCKET)(i + 1), nullptr, i);
+        clients.push_back(c);
+    }
+
+    LayoutResult legacy = runLayout("legacy", legacy_clients, legacy_pool, order, events, pool_core, acceptor_core);
+    LayoutResult current = runLayout("current", clients, pool, order, events, pool_core, acceptor_core);
+
+    std::string details;
+    appendf(details, "{\"benchmark\":\"cache_layout\",\"clients\":%d,\"events\":%llu,", num_clients, events);
+    appendf(details, "\"legacy\":{\"client_bytes\":%d,\"shared_lines_per_event\":%d,\"ns_alone\":%.3f,\"ns_contended\":%.3f,\"cycles_alone\":%.1f,\"cycles_contended\":%.1f,\"acceptor_ops\":%llu},",
+        (int)sizeof(LegacyClient), legacy.shared_lines, legacy.ns_alone, legacy.ns_contended, legacy.cycles_alone, legacy.cycles_contended, legacy.acceptor_ops);
+    appendf(details, "\"current\":{\"client_bytes\":%d,\"shared_lines_per_event\":%d,\"ns_alone\":%.3f,\"ns_contended\":%.3f,\"cycles_alone\":%.1f,\"cycles_contended\":%.1f,\"acceptor_ops\":%llu}}",
+        (int)sizeof(Client), current.shared_lines, current.ns_alone, current.ns_contended, current.cycles_alone, current.cycles_contended, current.acceptor_ops);
+    printf("%s\n", details.c_str());
+
+    BenchReport report("cache_layout", args);
+    report.addMetric("shared_lines_per_event", current.shared_lines, "lines", false, 0);
+    report.addMetric("ns_per_event_contended", current.ns_contended, "ns", false, 0.10);
+    report.addMetric("contention_ns_per_event", current.ns_contended - current.ns_alone, "ns", false, 0.25);
+    report.addMetric("legacy_contention_ns_per_event", legacy.ns_contended - legacy.ns_alone, "ns", false, 0.25);
+    report.addMetric("client_bytes", sizeof(Client), "bytes", false, 0);
+    report.setDetails(details);
+    report.write();
+
+    for (Client *c : clients) slab.destroy(c);
+    delete pool;
+    delete legacy_pool;
+    return 0;
+}
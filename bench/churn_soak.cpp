@@ -0,0 +1,342 @@
+/*  Connection churn soak test.
+    Runs a TcpConnectionAcceptor with an echo handler in process while --threads threads connect, send
+    --packets packets, check the echoes and disconnect, over and over for --duration seconds.
+    Connections end in one of three ways:
+        reset           the client closes abortively (SO_LINGER 0), most connections, avoids TIME_WAIT
+        graceful        the client shuts down its side and closes (--graceful-percent)
+        server close    the handler calls Client::close() after the last echo (--server-close-percent)
+
+    Every --sample-s seconds it records RSS, open handles (sockets included), live Client objects
+    (Client::live_count) and clients registered with the pools. After --warmup-s the growth of each is
+    taken from a least squares fit over the samples and has to stay below
+        --max-rss-growth-mb     (default 16)
+        --max-handle-growth     (default 64)
+        --max-client-growth     (default 256)
+    After the churn stops every client must leave the pools and every Client must be deleted within
+    --drain-s seconds (a pool frees the clients it retired at the latest when its epoll_wait times out),
+    and the handle count has to be back near where it started. Exits with 1 if any check fails.
+
+    Pools register new connections when they wake up, an idle pool sleeps up to 500 ms in epoll_wait,
+    so the connect rate grows with --threads as busier pools wake more often.
+    Sustained graceful closes leave client ports in TIME_WAIT, use --source-ips to spread clients over
+    127.0.0.x source addresses when connects start failing.
+
+    Usage:
+        churn_soak --duration 14400 --threads 64 --pools 4 --packets 4 --size 64 --rate 0 --port 5004
+    --rate limits connects per second over all threads (0 = as fast as possible).
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+    Build:
+        cl /O2 /EHsc /std:c++17 bench\churn_soak.cpp src\TcpConnectionAcceptor.cpp src\TcpConnectionPool.cpp src\client.cpp
+           src\HandlerWatchdog.cpp src\TopKSketch.cpp src\RequestTracer.cpp src\BufferPool.cpp src\EpochReclaimer.cpp src\HugePages.cpp src\Numa.cpp src\SharedPayload.cpp src\PacketPool.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib advapi32.lib
+*/
+
+#include "bench_common.h"
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/client.h"
+
+#include <thread>
+#include <atomic>
+
+
+// First payload byte asking the server to close the connection after echoing
+static const char server_close_marker = 'C';
+
+static void echoOrClose(Client *client, Packet *packet){
+    echoPacket(client, packet);
+    if (packet->data[0] == server_close_marker) client->close();
+}
+
+struct SoakOptions{
+	const char *ip;
+	int port;
+	int threads;
+	int packets;
+	int size;
+	double rate;
+	int graceful_percent;
+	int server_close_percent;
+	int source_ips;
+};
+
+struct SoakCounters{
+	std::atomic<unsigned long long> connections = 0;
+	std::atomic<unsigned long long> connect_failures = 0;
+	std::atomic<unsigned long long> timeouts = 0;
+	std::atomic<unsigned long long> wrong_echoes = 0;
+	std::atomic<bool> stop = false;
+};
+
+struct SoakSample{
+	double t_s = 0;
+	double rss = 0;
+	double handles = 0;
+	double live_clients = 0;
+	double registered = 0;
+	unsigned long long connections = 0;
+};
+
+// Returns 1 when len bytes were read, 0 on EOF, -1 on timeout or error
+static int recvAll(SOCKET s, char *buffer, int len){
+    while (len > 0){
+        int n = recv(s, buffer, len, 0);
+        if (n == 0) return 0;
+        if (n < 0) return -1;
+        buffer += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void churnThread(int index, const SoakOptions *options, SoakCounters *counters){
+    std::mt19937_64 rng(index + 1);
+    std::vector<char> request(packet_header_size + options->size), reply(request.size());
+    double interval_us = options->rate > 0 ? options->threads * 1e6 / options->rate : 0;
+    double next_us = (double)getMonotonicTimeUS();
+    char source_ip[32];
+    unsigned long long sequence = 0;
+
+    while (!counters->stop){
+        if (interval_us > 0){
+            next_us += interval_us;
+            double now = (double)getMonotonicTimeUS();
+            if (next_us > now) std::this_thread::sleep_for(std::chrono::microseconds((long long)(next_us - now)));
+        }
+        snprintf(source_ip, sizeof(source_ip), "127.0.0.%d", 1 + (int)(sequence++ % options->source_ips));
+        SOCKET s = connectFrom(source_ip, options->ip, options->port);
+        if (s == INVALID_SOCKET){
+            counters->connect_failures++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        DWORD timeout_ms = 5000;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(timeout_ms));
+        int val = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(int));
+
+        int ending = (int)(rng() % 100);
+        bool server_close = ending < options->server_close_percent;
+        bool graceful = !server_close && ending < options->server_close_percent + options->graceful_percent;
+
+        bool ok = true;
+        for (int p = 0; p < options->packets && ok; p++){
+            writePacketHeader(request.data(), options->size);
+            for (int i = 0; i < options->size; i++) request[packet_header_size + i] = (char)('a' + (sequence + p + i) % 26);
+            if (server_close && p == options->packets - 1) request[packet_header_size] = server_close_marker;
+
+            if (send(s, request.data(), (int)request.size(), 0) != (int)request.size()){
+                counters->timeouts++;
+                ok = false;
+                break;
+            }
+            int r = recvAll(s, reply.data(), (int)reply.size());
+            if (r <= 0){
+                counters->timeouts++;
+                ok = false;
+            }
+            else if (memcmp(reply.data(), request.data(), request.size()) != 0){
+                counters->wrong_echoes++;
+                ok = false;
+            }
+        }
+
+        if (ok && server_close){
+            // The server closes first, wait for its FIN
+            char byte;
+            if (recv(s, &byte, 1, 0) != 0) counters->timeouts++;
+            closesocket(s);
+        }
+        else if (ok && graceful){
+            shutdown(s, SD_SEND);
+            closesocket(s);
+        }
+        else {
+            struct linger abortive;
+            abortive.l_onoff = 1;
+            abortive.l_linger = 0;
+            setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&abortive, sizeof(abortive));
+            closesocket(s);
+        }
+        if (ok) counters->connections++;
+    }
+}
+
+static int registeredClients(TcpConnectionAcceptor *acceptor){
+    int registered = 0;
+    for (const PoolStats &s : acceptor->getPoolStats()) registered += s.size;
+    return registered;
+}
+
+static SoakSample takeSample(TcpConnectionAcceptor *acceptor, const SoakCounters &counters, unsigned long long start_us){
+    SoakSample s;
+    s.t_s = (getMonotonicTimeUS() - start_us) / 1e6;
+    s.rss = (double)getProcessRSS();
+    s.handles = (double)getProcessHandleCount();
+    s.live_clients = Client::live_count.load(std::memory_order_relaxed);
+    s.registered = registeredClients(acceptor);
+    s.connections = counters.connections;
+    return s;
+}
+
+// Growth of field over the sampled time, from the least squares slope. Less sensitive to a single noisy sample than last - first.
+static double fittedGrowth(const std::vector<SoakSample> &samples, double SoakSample::*field){
+    if (samples.size() < 2) return 0;
+    double n = (double)samples.size(), sum_t = 0, sum_v = 0, sum_tt = 0, sum_tv = 0;
+    for (const SoakSample &s : samples){
+        sum_t += s.t_s;
+        sum_v += s.*field;
+        sum_tt += s.t_s * s.t_s;
+        sum_tv += s.t_s * s.*field;
+    }
+    double denominator = n * sum_tt - sum_t * sum_t;
+    if (denominator <= 0) return 0;
+    double slope = (n * sum_tv - sum_t * sum_v) / denominator;
+    return slope * (samples.back().t_s - samples.front().t_s);
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    SoakOptions options;
+    options.ip = args.getString("ip", "127.0.0.1");
+    options.port = (int)args.getInt("port", 5004);
+    options.threads = (int)args.getInt("threads", 64);
+    options.packets = (int)args.getInt("packets", 4);
+    options.size = (int)args.getInt("size", 64);
+    options.rate = args.getDouble("rate", 0);
+    options.graceful_percent = (int)args.getInt("graceful-percent", 5);
+    options.server_close_percent = (int)args.getInt("server-close-percent", 10);
+    options.source_ips = (int)args.getInt("source-ips", 1);
+    int pools = (int)args.getInt("pools", 4);
+    double duration_s = args.getDouble("duration", 3600);
+    double warmup_s = args.getDouble("warmup-s", 60);
+    double sample_s = args.getDouble("sample-s", 10);
+    double drain_s = args.getDouble("drain-s", 20);
+    double max_rss_growth = args.getDouble("max-rss-growth-mb", 16) * 1024 * 1024;
+    double max_handle_growth = args.getDouble("max-handle-growth", 64);
+    double max_client_growth = args.getDouble("max-client-growth", 256);
+    if (options.threads < 1) options.threads = 1;
+    if (options.packets < 1) options.packets = 1;
+    if (options.size < 1) options.size = 1;
+    if (options.size > max_packet_size) options.size = max_packet_size;
+    if (options.source_ips < 1) options.source_ips = 1;
+    if (sample_s <= 0) sample_s = 10;
+
+    if (!initSockets()) return 1;
+
+    TcpConnectionAcceptor *acceptor = new TcpConnectionAcceptor(echoOrClose, options.ip, options.port, pools);
+    std::thread acceptor_thread(&TcpConnectionAcceptor::serveForever, acceptor);
+    acceptor_thread.detach();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    unsigned long long base_handles = getProcessHandleCount();
+
+    SoakCounters counters;
+    std::vector<std::thread> threads;
+    unsigned long long start_us = getMonotonicTimeUS();
+    for (int i = 0; i < options.threads; i++) threads.emplace_back(churnThread, i, &options, &counters);
+
+    // The server logs every connection, progress goes to stderr
+    std::vector<SoakSample> samples;
+    double rss_max = 0, clients_max = 0;
+    double next_sample_s = sample_s;
+    while (true){
+        double now_s = (getMonotonicTimeUS() - start_us) / 1e6;
+        if (now_s >= duration_s) break;
+        if (now_s < next_sample_s){
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        next_sample_s += sample_s;
+        SoakSample s = takeSample(acceptor, counters, start_us);
+        if (s.rss > rss_max) rss_max = s.rss;
+        if (s.live_clients > clients_max) clients_max = s.live_clients;
+        if (s.t_s >= warmup_s) samples.push_back(s);
+        fprintf(stderr, "[soak %6.0f s] %llu connections, rss %.1f MB, %.0f handles, %.0f live clients, %.0f registered, %llu connect failures, %llu timeouts\n",
+            s.t_s, s.connections, s.rss / (1024*1024), s.handles, s.live_clients, s.registered,
+            (unsigned long long)counters.connect_failures, (unsigned long long)counters.timeouts);
+    }
+
+    counters.stop = true;
+    for (std::thread &t : threads) t.join();
+    double elapsed_s = (getMonotonicTimeUS() - start_us) / 1e6;
+
+    // Every connection is closed, the server has to let go of all of them
+    unsigned long long drain_deadline = getMonotonicTimeUS() + (unsigned long long)(drain_s * 1e6);
+    while (getMonotonicTimeUS() < drain_deadline){
+        if (registeredClients(acceptor) == 0 && Client::live_count == 0) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    int registered_after = registeredClients(acceptor);
+    int clients_after = Client::live_count;
+    long long handles_after = (long long)getProcessHandleCount() - (long long)base_handles;
+
+    double rss_growth = fittedGrowth(samples, &SoakSample::rss);
+    double handle_growth = fittedGrowth(samples, &SoakSample::handles);
+    double client_growth = fittedGrowth(samples, &SoakSample::live_clients);
+    double connections_per_s = counters.connections / (elapsed_s > 0 ? elapsed_s : 1);
+
+    std::vector<std::string> failures;
+    char message[256];
+    if (samples.size() < 3){
+        failures.push_back("fewer than 3 samples after warmup, run longer or sample more often");
+    }
+    if (rss_growth > max_rss_growth){
+        snprintf(message, sizeof(message), "rss grew %.1f MB (limit %.1f MB)", rss_growth / (1024*1024), max_rss_growth / (1024*1024));
+        failures.push_back(message);
+    }
+    if (handle_growth > max_handle_growth){
+        snprintf(message, sizeof(message), "handle count grew by %.0f (limit %.0f)", handle_growth, max_handle_growth);
+        failures.push_back(message);
+    }
+    if (client_growth > max_client_growth){
+        snprintf(message, sizeof(message), "live Clients grew by %.0f (limit %.0f)", client_growth, max_client_growth);
+        failures.push_back(message);
+    }
+    if (registered_after != 0 || clients_after != 0){
+        snprintf(message, sizeof(message), "%d clients still registered and %d Clients alive %.0f s after the last disconnect", registered_after, clients_after, drain_s);
+        failures.push_back(message);
+    }
+    if (handles_after > max_handle_growth){
+        snprintf(message, sizeof(message), "%lld more handles open than before the soak", handles_after);
+        failures.push_back(message);
+    }
+    if (counters.wrong_echoes > 0){
+        snprintf(message, sizeof(message), "%llu wrong echoes", (unsigned long long)counters.wrong_echoes);
+        failures.push_back(message);
+    }
+    if (counters.connections == 0) failures.push_back("no connection completed");
+
+    std::string details;
+    appendf(details, "{\"benchmark\":\"churn_soak\",\"duration_s\":%.1f,\"connections\":%llu,\"connections_per_s\":%.1f,",
+        elapsed_s, (unsigned long long)counters.connections, connections_per_s);
+    appendf(details, "\"connect_failures\":%llu,\"timeouts\":%llu,\"wrong_echoes\":%llu,",
+        (unsigned long long)counters.connect_failures, (unsigned long long)counters.timeouts, (unsigned long long)counters.wrong_echoes);
+    appendf(details, "\"growth\":{\"rss_bytes\":%.0f,\"handles\":%.1f,\"live_clients\":%.1f},", rss_growth, handle_growth, client_growth);
+    appendf(details, "\"rss_max_bytes\":%.0f,\"live_clients_max\":%.0f,", rss_max, clients_max);
+    appendf(details, "\"after_drain\":{\"registered\":%d,\"live_clients\":%d,\"handles_over_start\":%lld},", registered_after, clients_after, handles_after);
+    appendf(details, "\"samples\":[");
+    for (size_t i = 0; i < samples.size(); i++){
+        const SoakSample &s = samples[i];
+        appendf(details, "%s{\"t_s\":%.1f,\"rss\":%.0f,\"handles\":%.0f,\"live_clients\":%.0f,\"registered\":%.0f,\"connections\":%llu}",
+            i > 0 ? "," : "", s.t_s, s.rss, s.handles, s.live_clients, s.registered, s.connections);
+    }
+    appendf(details, "],\"failures\":[");
+    for (size_t i = 0; i < failures.size(); i++) appendf(details, "%s%s", i > 0 ? "," : "", jsonString(failures[i]).c_str());
+    appendf(details, "]}");
+
+    BenchReport report("churn_soak", args);
+    report.addMetric("connections_per_s", connections_per_s, "conn/s", true, 0.10);
+    report.addMetric("rss_growth_bytes", rss_growth, "bytes", false, 1.0);
+    report.addMetric("live_clients_max", clients_max, "clients", false, 0.50);
+    report.addMetric("clients_after_drain", clients_after, "clients", false, 0);
+    report.setDetails(details);
+    report.write();
+
+    fprintf(stderr, "%.0f s, %llu connections (%.0f/s): rss %+.1f MB, handles %+.0f, live Clients %+.0f after warmup; %d registered, %d Clients after drain\n",
+        elapsed_s, (unsigned long long)counters.connections, connections_per_s, rss_growth / (1024*1024), handle_growth, client_growth, registered_after, clients_after);
+    for (const std::string &f : failures) fprintf(stderr, "FAIL: %s\n", f.c_str());
+    if (failures.empty()) fprintf(stderr, "PASS\n");
+
+    fflush(stdout);
+    std::_Exit(failures.empty() ? 0 : 1);
+}
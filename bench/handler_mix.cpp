@@ -0,0 +1,398 @@
+/*  Synthetic handler cost workload.
+    Runs a TcpConnectionAcceptor in process with a handle_function that burns the CPU time and blocks for
+    as long as each request asks, and drives it with closed loop clients (one request in flight each).
+    Costs are drawn by the clients and carried in the request, so every reply can be attributed to the
+    client class and cost it had, whatever the server did with it.
+
+    Request cost (--cost, CPU microseconds spent spinning in the handler):
+        constant:US  uniform:MIN:MAX  exp:MEAN  bimodal:SMALL:LARGE:P_LARGE  pareto:MIN:ALPHA (heavy tailed)
+    capped at --max-cost-us. --block-p P --block-us US makes a share P of requests also sleep for US in
+    the handler, like a blocking call would. --heavy-percent of the clients form the heavy class whose
+    costs are multiplied by --heavy-factor, the rest is the light class.
+
+    Reports per class: throughput, latency percentiles, slowdown (latency / requested handler time),
+    and over all clients Jain's fairness index of the requests and of the handler time each client got
+    (1 when every client got the same, 1/n when one client got everything). Serving clients in turns
+    equalizes requests, sharing the CPU equally equalizes handler time; a light client stuck behind heavy
+    ones lowers both. The busy share of every pool over the measured window shows placement imbalance.
+
+    Usage:
+        handler_mix --connections 200 --threads 4 --pools 4 --cost pareto:20:1.5 --heavy-percent 10
+                    --heavy-factor 20 --block-p 0.001 --block-us 5000 --duration 10 --warmup 2 --port 5005
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+    Build:
+        cl /O2 /EHsc /std:c++17 bench\handler_mix.cpp src\TcpConnectionAcceptor.cpp src\TcpConnectionPool.cpp src\client.cpp
+           src\HandlerWatchdog.cpp src\TopKSketch.cpp src\RequestTracer.cpp src\BufferPool.cpp src\EpochReclaimer.cpp src\HugePages.cpp src\Numa.cpp src\SharedPayload.cpp src\PacketPool.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib advapi32.lib
+*/
+
+#include "bench_common.h"
+#include "../src/imports/wepoll/wepoll.h"
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/client.h"
+
+#include <thread>
+#include <atomic>
+#include <cmath>
+
+
+/* Request payload: send time (8 bytes), CPU cost in us (4), blocking time in us (4), client class (4).
+   The server echoes the payload unchanged. */
+static const int mix_payload_size = 20;
+
+enum ClientClass{ LIGHT, HEAVY, NUM_CLASSES };
+static const char *class_names[NUM_CLASSES] = {"light", "heavy"};
+
+static void syntheticHandler(Client *client, Packet *packet){
+    if (packet->size < mix_payload_size) return;
+    unsigned int cost_us, block_us;
+    memcpy(&cost_us, packet->data + 8, 4);
+    memcpy(&block_us, packet->data + 12, 4);
+
+    // Spin for the requested CPU time
+    unsigned long long end = getMonotonicTimeUS() + cost_us;
+    volatile unsigned long long spin = 0;
+    while (getMonotonicTimeUS() < end) spin++;
+    if (block_us > 0) std::this_thread::sleep_for(std::chrono::microseconds(block_us));
+
+    char reply[packet_header_size + mix_payload_size];
+    writePacketHeader(reply, mix_payload_size);
+    memcpy(reply + packet_header_size, packet->data, mix_payload_size);
+    client->send(reply, sizeof(reply));
+}
+
+
+/*  Handler CPU time in microseconds, given as
+        constant:US  uniform:MIN:MAX  exp:MEAN  bimodal:SMALL:LARGE:P_LARGE  pareto:MIN:ALPHA */
+class CostDistribution{
+public:
+	CostDistribution(const char *spec, double max_us){
+		this->spec = spec;
+		this->max_us = max_us;
+		if (sscanf(spec, "constant:%lf", &this->a) == 1) this->type = 0;
+		else if (sscanf(spec, "uniform:%lf:%lf", &this->a, &this->b) == 2) this->type = 1;
+		else if (sscanf(spec, "exp:%lf", &this->a) == 1) this->type = 2;
+		else if (sscanf(spec, "bimodal:%lf:%lf:%lf", &this->a, &this->b, &this->p) == 3) this->type = 3;
+		else if (sscanf(spec, "pareto:%lf:%lf", &this->a, &this->p) == 2 && this->p > 0) this->type = 4;
+		else {
+			printf("Invalid cost distribution '%s'\n", spec);
+			exit(1);
+		}
+	}
+	double sample(std::mt19937_64 &rng){
+		double cost = this->a;
+		if (this->type == 1) cost = std::uniform_real_distribution<double>(this->a, this->b)(rng);
+		else if (this->type == 2) cost = std::exponential_distribution<double>(1.0 / this->a)(rng);
+		else if (this->type == 3) cost = std::bernoulli_distribution(this->p)(rng) ? this->b : this->a;
+		else if (this->type == 4){
+			// Inverse transform, 1 - u is in (0, 1]
+			double u = std::uniform_real_distribution<double>(0, 1)(rng);
+			cost = this->a / pow(1 - u, 1 / this->p);
+		}
+		if (cost > this->max_us) cost = this->max_us;
+		return cost < 0 ? 0 : cost;
+	}
+
+	const char *spec;
+
+protected:
+	int type = 0;
+	double a = 0, b = 0, p = 0, max_us = 0;
+};
+
+struct MixConfig{
+	const char *ip;
+	int port;
+	int connections;
+	int threads;
+	const char *cost_spec;
+	double max_cost_us;
+	double heavy_factor;
+	int heavy_percent;
+	double block_p;
+	int block_us;
+	int duration_s;
+	int warmup_s;
+};
+
+struct MixConnection{
+	SOCKET socket = INVALID_SOCKET;
+	int client_class = LIGHT;
+	std::vector<char> in;
+	bool in_flight = false;
+	// Inside the measured window
+	unsigned long long requests = 0;
+	double service_us = 0;
+};
+
+struct ClassResult{
+	LatencyHistogram latency;
+	// Latency divided by requested handler time, in hundredths
+	LatencyHistogram slowdown;
+	unsigned long long requests = 0;
+	double service_us = 0;
+	int clients = 0;
+
+	void merge(const ClassResult &other){
+		this->latency.merge(other.latency);
+		this->slowdown.merge(other.slowdown);
+		this->requests += other.requests;
+		this->service_us += other.service_us;
+		this->clients += other.clients;
+	}
+};
+
+struct MixThreadResult{
+	ClassResult classes[NUM_CLASSES];
+	// Requests and handler time every client got in the measured window
+	std::vector<double> client_requests, client_service_us;
+	int errors = 0;
+};
+
+static bool sendRequest(MixConnection *c, const MixConfig *config, CostDistribution &costs, std::mt19937_64 &rng){
+    unsigned long long now = getMonotonicTimeUS();
+    double cost = costs.sample(rng) * (c->client_class == HEAVY ? config->heavy_factor : 1);
+    unsigned int cost_us = (unsigned int)(cost < config->max_cost_us ? cost : config->max_cost_us);
+    unsigned int block_us = config->block_p > 0 && std::bernoulli_distribution(config->block_p)(rng) ? config->block_us : 0;
+    unsigned int client_class = c->client_class;
+
+    char request[packet_header_size + mix_payload_size];
+    writePacketHeader(request, mix_payload_size);
+    memcpy(request + packet_header_size, &now, 8);
+    memcpy(request + packet_header_size + 8, &cost_us, 4);
+    memcpy(request + packet_header_size + 12, &block_us, 4);
+    memcpy(request + packet_header_size + 16, &client_class, 4);
+    // Small enough to always fit the empty send buffer of a connection with nothing in flight
+    if (send(c->socket, request, sizeof(request), 0) != (int)sizeof(request)) return false;
+    c->in_flight = true;
+    return true;
+}
+
+static int readReply(MixConnection *c, unsigned long long now, unsigned long long measure_start, unsigned long long measure_end, MixThreadResult *result){
+    /* Returns 1 when the reply is complete, 0 if more data is needed, -1 when the connection was lost */
+    char buffer[1024];
+    int n = recv(c->socket, buffer, sizeof(buffer), 0);
+    if (n <= 0){
+        if (n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return 0;
+        return -1;
+    }
+    c->in.insert(c->in.end(), buffer, buffer + n);
+    if (c->in.size() < (size_t)(packet_header_size + mix_payload_size)) return 0;
+
+    const char *payload = c->in.data() + packet_header_size;
+    unsigned long long sent_us;
+    unsigned int cost_us, block_us;
+    memcpy(&sent_us, payload, 8);
+    memcpy(&cost_us, payload + 8, 4);
+    memcpy(&block_us, payload + 12, 4);
+    c->in.erase(c->in.begin(), c->in.begin() + packet_header_size + mix_payload_size);
+    c->in_flight = false;
+
+    if (sent_us >= measure_start && sent_us < measure_end){
+        unsigned long long latency = now > sent_us ? now - sent_us : 0;
+        unsigned long long requested = cost_us + block_us > 0 ? cost_us + block_us : 1;
+        ClassResult &r = result->classes[c->client_class];
+        r.latency.record(latency);
+        r.slowdown.record(latency * 100 / requested);
+        r.requests++;
+        r.service_us += cost_us + block_us;
+        c->requests++;
+        c->service_us += cost_us + block_us;
+    }
+    return 1;
+}
+
+static void runWorker(int thread_idx, const MixConfig *config, std::vector<MixConnection> connections, std::atomic<unsigned long long> *start_us, MixThreadResult *result){
+    std::mt19937_64 rng(4242 + thread_idx);
+    CostDistribution costs(config->cost_spec, config->max_cost_us);
+
+    HANDLE ep = epoll_create(1);
+    for (MixConnection &c : connections){
+        setNonBlocking(c.socket);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &c;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.socket, &event);
+        result->classes[c.client_class].clients++;
+    }
+    while (start_us->load() == 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    unsigned long long measure_start = start_us->load() + (unsigned long long)config->warmup_s * 1000000;
+    unsigned long long end = measure_start + (unsigned long long)config->duration_s * 1000000;
+    for (MixConnection &c : connections){
+        if (c.socket != INVALID_SOCKET && !sendRequest(&c, config, costs, rng)) result->errors++;
+    }
+
+    const int max_events = 256;
+    struct epoll_event events[max_events];
+    unsigned long long now = getMonotonicTimeUS();
+    while (now < end){
+        int eventCount = epoll_wait(ep, events, max_events, 10);
+        now = getMonotonicTimeUS();
+        for (int i = 0; i < eventCount; i++){
+            MixConnection *c = (MixConnection *)events[i].data.ptr;
+            if (c->socket == INVALID_SOCKET) continue;
+            int r = readReply(c, now, measure_start, end, result);
+            if (r == 1 && !sendRequest(c, config, costs, rng)) r = -1;
+            if (r < 0){
+                // Lost, stop using it
+                result->errors++;
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->socket, nullptr);
+                closesocket(c->socket);
+                c->socket = INVALID_SOCKET;
+            }
+        }
+    }
+
+    for (MixConnection &c : connections){
+        result->client_requests.push_back((double)c.requests);
+        result->client_service_us.push_back(c.service_us);
+        if (c.socket != INVALID_SOCKET) closesocket(c.socket);
+    }
+    epoll_close(ep);
+}
+
+// Jain's fairness index: 1 when all values are equal, 1/n when one gets everything
+static double jainIndex(const std::vector<double> &values){
+    double sum = 0, sum_squares = 0;
+    for (double v : values){
+        sum += v;
+        sum_squares += v * v;
+    }
+    return sum_squares > 0 ? sum * sum / (values.size() * sum_squares) : 1;
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    MixConfig config;
+    config.ip = args.getString("ip", "127.0.0.1");
+    config.port = (int)args.getInt("port", 5005);
+    config.connections = (int)args.getInt("connections", 200);
+    config.threads = (int)args.getInt("threads", 4);
+    config.cost_spec = args.getString("cost", "exp:50");
+    config.max_cost_us = args.getDouble("max-cost-us", 100000);
+    config.heavy_factor = args.getDouble("heavy-factor", 10);
+    config.heavy_percent = (int)args.getInt("heavy-percent", 10);
+    config.block_p = args.getDouble("block-p", 0);
+    config.block_us = (int)args.getInt("block-us", 1000);
+    config.duration_s = (int)args.getInt("duration", 10);
+    config.warmup_s = (int)args.getInt("warmup", 2);
+    int pools = (int)args.getInt("pools", 4);
+    if (config.threads < 1) config.threads = 1;
+    if (config.duration_s < 1) config.duration_s = 1;
+    CostDistribution check(config.cost_spec, config.max_cost_us);
+
+    if (!initSockets()) return 1;
+
+    TcpConnectionAcceptor *acceptor = new TcpConnectionAcceptor(syntheticHandler, config.ip, config.port, pools);
+    std::thread acceptor_thread(&TcpConnectionAcceptor::serveForever, acceptor);
+    acceptor_thread.detach();
+
+    // Connect in batches that the pools register before the next one, the handoff queues have a fixed size.
+    // Clients are dealt round robin to the threads, so every thread gets its share of heavy clients.
+    std::vector<std::vector<MixConnection>> thread_connections(config.threads);
+    int connected = 0, connect_failures = 0;
+    for (int i = 0; i < config.connections; i++){
+        MixConnection c;
+        c.client_class = (i % 100) < config.heavy_percent ? HEAVY : LIGHT;
+        c.socket = connectTo(config.ip, config.port);
+        if (c.socket == INVALID_SOCKET) connect_failures++;
+        else {
+            thread_connections[connected % config.threads].push_back(c);
+            connected++;
+        }
+        if (connected % 50 == 0 || i + 1 == config.connections){
+            if (!waitForClients(acceptor, connected, 5000)) printf("Not every client got registered with a pool\n");
+        }
+    }
+
+    std::atomic<unsigned long long> start_us = 0;
+    std::vector<MixThreadResult> results(config.threads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.threads; i++){
+        threads.emplace_back(runWorker, i, &config, thread_connections[i], &start_us, &results[i]);
+    }
+
+    printf("Mix: %d clients (%d%% heavy x%.1f) on %d threads, %d pools, cost %s us, block %.4f x %d us, %d s (+%d s warmup)\n",
+        config.connections, config.heavy_percent, config.heavy_factor, config.threads, pools, config.cost_spec,
+        config.block_p, config.block_us, config.duration_s, config.warmup_s);
+
+    start_us = getMonotonicTimeUS();
+    std::this_thread::sleep_for(std::chrono::seconds(config.warmup_s));
+    std::vector<PoolStats> pools_before = acceptor->getPoolStats();
+    std::this_thread::sleep_for(std::chrono::seconds(config.duration_s));
+    std::vector<PoolStats> pools_after = acceptor->getPoolStats();
+    for (std::thread &t : threads) t.join();
+
+    ClassResult classes[NUM_CLASSES];
+    std::vector<double> client_requests, client_service;
+    int errors = 0;
+    for (const MixThreadResult &r : results){
+        for (int k = 0; k < NUM_CLASSES; k++) classes[k].merge(r.classes[k]);
+        client_requests.insert(client_requests.end(), r.client_requests.begin(), r.client_requests.end());
+        client_service.insert(client_service.end(), r.client_service_us.begin(), r.client_service_us.end());
+        errors += r.errors;
+    }
+    double fairness_requests = jainIndex(client_requests);
+    double fairness_service = jainIndex(client_service);
+
+    BenchReport report("handler_mix", args);
+    std::string details = "{\"classes\":[";
+    unsigned long long total_requests = 0;
+    bool first = true;
+    for (int k = 0; k < NUM_CLASSES; k++){
+        const ClassResult &c = classes[k];
+        total_requests += c.requests;
+        if (c.clients == 0) continue;
+        double throughput = c.requests / (double)config.duration_s;
+        double share = c.service_us / (config.duration_s * 1e6);
+        printf("%-6s %4d clients: %.0f req/s (%.1f per client), handler time %.2f cores, mean cost %.1f us\n", class_names[k], c.clients,
+            throughput, throughput / c.clients, share, c.requests > 0 ? c.service_us / c.requests : 0);
+        printLatency("  latency", c.latency);
+        printf("  slowdown: p50 %.2f  p99 %.2f  p99.9 %.2f\n", c.slowdown.percentile(0.5) / 100.0, c.slowdown.percentile(0.99) / 100.0,
+            c.slowdown.percentile(0.999) / 100.0);
+
+        std::string name = class_names[k];
+        report.addMetric("throughput_rps_" + name, throughput, "req/s", true, 0.05);
+        report.addMetric("p99_us_" + name, (double)c.latency.percentile(0.99), "us", false, 0.15);
+        report.addMetric("p999_us_" + name, (double)c.latency.percentile(0.999), "us", false, 0.25);
+        report.addMetric("slowdown_p99_" + name, c.slowdown.percentile(0.99) / 100.0, "x", false, 0.15);
+        appendf(details, "%s{\"class\":\"%s\",\"clients\":%d,\"requests\":%llu,\"throughput_rps\":%.1f,\"handler_cores\":%.3f,"
+            "\"mean_us\":%.1f,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,\"slowdown_p50\":%.2f,\"slowdown_p99\":%.2f}",
+            first ? "" : ",", class_names[k], c.clients, c.requests, throughput, share, c.latency.mean(),
+            c.latency.percentile(0.5), c.latency.percentile(0.99), c.latency.percentile(0.999), c.latency.max,
+            c.slowdown.percentile(0.5) / 100.0, c.slowdown.percentile(0.99) / 100.0);
+        first = false;
+    }
+    details += "],\"pools\":[";
+
+    // Busy share of every pool over the measured window
+    double busy_sum = 0, busy_max = 0;
+    printf("pools:");
+    for (size_t i = 0; i < pools_after.size() && i < pools_before.size(); i++){
+        unsigned long long busy_us = (pools_after[i].process_us + pools_after[i].update_us) - (pools_before[i].process_us + pools_before[i].update_us);
+        double busy = busy_us / (config.duration_s * 1e6);
+        busy_sum += busy;
+        if (busy > busy_max) busy_max = busy;
+        printf(" %d: %d clients %.0f%% busy%s", pools_after[i].id, pools_after[i].size, busy * 100, i + 1 < pools_after.size() ? "," : "\n");
+        appendf(details, "%s{\"id\":%d,\"clients\":%d,\"busy\":%.3f}", i > 0 ? "," : "", pools_after[i].id, pools_after[i].size, busy);
+    }
+    double busy_mean = pools_after.empty() ? 0 : busy_sum / pools_after.size();
+    double imbalance = busy_mean > 0 ? busy_max / busy_mean : 1;
+    printf("Throughput %.0f req/s, fairness (Jain) of requests %.3f and handler time %.3f per client, pool imbalance (max/mean busy) %.2f\n",
+        total_requests / (double)config.duration_s, fairness_requests, fairness_service, imbalance);
+    if (connect_failures > 0 || errors > 0) printf("Connect failures: %d  connection errors: %d\n", connect_failures, errors);
+
+    report.addMetric("throughput_rps", total_requests / (double)config.duration_s, "req/s", true, 0.05);
+    report.addMetric("fairness_requests", fairness_requests, "index", true, 0.02);
+    report.addMetric("fairness_handler_time", fairness_service, "index", true, 0.02);
+    report.addMetric("pool_imbalance", imbalance, "ratio", false, 0.05);
+    appendf(details, "],\"fairness_requests\":%.4f,\"fairness_handler_time\":%.4f,\"pool_imbalance\":%.3f,\"connect_failures\":%d,\"errors\":%d}",
+        fairness_requests, fairness_service, imbalance, connect_failures, errors);
+    report.setDetails(details);
+    report.write();
+
+    fflush(stdout);
+    std::_Exit(0);
+}
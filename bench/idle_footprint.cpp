@@ -0,0 +1,144 @@
+/*  Idle connection memory footprint benchmark (C100K).
+    Runs a TcpConnectionAcceptor in process, opens --connections idle clients and reports how much memory
+    each connection costs, then disconnects them all and reports how much memory was given back.
+
+    The breakdown per connection is
+        client_object     sizeof(Client), Clients are packed into preallocated slabs
+        registry          pool client lists
+        buffers           receive buffers held by pools (shared per pool or per client)
+        unattributed      rest of the RSS growth: heap overhead, wepoll per socket state, client side of the benchmark
+    and the kernel socket buffer limit (SO_RCVBUF + SO_SNDBUF) an idle socket may grow to, which is not part of RSS.
+
+    Connections are opened in batches of --batch and each batch waits until the pools registered it,
+    since the handoff queue to each pool has a fixed size. Use --source-ips to spread clients over
+    127.0.0.x source addresses when there aren't enough ephemeral ports for one.
+
+    --huge-pages 1 puts client slabs and buffer pools on huge pages (see src/HugePages.h). Large pages are
+    not part of the working set, the huge page memory is reported separately as huge_page_bytes.
+
+    Usage:
+        idle_footprint --connections 100000 --pools 4 --batch 50 --source-ips 4 --port 5002
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+*/
+
+#include "bench_common.h"
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/client.h"
+#include "../src/HugePages.h"
+
+#include <thread>
+
+
+static void ignore(Client *client, Packet *packet){}
+
+struct PoolTotals{
+	int clients = 0;
+	unsigned long long registry_bytes = 0;
+	unsigned long long buffer_bytes = 0;
+};
+
+static PoolTotals getPoolTotals(TcpConnectionAcceptor *acceptor){
+    PoolTotals totals;
+    for (const PoolStats &s : acceptor->getPoolStats()){
+        totals.clients += s.size;
+        totals.registry_bytes += s.registry_bytes;
+        totals.buffer_bytes += s.buffer_bytes + s.arena_bytes;
+    }
+    return totals;
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    const char *ip = args.getString("ip", "127.0.0.1");
+    int port = (int)args.getInt("port", 5002);
+    int connections = (int)args.getInt("connections", 100000);
+    int pools = (int)args.getInt("pools", 4);
+    int batch = (int)args.getInt("batch", 50);
+    int source_ips = (int)args.getInt("source-ips", 1);
+    bool huge_pages = args.getInt("huge-pages", 0) != 0;
+    if (batch < 1) batch = 1;
+    if (source_ips < 1) source_ips = 1;
+
+    if (!initSockets()) return 1;
+
+    // Room for every client up front, pages of the slabs only count once clients touch them
+    TcpConnectionAcceptor *acceptor = new TcpConnectionAcceptor(ignore, ip, port, pools, connections, huge_pages);
+    std::thread acceptor_thread(&TcpConnectionAcceptor::serveForever, acceptor);
+    acceptor_thread.detach();
+    // Let pools allocate their buffers before the baseline
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    PoolTotals base_pools = getPoolTotals(acceptor);
+    unsigned long long base_rss = getProcessRSS();
+
+    std::vector<SOCKET> sockets;
+    sockets.reserve(connections);
+    int failures = 0, registration_timeouts = 0;
+    char source_ip[32];
+    while ((int)sockets.size() + failures < connections){
+        int n = batch < connections - (int)sockets.size() - failures ? batch : connections - (int)sockets.size() - failures;
+        for (int i = 0; i < n; i++){
+            snprintf(source_ip, sizeof(source_ip), "127.0.0.%d", 1 + (int)(sockets.size() % source_ips));
+            SOCKET s = connectFrom(source_ip, ip, port);
+            if (s == INVALID_SOCKET) failures++;
+            else sockets.push_back(s);
+        }
+        if (!waitForClients(acceptor, (int)sockets.size(), 5000)) registration_timeouts++;
+    }
+
+    unsigned long long connected_rss = getProcessRSS();
+    PoolTotals connected_pools = getPoolTotals(acceptor);
+    HugePageStats huge = getHugePageStats();
+    int n = connected_pools.clients > 0 ? connected_pools.clients : 1;
+
+    // Slab slots have no allocator header or rounding
+    double client_object = (double)sizeof(Client);
+    double registry = (double)(connected_pools.registry_bytes - base_pools.registry_bytes) / n;
+    double buffers = (double)(connected_pools.buffer_bytes - base_pools.buffer_bytes) / n;
+    double rss = connected_rss > base_rss ? (double)(connected_rss - base_rss) / n : 0;
+    double unattributed = rss - client_object - registry - buffers;
+
+    int rcvbuf = 0, sndbuf = 0, optlen = sizeof(int);
+    if (!sockets.empty()){
+        getsockopt(sockets[0], SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf, &optlen);
+        optlen = sizeof(int);
+        getsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, (char *)&sndbuf, &optlen);
+    }
+
+    // Disconnect everyone and see what comes back
+    for (SOCKET s : sockets) closesocket(s);
+    bool drained = waitForClients(acceptor, 0, 10000);
+    unsigned long long disconnected_rss = getProcessRSS();
+    PoolTotals disconnected_pools = getPoolTotals(acceptor);
+    unsigned long long returned = connected_rss > disconnected_rss ? connected_rss - disconnected_rss : 0;
+    double returned_ratio = connected_rss > base_rss ? (double)returned / (connected_rss - base_rss) : 0;
+
+    std::string details;
+    appendf(details, "{\"benchmark\":\"idle_footprint\",\"connections\":%d,\"registered\":%d,\"connect_failures\":%d,\"registration_timeouts\":%d,",
+        connections, connected_pools.clients, failures, registration_timeouts);
+    appendf(details, "\"rss_base_bytes\":%llu,\"rss_connected_bytes\":%llu,\"rss_per_connection\":%.1f,", base_rss, connected_rss, rss);
+    appendf(details, "\"per_connection\":{\"client_object\":%.1f,\"registry\":%.1f,\"buffers\":%.1f,\"unattributed\":%.1f},",
+        client_object, registry, buffers, unattributed);
+    appendf(details, "\"kernel_socket_buffer_limit\":%d,", rcvbuf + sndbuf);
+    appendf(details, "\"huge_pages\":%s,\"huge_page_bytes\":%llu,\"huge_page_fallbacks\":%d,", huge.enabled ? "true" : "false",
+        (unsigned long long)(huge.huge_pages * huge.page_size), huge.fallbacks);
+    appendf(details, "\"rss_disconnected_bytes\":%llu,\"rss_returned_bytes\":%llu,\"rss_returned_ratio\":%.3f,",
+        disconnected_rss, returned, returned_ratio);
+    appendf(details, "\"clients_after_disconnect\":%d,\"drained\":%s}", disconnected_pools.clients, drained ? "true" : "false");
+    printf("%s\n", details.c_str());
+
+    BenchReport report("idle_footprint", args);
+    report.addMetric("bytes_per_connection", rss, "bytes", false, 0.05);
+    report.addMetric("client_object_bytes", client_object, "bytes", false, 0);
+    report.addMetric("registry_bytes_per_connection", registry, "bytes", false, 0.05);
+    report.addMetric("buffer_bytes_per_connection", buffers, "bytes", false, 0.05);
+    report.addMetric("rss_returned_ratio", returned_ratio, "ratio", true, 0.10);
+    report.addMetric("clients_after_disconnect", disconnected_pools.clients, "clients", false, 0);
+    report.setDetails(details);
+    report.write();
+
+    fflush(stdout);
+    std::_Exit(0);
+}
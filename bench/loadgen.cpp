@@ -0,0 +1,440 @@
+/*  Load generator.
+    Opens --connections connections spread over --threads threads, each thread running its own epoll loop,
+    and sends framed requests that the echo server (backend-server) returns.
+
+    Closed loop (--mode closed, default): every connection keeps --depth requests in flight and waits
+    --think-us after each reply before sending the next one.
+
+    Open loop (--mode open): requests are scheduled at a fixed arrival rate of --rate requests per second
+    (--arrival constant or poisson) over all connections, regardless of how fast replies come back.
+    Latency is measured from the intended send time, so a stalled server shows up as latency instead
+    of silently lowering the offered load (coordinated omission).
+    --sweep MIN:MAX:STEPS runs the open loop at STEPS rates between MIN and MAX on the same connections
+    and prints a latency versus throughput curve with the estimated saturation knee.
+
+    Usage:
+        loadgen --host 127.0.0.1 --port 5000 --connections 1000 --threads 4 --depth 1
+                --think-us 0 --size fixed:128 --duration 10 --warmup 2
+        loadgen --mode open --rate 50000 --arrival poisson --connections 1000 --threads 4
+        loadgen --mode open --sweep 10000:200000:20 --duration 5 --warmup 1
+    --json FILE writes the results in the common benchmark format (bench_common.h) for bench_compare.
+*/
+
+#include "bench_common.h"
+#include "../src/imports/wepoll/wepoll.h"
+
+#include <thread>
+#include <atomic>
+#include <queue>
+
+
+struct LoadConfig{
+	const char *host;
+	int port;
+	int connections;
+	int threads;
+	int depth;
+	int think_us;
+	const char *size_spec;
+	int duration_s;
+	int warmup_s;
+	bool open_loop;
+	bool poisson;
+	// Requests per second for each step, one step unless sweeping
+	std::vector<double> rates;
+};
+
+struct LoadConnection{
+	SOCKET socket = INVALID_SOCKET;
+	std::vector<char> out;
+	size_t out_offset = 0;
+	std::vector<char> in;
+	int in_flight = 0;
+	bool want_write = false;
+	bool dirty = false;
+};
+
+struct ThreadResult{
+	LatencyHistogram latency;
+	unsigned long long requests = 0;
+	// Requests per second of the measured window, by send time
+	std::vector<unsigned long long> per_second;
+	unsigned long long bytes = 0;
+	int connect_failures = 0;
+	int errors = 0;
+};
+
+// Next time a connection is allowed to send when think time is used
+struct ScheduledSend{
+	unsigned long long time_us;
+	LoadConnection *connection;
+	bool operator>(const ScheduledSend &other) const{ return this->time_us > other.time_us; }
+};
+
+// Steps are started by the main thread once every worker finished the previous one
+struct StepControl{
+	std::atomic<int> ready{0};
+	std::atomic<int> step{-1};
+	std::atomic<int> finished{0};
+};
+
+
+static void queueRequest(LoadConnection *c, SizeDistribution &sizes, std::mt19937_64 &rng, unsigned long long send_time_us){
+    int payload = sizes.sample(rng);
+    size_t offset = c->out.size();
+    c->out.resize(offset + packet_header_size + payload);
+    char *frame = c->out.data() + offset;
+    writePacketHeader(frame, payload);
+    memcpy(frame + packet_header_size, &send_time_us, sizeof(send_time_us));
+    c->in_flight++;
+}
+
+static bool flush(HANDLE ep, LoadConnection *c){
+    /* Sends as much of the output buffer as the socket accepts. Returns false on socket error. */
+    while (c->out_offset < c->out.size()){
+        int n = send(c->socket, c->out.data() + c->out_offset, (int)(c->out.size() - c->out_offset), 0);
+        if (n == SOCKET_ERROR){
+            if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+            break;
+        }
+        c->out_offset += n;
+    }
+    if (c->out_offset == c->out.size()){
+        c->out.clear();
+        c->out_offset = 0;
+    }
+
+    // Only ask for EPOLLOUT while there is pending output
+    bool want_write = !c->out.empty();
+    if (want_write != c->want_write){
+        struct epoll_event event;
+        event.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+        event.data.ptr = c;
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->socket, &event);
+        c->want_write = want_write;
+    }
+    return true;
+}
+
+static int readReplies(HANDLE ep, LoadConnection *c, unsigned long long now, unsigned long long measure_start, unsigned long long measure_end, ThreadResult *result){
+    /* Reads available data and records every complete reply sent inside the measured window.
+       Returns number of replies, or -1 when the connection was lost. */
+    char buffer[65536];
+    int n = recv(c->socket, buffer, sizeof(buffer), 0);
+    if (n <= 0){
+        if (n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return 0;
+        // Server closed the connection, stop using it
+        result->errors++;
+        epoll_ctl(ep, EPOLL_CTL_DEL, c->socket, nullptr);
+        closesocket(c->socket);
+        c->socket = INVALID_SOCKET;
+        c->in_flight = 0;
+        return -1;
+    }
+    c->in.insert(c->in.end(), buffer, buffer + n);
+
+    size_t offset = 0;
+    int replies = 0;
+    while (c->in.size() - offset >= (size_t)packet_header_size){
+        unsigned int payload = readPacketHeader(c->in.data() + offset);
+        if (c->in.size() - offset < packet_header_size + payload) break;
+        unsigned long long sent_us;
+        memcpy(&sent_us, c->in.data() + offset + packet_header_size, sizeof(sent_us));
+        if (sent_us >= measure_start && sent_us < measure_end){
+            result->latency.record(now > sent_us ? now - sent_us : 0);
+            result->requests++;
+            size_t second = (size_t)((sent_us - measure_start) / 1000000);
+            if (second >= result->per_second.size()) result->per_second.resize(second + 1, 0);
+            result->per_second[second]++;
+            result->bytes += packet_header_size + payload;
+        }
+        offset += packet_header_size + payload;
+        c->in_flight--;
+        replies++;
+    }
+    c->in.erase(c->in.begin(), c->in.begin() + offset);
+    return replies;
+}
+
+static void runStep(HANDLE ep, std::vector<LoadConnection> &connections, const LoadConfig *config, double thread_rate,
+                    SizeDistribution &sizes, std::mt19937_64 &rng, ThreadResult *result){
+    std::priority_queue<ScheduledSend, std::vector<ScheduledSend>, std::greater<ScheduledSend>> scheduled;
+    std::vector<LoadConnection *> dirty;
+    const int max_events = 256;
+    struct epoll_event events[max_events];
+
+    unsigned long long begin = getMonotonicTimeUS();
+    unsigned long long measure_start = begin + (unsigned long long)config->warmup_s * 1000000;
+    unsigned long long end = measure_start + (unsigned long long)config->duration_s * 1000000;
+
+    // Open loop arrivals, spread round robin over this thread's connections
+    double interval_us = thread_rate > 0 ? 1e6 / thread_rate : 1e6;
+    std::exponential_distribution<double> poisson_gap(1.0 / interval_us);
+    double next_arrival = (double)begin;
+    size_t next_connection = 0;
+
+    if (!config->open_loop){
+        for (LoadConnection &c : connections){
+            if (c.socket == INVALID_SOCKET) continue;
+            for (int i = 0; i < config->depth; i++) queueRequest(&c, sizes, rng, begin);
+            if (!flush(ep, &c)) result->errors++;
+        }
+    }
+
+    unsigned long long now = begin;
+    while (now < end){
+        if (config->open_loop){
+            // Send everything that was due, stamped with its intended send time
+            while (next_arrival <= (double)now){
+                LoadConnection *c = nullptr;
+                for (size_t tries = 0; tries < connections.size() && c == nullptr; tries++){
+                    LoadConnection *candidate = &connections[next_connection];
+                    next_connection = (next_connection + 1) % connections.size();
+                    if (candidate->socket != INVALID_SOCKET) c = candidate;
+                }
+                if (c == nullptr) break;
+                queueRequest(c, sizes, rng, (unsigned long long)next_arrival);
+                if (!c->dirty){
+                    c->dirty = true;
+                    dirty.push_back(c);
+                }
+                next_arrival += config->poisson ? poisson_gap(rng) : interval_us;
+            }
+            for (LoadConnection *c : dirty){
+                c->dirty = false;
+                if (!flush(ep, c)) result->errors++;
+            }
+            dirty.clear();
+        }
+        else {
+            // Send requests whose think time has passed
+            while (!scheduled.empty() && scheduled.top().time_us <= now){
+                LoadConnection *c = scheduled.top().connection;
+                scheduled.pop();
+                if (c->socket == INVALID_SOCKET) continue;
+                queueRequest(c, sizes, rng, now);
+                if (!flush(ep, c)) result->errors++;
+            }
+        }
+
+        int timeout_ms = scheduled.empty() ? 10 : 1;
+        if (config->open_loop){
+            // Busy poll when the next arrival is less than a millisecond away
+            double until_next = next_arrival - (double)now;
+            timeout_ms = until_next >= 1000 ? (int)(until_next / 1000) : 0;
+            if (timeout_ms > 10) timeout_ms = 10;
+        }
+        int eventCount = epoll_wait(ep, events, max_events, timeout_ms);
+        now = getMonotonicTimeUS();
+
+        for (int i = 0; i < eventCount; i++){
+            LoadConnection *c = (LoadConnection *)events[i].data.ptr;
+            if (c->socket == INVALID_SOCKET) continue;
+            if (events[i].events & EPOLLOUT){
+                if (!flush(ep, c)) result->errors++;
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+
+            int replies = readReplies(ep, c, now, measure_start, end, result);
+            if (replies <= 0 || config->open_loop) continue;
+
+            // Closed loop: every reply allows one new request
+            for (int r = 0; r < replies; r++){
+                if (config->think_us > 0){
+                    ScheduledSend s;
+                    s.time_us = now + config->think_us;
+                    s.connection = c;
+                    scheduled.push(s);
+                }
+                else queueRequest(c, sizes, rng, now);
+            }
+            if (config->think_us <= 0 && !flush(ep, c)) result->errors++;
+        }
+    }
+
+    // Drain replies still in flight so the next step starts from idle connections
+    unsigned long long drain_deadline = now + 2000000;
+    while (now < drain_deadline){
+        bool idle = true;
+        for (LoadConnection &c : connections){
+            if (c.socket != INVALID_SOCKET && (c.in_flight > 0 || !c.out.empty())) idle = false;
+        }
+        if (idle) break;
+        int eventCount = epoll_wait(ep, events, max_events, 10);
+        now = getMonotonicTimeUS();
+        for (int i = 0; i < eventCount; i++){
+            LoadConnection *c = (LoadConnection *)events[i].data.ptr;
+            if (c->socket == INVALID_SOCKET) continue;
+            if (events[i].events & EPOLLOUT) flush(ep, c);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readReplies(ep, c, now, measure_start, end, result);
+        }
+    }
+}
+
+static void runWorker(int thread_idx, const LoadConfig *config, StepControl *control, std::vector<ThreadResult> *results){
+    int count = config->connections / config->threads + (thread_idx < config->connections % config->threads ? 1 : 0);
+    std::mt19937_64 rng(12345 + thread_idx);
+    SizeDistribution sizes(config->size_spec);
+    std::vector<LoadConnection> connections(count);
+
+    HANDLE ep = epoll_create(1);
+    for (LoadConnection &c : connections){
+        c.socket = connectTo(config->host, config->port);
+        if (c.socket == INVALID_SOCKET){
+            (*results)[0].connect_failures++;
+            continue;
+        }
+        setNonBlocking(c.socket);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &c;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.socket, &event);
+    }
+    control->ready++;
+
+    for (int step = 0; step < (int)config->rates.size(); step++){
+        while (control->step.load() < step) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        runStep(ep, connections, config, config->rates[step] / config->threads, sizes, rng, &(*results)[step]);
+        control->finished++;
+    }
+
+    for (LoadConnection &c : connections){
+        if (c.socket != INVALID_SOCKET) closesocket(c.socket);
+    }
+    epoll_close(ep);
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    LoadConfig config;
+    config.host = args.getString("host", "127.0.0.1");
+    config.port = (int)args.getInt("port", 5000);
+    config.connections = (int)args.getInt("connections", 100);
+    config.threads = (int)args.getInt("threads", 4);
+    config.depth = (int)args.getInt("depth", 1);
+    config.think_us = (int)args.getInt("think-us", 0);
+    config.size_spec = args.getString("size", "fixed:128");
+    config.duration_s = (int)args.getInt("duration", 10);
+    config.warmup_s = (int)args.getInt("warmup", 2);
+    config.open_loop = strcmp(args.getString("mode", "closed"), "open") == 0;
+    config.poisson = strcmp(args.getString("arrival", "poisson"), "poisson") == 0;
+    if (config.threads < 1) config.threads = 1;
+    if (config.depth < 1) config.depth = 1;
+
+    const char *sweep = args.getString("sweep", nullptr);
+    if (config.open_loop && sweep != nullptr){
+        double min_rate, max_rate;
+        int steps;
+        if (sscanf(sweep, "%lf:%lf:%d", &min_rate, &max_rate, &steps) != 3 || steps < 1){
+            printf("Invalid sweep '%s', expected MIN:MAX:STEPS\n", sweep);
+            return 1;
+        }
+        for (int i = 0; i < steps; i++){
+            config.rates.push_back(steps == 1 ? min_rate : min_rate + (max_rate - min_rate) * i / (steps - 1));
+        }
+    }
+    else config.rates.push_back(config.open_loop ? args.getDouble("rate", 10000) : 0);
+
+    if (!initSockets()) return 1;
+
+    if (config.open_loop){
+        printf("Load: open loop, %s arrivals, %d connections on %d threads, size %s, %d step(s) of %d s (+%d s warmup) against %s:%d\n",
+            config.poisson ? "poisson" : "constant", config.connections, config.threads, config.size_spec,
+            (int)config.rates.size(), config.duration_s, config.warmup_s, config.host, config.port);
+    }
+    else {
+        printf("Load: %d connections on %d threads, depth %d, think %d us, size %s, %d s (+%d s warmup) against %s:%d\n",
+            config.connections, config.threads, config.depth, config.think_us, config.size_spec,
+            config.duration_s, config.warmup_s, config.host, config.port);
+    }
+
+    StepControl control;
+    std::vector<std::vector<ThreadResult>> results(config.threads, std::vector<ThreadResult>(config.rates.size()));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.threads; i++){
+        threads.emplace_back(runWorker, i, &config, &control, &results[i]);
+    }
+    // Start sending once every connection has been made
+    while (control.ready < config.threads) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::vector<ThreadResult> totals(config.rates.size());
+    for (int step = 0; step < (int)config.rates.size(); step++){
+        control.step = step;
+        while (control.finished < (step + 1) * config.threads) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        ThreadResult &total = totals[step];
+        for (int i = 0; i < config.threads; i++){
+            ThreadResult &r = results[i][step];
+            total.latency.merge(r.latency);
+            total.requests += r.requests;
+            if (r.per_second.size() > total.per_second.size()) total.per_second.resize(r.per_second.size(), 0);
+            for (size_t s = 0; s < r.per_second.size(); s++) total.per_second[s] += r.per_second[s];
+            total.bytes += r.bytes;
+            total.connect_failures += r.connect_failures;
+            total.errors += r.errors;
+        }
+        double throughput = total.requests / (double)config.duration_s;
+        if (config.open_loop){
+            printf("Offered %.0f req/s: achieved %.0f req/s  %.2f MB/s\n", config.rates[step], throughput,
+                total.bytes / (double)config.duration_s / (1024*1024));
+        }
+        else {
+            printf("Requests: %llu  throughput %.0f req/s  %.2f MB/s\n", total.requests, throughput,
+                total.bytes / (double)config.duration_s / (1024*1024));
+        }
+        printLatency("Latency", total.latency);
+        if (total.connect_failures > 0 || total.errors > 0){
+            printf("Connect failures: %d  connection errors: %d\n", total.connect_failures, total.errors);
+        }
+    }
+    for (std::thread &t : threads) t.join();
+
+    BenchReport report(config.open_loop ? "loadgen_open" : "loadgen", args);
+    std::string details = "{\"steps\":[";
+    for (int step = 0; step < (int)config.rates.size(); step++){
+        const ThreadResult &t = totals[step];
+        double achieved = t.requests / (double)config.duration_s;
+        std::vector<double> samples(t.per_second.begin(), t.per_second.end());
+        // Rates are part of the name when sweeping so steps are compared with the same step
+        std::string suffix;
+        if (config.rates.size() > 1) appendf(suffix, "@%.0f", config.rates[step]);
+        report.addMetric("throughput_rps" + suffix, achieved, "req/s", true, 0.05, samples);
+        report.addMetric("p50_us" + suffix, (double)t.latency.percentile(0.5), "us", false, 0.10);
+        report.addMetric("p99_us" + suffix, (double)t.latency.percentile(0.99), "us", false, 0.15);
+        report.addMetric("p999_us" + suffix, (double)t.latency.percentile(0.999), "us", false, 0.25);
+        appendf(details, "%s{\"offered_rps\":%.0f,\"achieved_rps\":%.0f,\"requests\":%llu,\"mb_per_s\":%.3f,\"mean_us\":%.1f,\"p50_us\":%llu,\"p90_us\":%llu,"
+            "\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,\"connect_failures\":%d,\"errors\":%d}", step ? "," : "",
+            config.rates[step], achieved, t.requests, t.bytes / (double)config.duration_s / (1024*1024), t.latency.mean(),
+            t.latency.percentile(0.5), t.latency.percentile(0.9), t.latency.percentile(0.99), t.latency.percentile(0.999),
+            t.latency.max, t.connect_failures, t.errors);
+    }
+    details += "]";
+
+    if (config.rates.size() > 1){
+        /* Knee: first rate where the server can't keep up (achieved < 95% of offered)
+           or p99 grows beyond 10x the p99 at the lowest rate. */
+        int knee = -1;
+        unsigned long long base_p99 = totals[0].latency.percentile(0.99);
+        printf("\noffered_rps,achieved_rps,p50_us,p99_us,p999_us\n");
+        for (int step = 0; step < (int)config.rates.size(); step++){
+            double achieved = totals[step].requests / (double)config.duration_s;
+            unsigned long long p99 = totals[step].latency.percentile(0.99);
+            printf("%.0f,%.0f,%llu,%llu,%llu\n", config.rates[step], achieved, totals[step].latency.percentile(0.5),
+                p99, totals[step].latency.percentile(0.999));
+            if (knee < 0 && (achieved < config.rates[step] * 0.95 || p99 > base_p99 * 10)) knee = step;
+        }
+        if (knee > 0) printf("Knee between %.0f and %.0f req/s\n", config.rates[knee - 1], config.rates[knee]);
+        else if (knee == 0) printf("Saturated at the lowest offered rate %.0f req/s\n", config.rates[0]);
+        else printf("No knee found up to %.0f req/s\n", config.rates.back());
+        // Highest offered rate the server kept up with
+        double sustained = knee > 0 ? config.rates[knee - 1] : (knee == 0 ? 0 : config.rates.back());
+        report.addMetric("knee_rps", sustained, "req/s", true, 0.10);
+        appendf(details, ",\"knee_rps\":%.0f", sustained);
+    }
+    report.setDetails(details + "}");
+    report.write();
+
+    WSACleanup();
+    return 0;
+}
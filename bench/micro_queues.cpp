@@ -0,0 +1,328 @@
+/*  Microbenchmarks for the handoff queues and client lookup structures.
+
+    Queues (one producer thread, one consumer thread, optionally pinned to --producer-core / --consumer-core):
+        spsc_rwq            moodycamel::ReaderWriterQueue, single items (acceptor -> pool handoff today)
+        spsc_rwq_bulk       ReaderWriterQueue carrying batches of bulk_size items
+        spsc_circular       moodycamel::BlockingReaderWriterCircularBuffer, single items
+        spsc_mutex_deque    std::mutex + std::deque baseline
+        mpsc_mutex_deque    --producers producers on one std::mutex + std::deque
+        mpsc_rwq_per_producer   one ReaderWriterQueue per producer, consumer polls all of them
+        pingpong_rwq        round trip through two ReaderWriterQueues, reported as one way latency
+
+    Lookup of a client by socket for 1k/10k/100k clients:
+        vector_scan         ConnectionPool::getClientFromSocket today
+        unordered_map       hash map from socket to Client*
+        direct_handle       Client* stored in epoll_event.data (no lookup)
+
+    Every result is printed as ns/op and cycles/op (time stamp counter).
+
+    Usage:
+        micro_queues --ops 10000000 --producers 4 --producer-core 0 --consumer-core 2
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+    Build:
+        cl /O2 /EHsc /std:c++17 bench\micro_queues.cpp src\TcpConnectionAcceptor.cpp src\TcpConnectionPool.cpp src\client.cpp
+           src\HandlerWatchdog.cpp src\TopKSketch.cpp src\RequestTracer.cpp src\BufferPool.cpp src\EpochReclaimer.cpp src\HugePages.cpp src\Numa.cpp src\SharedPayload.cpp src\PacketPool.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib advapi32.lib
+*/
+
+#include "bench_common.h"
+#include "../src/imports/lockfreequeue/readerwriterqueue.h"
+#include "../src/imports/lockfreequeue/readerwritercircularbuffer.h"
+#include "../src/client.h"
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+
+
+static const int queue_capacity = 1024;
+static const int bulk_size = 32;
+
+struct Batch{
+	int count;
+	void *items[bulk_size];
+};
+
+// Every result also goes into the --json report
+static BenchReport *bench_report = nullptr;
+static std::string details;
+
+static void report(const char *name, unsigned long long ops, unsigned long long ns, unsigned long long cycles){
+    printf("%-26s %12llu ops  %8.2f ns/op  %8.2f cycles/op\n", name, ops, (double)ns / ops, (double)cycles / ops);
+    bench_report->addMetric(name, (double)ns / ops, "ns/op", false, 0.10);
+    appendf(details, "%s{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.3f,\"cycles_per_op\":%.3f}", details.empty() ? "" : ",",
+        name, ops, (double)ns / ops, (double)cycles / ops);
+}
+
+// Spins, yielding now and then so producer and consumer can share a core
+static inline void backoff(int &spins){
+    if (++spins >= 64){
+        std::this_thread::yield();
+        spins = 0;
+    }
+}
+
+struct Timing{
+	unsigned long long start_ns, start_cycles;
+	void begin(){ this->start_cycles = readCycleCounter(); this->start_ns = getMonotonicTimeUS() * 1000; }
+	void end(const char *name, unsigned long long ops){
+		unsigned long long cycles = readCycleCounter() - this->start_cycles;
+		report(name, ops, getMonotonicTimeUS() * 1000 - this->start_ns, cycles);
+	}
+};
+
+
+/* Single producer single consumer with any queue offering try_enqueue/try_dequeue */
+template<class Queue>
+static void spscSingle(const char *name, Queue &queue, unsigned long long ops, int producer_core, int consumer_core){
+    Timing timing;
+    std::thread consumer([&](){
+        pinThread(consumer_core);
+        void *item;
+        int spins = 0;
+        for (unsigned long long i = 0; i < ops; i++){
+            while (!queue.try_dequeue(item)) backoff(spins);
+        }
+    });
+    pinThread(producer_core);
+    timing.begin();
+    int spins = 0;
+    for (unsigned long long i = 0; i < ops; i++){
+        while (!queue.try_enqueue((void *)(i + 1))) backoff(spins);
+    }
+    consumer.join();
+    timing.end(name, ops);
+}
+
+static void spscBulk(unsigned long long ops, int producer_core, int consumer_core){
+    moodycamel::ReaderWriterQueue<Batch> queue(queue_capacity / bulk_size);
+    Timing timing;
+    std::thread consumer([&](){
+        pinThread(consumer_core);
+        Batch batch;
+        unsigned long long received = 0;
+        int spins = 0;
+        while (received < ops){
+            if (!queue.try_dequeue(batch)){
+                backoff(spins);
+                continue;
+            }
+            received += batch.count;
+        }
+    });
+    pinThread(producer_core);
+    timing.begin();
+    Batch batch;
+    int spins = 0;
+    for (unsigned long long i = 0; i < ops; i += bulk_size){
+        batch.count = (int)std::min<unsigned long long>(bulk_size, ops - i);
+        for (int j = 0; j < batch.count; j++) batch.items[j] = (void *)(i + j + 1);
+        while (!queue.try_enqueue(batch)) backoff(spins);
+    }
+    consumer.join();
+    timing.end("spsc_rwq_bulk", ops);
+}
+
+// Baseline queue with the same interface as the moodycamel queues
+class MutexQueue{
+public:
+	bool try_enqueue(void *item){
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->items.size() >= (size_t)queue_capacity) return false;
+		this->items.push_back(item);
+		return true;
+	}
+	bool try_dequeue(void *&item){
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->items.empty()) return false;
+		item = this->items.front();
+		this->items.pop_front();
+		return true;
+	}
+protected:
+	std::mutex mutex;
+	std::deque<void *> items;
+};
+
+static void mpscMutex(unsigned long long ops, int producers, int consumer_core){
+    MutexQueue queue;
+    unsigned long long per_producer = ops / producers;
+    Timing timing;
+    timing.begin();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++){
+        threads.emplace_back([&](){
+            int spins = 0;
+            for (unsigned long long i = 0; i < per_producer; i++){
+                while (!queue.try_enqueue((void *)(i + 1))) backoff(spins);
+            }
+        });
+    }
+    pinThread(consumer_core);
+    void *item;
+    int spins = 0;
+    for (unsigned long long i = 0; i < per_producer * producers; i++){
+        while (!queue.try_dequeue(item)) backoff(spins);
+    }
+    for (std::thread &t : threads) t.join();
+    timing.end("mpsc_mutex_deque", per_producer * producers);
+}
+
+static void mpscPerProducer(unsigned long long ops, int producers, int consumer_core){
+    std::vector<moodycamel::ReaderWriterQueue<void *> *> queues;
+    for (int p = 0; p < producers; p++) queues.push_back(new moodycamel::ReaderWriterQueue<void *>(queue_capacity));
+    unsigned long long per_producer = ops / producers;
+    Timing timing;
+    timing.begin();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++){
+        moodycamel::ReaderWriterQueue<void *> *q = queues[p];
+        threads.emplace_back([q, per_producer](){
+            int spins = 0;
+            for (unsigned long long i = 0; i < per_producer; i++){
+                while (!q->try_enqueue((void *)(i + 1))) backoff(spins);
+            }
+        });
+    }
+    pinThread(consumer_core);
+    void *item;
+    unsigned long long received = 0;
+    int spins = 0;
+    while (received < per_producer * producers){
+        bool any = false;
+        for (auto q : queues){
+            while (q->try_dequeue(item)){
+                received++;
+                any = true;
+            }
+        }
+        if (!any) backoff(spins);
+    }
+    for (std::thread &t : threads) t.join();
+    timing.end("mpsc_rwq_per_producer", per_producer * producers);
+    for (auto q : queues) delete q;
+}
+
+static void pingPong(unsigned long long round_trips, int producer_core, int consumer_core){
+    moodycamel::ReaderWriterQueue<void *> ping(16), pong(16);
+    LatencyHistogram cycles;
+    std::thread echo([&](){
+        pinThread(consumer_core);
+        void *item;
+        int spins = 0;
+        for (unsigned long long i = 0; i < round_trips; i++){
+            while (!ping.try_dequeue(item)) backoff(spins);
+            pong.enqueue(item);
+        }
+    });
+    pinThread(producer_core);
+    unsigned long long start_us = getMonotonicTimeUS();
+    void *item;
+    int spins = 0;
+    for (unsigned long long i = 0; i < round_trips; i++){
+        unsigned long long t = readCycleCounter();
+        ping.enqueue((void *)(i + 1));
+        while (!pong.try_dequeue(item)) backoff(spins);
+        cycles.record(readCycleCounter() - t);
+    }
+    unsigned long long elapsed_ns = (getMonotonicTimeUS() - start_us) * 1000;
+    echo.join();
+    printf("%-26s %12llu ops  %8.2f ns/op  %8.2f cycles/op  (one way, p50 %llu p99 %llu p99.9 %llu cycles)\n", "pingpong_rwq", round_trips,
+        (double)elapsed_ns / round_trips / 2, cycles.mean() / 2, cycles.percentile(0.5) / 2, cycles.percentile(0.99) / 2, cycles.percentile(0.999) / 2);
+    bench_report->addMetric("pingpong_rwq", (double)elapsed_ns / round_trips / 2, "ns/op", false, 0.10);
+    bench_report->addMetric("pingpong_rwq_p99_cycles", (double)(cycles.percentile(0.99) / 2), "cycles", false, 0.20);
+    appendf(details, "%s{\"name\":\"pingpong_rwq\",\"ops\":%llu,\"ns_per_op\":%.3f,\"cycles_p50\":%llu,\"cycles_p99\":%llu,\"cycles_p999\":%llu}",
+        details.empty() ? "" : ",", round_trips, (double)elapsed_ns / round_trips / 2, cycles.percentile(0.5) / 2, cycles.percentile(0.99) / 2,
+        cycles.percentile(0.999) / 2);
+}
+
+
+static void lookups(int num_clients, int num_lookups){
+    std::vector<Client *> clients;
+    std::unordered_map<SOCKET, Client *> by_socket;
+    for (int i = 0; i < num_clients; i++){
+        // Sockets on Windows are multiples of 4 with gaps, mimic that
+        Client *c = new Client((SOCKET)(1000 + i * 4), nullptr, i);
+        clients.push_back(c);
+        by_socket[c->client_socket] = c;
+    }
+    std::mt19937_64 rng(42);
+    std::vector<Client *> targets;
+    for (int i = 0; i < num_lookups; i++) targets.push_back(clients[rng() % num_clients]);
+    char name[64];
+    unsigned long long found = 0;
+    Timing timing;
+
+    // Vector scan is O(n), keep its run time bounded
+    int scan_lookups = std::min(num_lookups, (int)(200000000LL / num_clients));
+    timing.begin();
+    for (int i = 0; i < scan_lookups; i++){
+        SOCKET s = targets[i]->client_socket;
+        for (Client *c : clients){
+            if (c->client_socket == s){
+                found += c->client_id;
+                break;
+            }
+        }
+    }
+    snprintf(name, sizeof(name), "lookup_vector_scan_%d", num_clients);
+    timing.end(name, scan_lookups);
+
+    timing.begin();
+    for (int i = 0; i < num_lookups; i++){
+        found += by_socket.find(targets[i]->client_socket)->second->client_id;
+    }
+    snprintf(name, sizeof(name), "lookup_unordered_map_%d", num_clients);
+    timing.end(name, num_lookups);
+
+    timing.begin();
+    for (int i = 0; i < num_lookups; i++){
+        // The handle is what epoll hands back in data.ptr, reading the client is the only cost
+        found += targets[i]->client_id;
+    }
+    snprintf(name, sizeof(name), "lookup_direct_handle_%d", num_clients);
+    timing.end(name, num_lookups);
+
+    if (found == 42) printf(" ");
+    for (Client *c : clients) delete c;
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    unsigned long long ops = args.getInt("ops", 10000000);
+    int producers = (int)args.getInt("producers", 4);
+    int producer_core = (int)args.getInt("producer-core", -1);
+    int consumer_core = (int)args.getInt("consumer-core", -1);
+    int num_lookups = (int)args.getInt("lookups", 1000000);
+    if (producers < 1) producers = 1;
+    BenchReport results("micro_queues", args);
+    bench_report = &results;
+
+    {
+        moodycamel::ReaderWriterQueue<void *> queue(queue_capacity);
+        spscSingle("spsc_rwq", queue, ops, producer_core, consumer_core);
+    }
+    spscBulk(ops, producer_core, consumer_core);
+    {
+        moodycamel::BlockingReaderWriterCircularBuffer<void *> queue(queue_capacity);
+        spscSingle("spsc_circular", queue, ops, producer_core, consumer_core);
+    }
+    {
+        MutexQueue queue;
+        spscSingle("spsc_mutex_deque", queue, ops, producer_core, consumer_core);
+    }
+    mpscMutex(ops, producers, consumer_core);
+    mpscPerProducer(ops, producers, consumer_core);
+    pingPong(ops / 10 > 0 ? ops / 10 : 1, producer_core, consumer_core);
+
+    lookups(1000, num_lookups);
+    lookups(10000, num_lookups);
+    lookups(100000, num_lookups);
+
+    results.setDetails("{\"results\":[" + details + "]}");
+    results.write();
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*  Remote versus local NUMA memory for a pool's clients, buffers and arena.
+
+    A pool thread bound to --pool-node runs the per-event memory accesses of ConnectionPool::serveOnce() on
+    --clients clients picked at random: read the Client, count the request, take a partial packet buffer from
+    the BufferPool and copy half of a --size byte packet into it, or complete the packet, copy it into the
+    arena and give the buffer back (so about half the clients hold a buffer at any time). Two placements:
+
+        remote      slab, buffer pool, arena and receive buffer on --remote-node, where the acceptor thread
+                    allocated them before pools had a node
+        local       all of them on the pool's node, the way TcpConnectionAcceptor allocates them now
+
+    Without huge pages the BufferPool's buffers are new[] in both placements, they land where the pool thread
+    first touches them. --huge-pages 1 puts them on huge page regions placed with the rest.
+
+    For each placement two raw measures of that memory from the pool thread: dependent loads chasing
+    through the clients in random order (latency) and sequential reads of --stream-mb MB (bandwidth).
+
+    Windows has no user mode access to the memory controller or interconnect counters, the remote/local
+    ratios are the cost of the traffic as the pool thread sees it. Run under VTune (memory access analysis)
+    to count the remote accesses themselves. placement_local is the share of the sampled pages that
+    QueryWorkingSetEx reports on the intended node.
+
+    On a machine with a single node both placements are the same memory, the tool says so and the ratios
+    stay around 1.
+
+    Usage:
+        numa_locality --clients 100000 --events 20000000 --size 512 --pool-node 1 --remote-node 0 [--huge-pages 1]
+    --json FILE also writes the results in the common benchmark format (bench_common.h).
+    Build:
+        cl /O2 /EHsc /std:c++17 bench\numa_locality.cpp src\TcpConnectionAcceptor.cpp src\TcpConnectionPool.cpp src\client.cpp
+           src\HandlerWatchdog.cpp src\TopKSketch.cpp src\RequestTracer.cpp src\BufferPool.cpp src\EpochReclaimer.cpp src\HugePages.cpp
+           src\Numa.cpp src\SharedPayload.cpp src\PacketPool.cpp src\imports\wepoll\wepoll.c ws2_32.lib psapi.lib advapi32.lib
+*/
+
+#include "bench_common.h"
+#include "../src/client.h"
+#include "../src/BufferPool.h"
+#include "../src/RequestArena.h"
+#include "../src/HugePages.h"
+#include "../src/Numa.h"
+
+#include <algorithm>
+#include <thread>
+#include <random>
+
+
+struct Options{
+	int clients = 100000;
+	unsigned long long events = 20000000;
+	int size = 512;
+	unsigned long long chase_steps = 20000000;
+	int stream_mb = 256;
+	int stream_passes = 5;
+};
+
+// Everything a pool allocates, on one node
+struct PoolMemory{
+	ClientSlab *slab = nullptr;
+	BufferPool *buffers = nullptr;
+	RequestArena *arena = nullptr;
+	PageAllocation recv;
+	PageAllocation stream;
+	// Clients in slot order, base[i] is client i
+	Client *base = nullptr;
+};
+
+struct PlacementResult{
+	int node = 0;
+	double ns_per_event = 0, cycles_per_event = 0;
+	double ns_per_load = 0;
+	double gb_per_s = 0;
+	double placement_local = 0;
+};
+
+static const int recv_size = 4096*10;
+
+static bool createMemory(PoolMemory &m, int node, const Options &o){
+    m.slab = new ClientSlab(o.clients, node);
+    m.buffers = new BufferPool(4*1024*1024, node);
+    m.arena = new RequestArena(64*1024, 1024*1024, node);
+    m.recv = allocatePages(recv_size, node, false);
+    m.stream = allocatePages((size_t)o.stream_mb * 1024 * 1024, node, false);
+    if (m.recv.data == nullptr || m.stream.data == nullptr) return false;
+    // Commits the pages, VirtualAllocExNuma places them on node whoever touches them first
+    for (size_t i = 0; i < m.recv.size; i++) m.recv.data[i] = (char)i;
+    memset(m.stream.data, 1, m.stream.size);
+
+    // A fresh slab hands out its slots in address order
+    for (int i = 0; i < o.clients; i++){
+        Client *c = m.slab->create((SOCKET)(i + 1), nullptr, i);
+        if (i == 0) m.base = c;
+        else if (c != m.base + i){
+            printf("Slab slots are not contiguous\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void destroyMemory(PoolMemory &m, const Options &o){
+    for (int i = 0; i < o.clients; i++){
+        m.buffers->release(m.base[i].recv_partial);
+        m.slab->destroy(&m.base[i]);
+    }
+    delete m.slab;
+    delete m.buffers;
+    delete m.arena;
+    freePages(m.recv);
+    freePages(m.stream);
+}
+
+static int pageNode(const void *address){
+    PSAPI_WORKING_SET_EX_INFORMATION info = {};
+    info.VirtualAddress = (void *)address;
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid) return -1;
+    return (int)info.VirtualAttributes.Node;
+}
+
+static double placementLocal(const PoolMemory &m, int node, const Options &o){
+    /* Share of resident pages on node, sampling the slab, the stream and the receive buffer */
+    int on_node = 0, resident = 0;
+    auto sample = [&](const char *start, size_t size, size_t step){
+        for (size_t offset = 0; offset < size; offset += step){
+            int n = pageNode(start + offset);
+            if (n < 0) continue;
+            resident++;
+            if (n == node) on_node++;
+        }
+    };
+    sample((const char *)m.base, (size_t)o.clients * sizeof(Client), 4096);
+    sample(m.stream.data, m.stream.size, 1024*1024);
+    sample(m.recv.data, m.recv.size, 4096);
+    return resident > 0 ? (double)on_node / resident : 0;
+}
+
+static void runEvents(PoolMemory &m, const std::vector<int> &order, const Options &o, PlacementResult &result){
+    /* The pool thread's accesses for readable events, see ConnectionPool::processReceived() */
+    int half = o.size / 2;
+    int sink = 0;
+    size_t next = 0, recv_offset = 0;
+    unsigned long long start_us = getMonotonicTimeUS(), start_cycles = readCycleCounter();
+    for (unsigned long long i = 0; i < o.events; i++){
+        Client *c = &m.base[order[next]];
+        if (++next == order.size()) next = 0;
+        if (c->closed) continue;
+        c->request_count++;
+        const char *received = m.recv.data + recv_offset;
+        recv_offset += 64;
+        if (recv_offset + o.size > recv_size) recv_offset = 0;
+
+        PooledBuffer &b = c->recv_partial;
+        if (b.data == nullptr){
+            // First half of a packet, kept until the rest arrives
+            if (!m.buffers->reserve(b, o.size)) break;
+            memcpy(b.data, received, half);
+            b.size = half;
+        }
+        else {
+            memcpy(b.data + b.size, received, o.size - b.size);
+            char *packet = m.arena->copy(b.data, o.size);
+            sink += packet[c->client_id % o.size];
+            m.buffers->release(b);
+        }
+        // A batch is at most num_epoll_events long
+        if ((i & 15) == 15) m.arena->reset();
+    }
+    unsigned long long cycles = readCycleCounter() - start_cycles;
+    unsigned long long ns = (getMonotonicTimeUS() - start_us) * 1000;
+    if (sink == -1) printf("\n");
+    result.ns_per_event = (double)ns / o.events;
+    result.cycles_per_event = (double)cycles / o.events;
+}
+
+static void runChase(PoolMemory &m, const Options &o, PlacementResult &result){
+    /* Every load depends on the previous one, the client ids form one random cycle through the slab */
+    int idx = 0;
+    unsigned long long start_us = getMonotonicTimeUS();
+    for (unsigned long long i = 0; i < o.chase_steps; i++) idx = m.base[idx].client_id;
+    unsigned long long ns = (getMonotonicTimeUS() - start_us) * 1000;
+    if (idx == -1) printf("\n");
+    result.ns_per_load = (double)ns / o.chase_steps;
+}
+
+static void runStream(PoolMemory &m, const Options &o, PlacementResult &result){
+    const unsigned long long *words = (const unsigned long long *)m.stream.data;
+    size_t count = m.stream.size / sizeof(unsigned long long);
+    unsigned long long sum = 0, best_us = ~0ull;
+    for (int pass = 0; pass < o.stream_passes; pass++){
+        unsigned long long start_us = getMonotonicTimeUS();
+        for (size_t i = 0; i < count; i += 4) sum += words[i] + words[i + 1] + words[i + 2] + words[i + 3];
+        unsigned long long us = getMonotonicTimeUS() - start_us;
+        if (us < best_us) best_us = us;
+    }
+    if (sum == 1) printf("\n");
+    result.gb_per_s = best_us > 0 ? (double)m.stream.size / (best_us * 1000.0) : 0;
+}
+
+static PlacementResult runPlacement(const char *name, int memory_node, int pool_node, const std::vector<int> &order,
+                                    const std::vector<int> &cycle, const Options &o){
+    PlacementResult result;
+    result.node = memory_node;
+    PoolMemory m;
+    if (!createMemory(m, memory_node, o)){
+        printf("Could not allocate %s memory on node %d\n", name, memory_node);
+        exit(1);
+    }
+    for (int i = 0; i < o.clients; i++) m.base[i].client_id = cycle[i];
+    result.placement_local = placementLocal(m, memory_node, o);
+
+    std::thread pool([&](){
+        if (!bindThreadToNumaNode(pool_node)) printf("Could not bind the pool thread to node %d\n", pool_node);
+        runChase(m, o, result);
+        runStream(m, o, result);
+        runEvents(m, order, o, result);
+    });
+    pool.join();
+
+    printf("%-7s memory on node %d, pool on node %d: %7.2f ns %7.1f cycles/event  %6.1f ns/load  %6.2f GB/s  %5.1f%% of pages on node\n",
+        name, memory_node, pool_node, result.ns_per_event, result.cycles_per_event, result.ns_per_load, result.gb_per_s,
+        result.placement_local * 100);
+    destroyMemory(m, o);
+    return result;
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    Options o;
+    o.clients = (int)args.getInt("clients", o.clients);
+    o.events = args.getInt("events", o.events);
+    o.size = (int)args.getInt("size", o.size);
+    o.chase_steps = args.getInt("chase-steps", o.chase_steps);
+    o.stream_mb = (int)args.getInt("stream-mb", o.stream_mb);
+    o.stream_passes = (int)args.getInt("stream-passes", o.stream_passes);
+    if (o.clients < 2) o.clients = 2;
+    if (o.size < 2) o.size = 2;
+    if (o.size > recv_size) o.size = recv_size;
+    if (o.stream_mb < 1) o.stream_mb = 1;
+    if (o.stream_passes < 1) o.stream_passes = 1;
+    // Before the first BufferPool, they decide on regions when constructed
+    if (args.getInt("huge-pages", 0) != 0) enableHugePages();
+
+    int nodes = getNumaNodeCount();
+    int pool_node = (int)args.getInt("pool-node", nodes - 1);
+    int remote_node = (int)args.getInt("remote-node", 0);
+    if (nodes < 2){
+        printf("[Warning] Single NUMA node, remote and local are the same memory\n");
+        pool_node = remote_node = 0;
+    }
+    else if (pool_node == remote_node){
+        printf("[Warning] --pool-node and --remote-node are both %d, remote is local\n", pool_node);
+    }
+
+    // Same random event order and chase cycle for both placements
+    std::mt19937 rng(12345);
+    std::vector<int> order(1 << 20);
+    for (int &i : order) i = (int)(rng() % o.clients);
+    std::vector<int> shuffled(o.clients), cycle(o.clients);
+    for (int i = 0; i < o.clients; i++) shuffled[i] = i;
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    for (int i = 0; i < o.clients; i++) cycle[shuffled[i]] = shuffled[(i + 1) % o.clients];
+
+    PlacementResult remote = runPlacement("remote", remote_node, pool_node, order, cycle, o);
+    PlacementResult local = runPlacement("local", pool_node, pool_node, order, cycle, o);
+    double event_ratio = local.ns_per_event > 0 ? remote.ns_per_event / local.ns_per_event : 0;
+    double load_ratio = local.ns_per_load > 0 ? remote.ns_per_load / local.ns_per_load : 0;
+    double bandwidth_ratio = remote.gb_per_s > 0 ? local.gb_per_s / remote.gb_per_s : 0;
+    printf("remote/local: %.2fx time per event, %.2fx load latency, local has %.2fx the bandwidth\n", event_ratio, load_ratio, bandwidth_ratio);
+
+    std::string details;
+    appendf(details, "{\"benchmark\":\"numa_locality\",\"nodes\":%d,\"pool_node\":%d,\"clients\":%d,\"events\":%llu,\"size\":%d,",
+        nodes, pool_node, o.clients, o.events, o.size);
+    const PlacementResult *results[] = {&remote, &local};
+    const char *names[] = {"remote", "local"};
+    for (int i = 0; i < 2; i++){
+        appendf(details, "\"%s\":{\"node\":%d,\"ns_per_event\":%.3f,\"cycles_per_event\":%.1f,\"ns_per_load\":%.2f,\"gb_per_s\":%.3f,\"placement_local\":%.3f},",
+            names[i], results[i]->node, results[i]->ns_per_event, results[i]->cycles_per_event, results[i]->ns_per_load,
+            results[i]->gb_per_s, results[i]->placement_local);
+    }
+    appendf(details, "\"remote_local_event_ratio\":%.3f,\"remote_local_load_ratio\":%.3f,\"local_remote_bandwidth_ratio\":%.3f}",
+        event_ratio, load_ratio, bandwidth_ratio);
+    printf("%s\n", details.c_str());
+
+    BenchReport report("numa_locality", args);
+    report.addMetric("ns_per_event", local.ns_per_event, "ns", false, 0.10);
+    report.addMetric("ns_per_load", local.ns_per_load, "ns", false, 0.10);
+    report.addMetric("gb_per_s", local.gb_per_s, "GB/s", true, 0.10);
+    report.addMetric("placement_local", local.placement_local, "ratio", true, 0.02);
+    report.addMetric("remote_local_event_ratio", event_ratio, "ratio", true, 0.15);
+    report.setDetails(details);
+    report.write();
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*  Fuzz target for the receive path: packet reassembly and dispatch in ConnectionPool::processReceived.
+    No sockets are involved, the input is split into recv sized chunks and fed to a pool directly.
+
+    Input layout:
+        byte 0          number of chunk lengths k (low 4 bits), 0 feeds the stream in one recv
+        bytes 1..k      chunk lengths (value + 1), used round robin
+        rest            byte stream as received from a client
+
+    Every run is checked against a reference parser working on the whole stream at once, so splitting
+    the stream differently must never change which packets reach the handler. A payload of 13 bytes
+    starting with 0xEE makes the handler throw to exercise the error path.
+
+    Build with libFuzzer and sanitizers:
+        clang -c -g -O1 -fsanitize=address,undefined src/imports/wepoll/wepoll.c -o wepoll.o
+        clang++ -g -O1 -std=c++17 -fsanitize=fuzzer,address,undefined fuzz/fuzz_receive.cpp src/TcpConnectionPool.cpp
+                src/TcpConnectionAcceptor.cpp src/client.cpp src/HandlerWatchdog.cpp src/TopKSketch.cpp src/RequestTracer.cpp
+                src/BufferPool.cpp src/EpochReclaimer.cpp src/HugePages.cpp src/Numa.cpp src/SharedPayload.cpp src/PacketPool.cpp
+                wepoll.o -lws2_32 -ladvapi32 -lpsapi -o fuzz_receive
+        cl /fsanitize=fuzzer /fsanitize=address /std:c++17 /EHsc fuzz\fuzz_receive.cpp src\*.cpp src\imports\wepoll\wepoll.c ws2_32.lib advapi32.lib
+    Run:
+        fuzz_receive fuzz/corpus/receive
+    Define TCPSERVER_FUZZ_STANDALONE to build a replay binary without libFuzzer that runs the given files,
+    which is how the regression corpus is checked:
+        fuzz_receive fuzz/corpus/receive/*
+    The corpus stays small enough for libFuzzer's default -max_len, a packet of exactly max_packet_size is
+    only started there (max_packet_size). The replay binary also runs a synthesized input completing one.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
+
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/client.h"
+
+
+struct SeenPacket{
+	int size;
+	unsigned int hash;
+	bool operator==(const SeenPacket &other) const{ return this->size == other.size && this->hash == other.hash; }
+};
+
+static std::vector<SeenPacket> seen;
+
+static unsigned int hashBytes(const char *data, int size){
+    // FNV-1a, reading every byte lets the sanitizer catch out of bounds payloads
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < size; i++) h = (h ^ (unsigned char)data[i]) * 16777619u;
+    return h;
+}
+
+static bool shouldThrow(const char *payload, int size){
+    return size == 13 && (unsigned char)payload[0] == 0xEE;
+}
+
+static void recordPacket(Client *client, Packet *packet){
+    SeenPacket s;
+    s.size = packet->size;
+    s.hash = hashBytes(packet->data, packet->size);
+    seen.push_back(s);
+    if (shouldThrow(packet->data, packet->size)) throw std::runtime_error("fuzz handler error");
+}
+
+/* Parses the whole stream at once. Returns true if the connection stays open and sets the tail length. */
+static bool referenceParse(const char *data, int size, std::vector<SeenPacket> &packets, int &tail){
+    int offset = 0;
+    while (size - offset >= packet_header_size){
+        unsigned int payload = readPacketHeader(data + offset);
+        if (payload > (unsigned int)max_packet_size) return false;
+        if ((unsigned int)(size - offset - packet_header_size) < payload) break;
+        const char *p = data + offset + packet_header_size;
+        SeenPacket s;
+        s.size = (int)payload;
+        s.hash = hashBytes(p, (int)payload);
+        packets.push_back(s);
+        if (shouldThrow(p, (int)payload)) return false;
+        offset += packet_header_size + payload;
+    }
+    tail = size - offset;
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    static ConnectionPool *pool = nullptr;
+    if (pool == nullptr){
+        handle_function = recordPacket;
+        pool = new ConnectionPool(0, "fuzz");
+    }
+    if (size < 1) return 0;
+
+    int num_lengths = data[0] & 0x0f;
+    if (size < (size_t)1 + num_lengths) return 0;
+    std::vector<int> lengths;
+    for (int i = 0; i < num_lengths; i++) lengths.push_back(data[1 + i] + 1);
+    const char *stream = (const char *)data + 1 + num_lengths;
+    int stream_size = (int)(size - 1 - num_lengths);
+
+    std::vector<SeenPacket> expected;
+    int expected_tail = 0;
+    bool expected_open = referenceParse(stream, stream_size, expected, expected_tail);
+
+    // Fresh client per input, the socket is never used
+    Client client((SOCKET)1, nullptr, 1);
+    seen.clear();
+    bool open = true;
+    int offset = 0, chunk = 0;
+    // Chunks are copied into a buffer of their exact size, like recv into the pool's buffer
+    std::vector<char> recv_buffer;
+    while (offset < stream_size && open){
+        int n = lengths.empty() ? stream_size : lengths[chunk++ % lengths.size()];
+        if (n > stream_size - offset) n = stream_size - offset;
+        recv_buffer.assign(stream + offset, stream + offset + n);
+        open = pool->processReceived(&client, recv_buffer.data(), n) == 0;
+        // serveOnce() does this after every event batch
+        pool->arena.reset();
+        offset += n;
+    }
+
+    if (open != expected_open || !(seen == expected) || (open && (int)client.recv_partial.size != expected_tail)){
+        fprintf(stderr, "Receive path mismatch: open %d/%d, packets %d/%d, partial %d/%d\n", open, expected_open,
+            (int)seen.size(), (int)expected.size(), (int)client.recv_partial.size, expected_tail);
+        abort();
+    }
+    return 0;
+}
+
+#ifdef TCPSERVER_FUZZ_STANDALONE
+int main(int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        FILE *f = fopen(argv[i], "rb");
+        if (f == nullptr){
+            printf("Could not open %s\n", argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> input;
+        int c;
+        while ((c = fgetc(f)) != EOF) input.push_back((uint8_t)c);
+        fclose(f);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+
+    // One complete packet of max_packet_size in 256 and 17 byte recvs, too large to keep in the corpus
+    std::vector<uint8_t> largest(3 + packet_header_size + max_packet_size, 'm');
+    largest[0] = 2;
+    largest[1] = 0xff;
+    largest[2] = 0x10;
+    writePacketHeader((char *)largest.data() + 3, max_packet_size);
+    LLVMFuzzerTestOneInput(largest.data(), largest.size());
+    printf("Ran %d input(s) and one of max_packet_size\n", argc - 1);
+    return 0;
+}
+#endif
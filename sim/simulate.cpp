@@ -0,0 +1,459 @@
+/*  Deterministic simulation of the acceptor, the pools and their clients.
+    The server runs unmodified on the in-memory sockets, poller and virtual clock of SimNetwork and
+    no thread is started: a seeded scheduler picks the next step, which is one of
+        acceptor            TcpConnectionAcceptor::serveOnce()
+        pool i              ConnectionPool::serveOnce() of a random pool
+        connect             a new client connects
+        send                a client sends part of its stream of framed packets, split at random points
+        read                a client reads the echoed bytes and checks them
+        close / reset       a client closes gracefully or resets its connection
+        oversize            a client sends a packet over max_packet_size and must be disconnected
+    Step weights are drawn per seed (swarm testing), so some seeds starve the pools, others the acceptor.
+    Recv and send sizes and the order of ready events are drawn from the same seed. Clients that don't read
+    fill their send buffer, so echoes go through the pools' outbound queues.
+
+    After the steps every client sends the rest of its stream and the simulation runs until idle, then checks
+        - every client got exactly the bytes it sent echoed back, in order
+        - the handler is only called with the Client of the connection the data came from
+        - clients that sent an oversize packet are disconnected, nobody else is (except connections
+          the acceptor rejects because the pool's handoff queue is full)
+        - no client keeps a receive buffer once its packets are complete, nor queued output once its
+          echoes are read, and every shared payload is released
+        - sampled requests (1 in 4 traced) whose echo was queued are timed from queueing until it is sent
+        - packets the handler retains (a quarter of them, released in random order) are exact copies and
+          counted by their pool until released
+        - closed connections leave no pool registration and no Client behind (every pool has run since,
+          so the epoch reclamation freed what it retired), and deleting the acceptor deletes every Client
+
+    A failing seed is reported with the step it failed at. Runs are reproducible, rerun a seed with
+    --verbose 1 to see the server log next to every step. The first seed is run twice to check that
+    both runs produce the same trace hash.
+
+    Usage:
+        simulate --seed 1 --seeds 1000 --steps 5000 --pools 4 --clients 32 --handle-reuse 1
+    --huge-pages 1 constructs the acceptor with huge pages, to run the buffer pools on regions where the
+    system allows it.
+    --budget 1 sets a memory budget (512 KB, 128 KB per client) that clients filling their send buffer
+    exceed, so they are paused and shed. The server may then close any connection, as long as the pools
+    count at least as many shed clients, and no client may stay paused once everything is read.
+    Build (every server source, TCPSERVER_SIMULATION defined, no ws2_32 or wepoll needed):
+        cl /O2 /EHsc /std:c++17 /DTCPSERVER_SIMULATION sim\simulate.cpp src\*.cpp advapi32.lib
+*/
+
+#ifndef TCPSERVER_SIMULATION
+#error Build the simulation with TCPSERVER_SIMULATION defined
+#endif
+
+#include "../bench/bench_common.h"
+#include "../src/TcpConnectionAcceptor.h"
+#include "../src/TcpConnectionPool.h"
+#include "../src/SimNetwork.h"
+#include "../src/netapi.h"
+#include "../src/client.h"
+#include "../src/EpochReclaimer.h"
+#include "../src/SharedPayload.h"
+#include "../src/MemoryBudget.h"
+#include "../src/RequestTracer.h"
+
+#include <string>
+#include <cstdarg>
+#include <chrono>
+
+
+static const int sim_port = 5000;
+
+// Accept indexes of connections the server closed right away because the pool's handoff queue was full
+static std::vector<bool> rejected;
+// Run with a memory budget small enough that clients get paused and shed
+static bool budget = false;
+static const size_t sim_budget_bytes = 512*1024, sim_client_quota = 128*1024;
+// Connections closed by the server that the budget can account for
+static unsigned long long budget_closes = 0;
+
+// Exposes the pools so the scheduler can run them
+class SimAcceptor : public TcpConnectionAcceptor{
+public:
+	using TcpConnectionAcceptor::TcpConnectionAcceptor;
+	std::vector<ConnectionPool *> &pools(){ return this->thread_connectionpool; }
+	long long pendingReclaims(){ return this->reclaimer->getPendingCount(); }
+	std::vector<RequestTracer *> &requestTracers(){ return this->tracers; }
+
+	void handleNewConnection(SOCKET newSocket, struct sockaddr *newSockAddr) override{
+		// Starving the pools fills their queues, the acceptor then closes the connection
+		auto queue = this->getConnectionPool()->newConnectionsQueue;
+		rejected.resize(this->connectionCount + 1);
+		rejected[this->connectionCount] = queue->size_approx() >= queue->max_capacity();
+		TcpConnectionAcceptor::handleNewConnection(newSocket, newSockAddr);
+	}
+};
+
+struct SimConnection{
+	SOCKET socket;
+	// Connect order, equal to the server's accept order
+	size_t id = 0;
+	// Every byte this client sends, in order, and how much of it went out
+	std::vector<char> stream;
+	size_t sent = 0;
+	// Bytes echoed back so far, checked against stream
+	size_t received = 0;
+	// Sent an oversize packet, only the packets before it are echoed. Echoes still queued in the pool
+	// when it disconnects the client are lost, as they would be with a reset.
+	bool expect_close = false;
+	size_t echo_limit = 0;
+	bool server_closed = false;
+};
+
+enum Action{ ACCEPTOR, POOL, CONNECT, SEND, READ, CLOSE, RESET, OVERSIZE, NUM_ACTIONS };
+static const char *action_names[NUM_ACTIONS] = {"acceptor", "pool", "connect", "send", "read", "close", "reset", "oversize"};
+
+struct SimResult{
+	std::string failure;
+	unsigned long long failed_step = 0;
+	unsigned long long trace_hash = 0;
+	unsigned long long connections = 0, packets = 0;
+};
+
+static std::string failure;
+// Packets handlers kept past their batch, see simEcho()
+static std::vector<Packet *> retained;
+static unsigned long long packets_handled = 0;
+static bool verbose = false;
+
+
+static void fail(const char *format, ...){
+    if (!failure.empty()) return;
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    failure = message;
+}
+
+static void simEcho(Client *client, Packet *packet){
+    int owner = SimNetwork::current->acceptIndex(client->client_socket);
+    if (owner != client->client_id){
+        fail("handler called with client %d for data of connection %d (socket %d)", client->client_id, owner, (int)client->client_socket);
+    }
+    packets_handled++;
+
+    // Some packets are kept as work items for a while, released in random order. Their echo is sent
+    // from the kept copy.
+    const char *payload = packet->data;
+    if (SimNetwork::current->random(4) == 0){
+        if (retained.size() >= 16){
+            size_t i = (size_t)SimNetwork::current->random(retained.size());
+            Packet::release(retained[i]);
+            retained[i] = retained.back();
+            retained.pop_back();
+        }
+        Packet *kept = packet->retain();
+        if (kept == nullptr || kept->size != packet->size || memcmp(kept->data, packet->data, packet->size) != 0){
+            fail("retained copy of a %d byte packet differs", packet->size);
+        }
+        if (kept != nullptr){
+            retained.push_back(kept);
+            payload = kept->data;
+        }
+    }
+
+    // Either path through the pool's outbound queue, the send buffer fills up when clients don't read
+    if (SimNetwork::current->random(2) == 0){
+        SharedPayload *reply = SharedPayload::createPacket(payload, packet->size);
+        client->send(reply);
+        reply->release();
+        return;
+    }
+    int reply_size = packet_header_size + packet->size;
+    char *reply = packet->arena->allocateArray<char>(reply_size);
+    writePacketHeader(reply, packet->size);
+    memcpy(reply + packet_header_size, payload, packet->size);
+    client->send(reply, reply_size);
+}
+
+
+// Larger than the pool's recv buffer, max_packet_size itself would make runs slow
+static const int sim_large_packet_size = 3*4096*10;
+
+static void appendPacket(SimNetwork &sim, SimConnection &c){
+    // Mostly small packets, sometimes large enough to span several recv calls and receive buffer size classes
+    int size = sim.random(8) == 0 ? (int)sim.random(sim_large_packet_size + 1) : (int)sim.random(64);
+    size_t offset = c.stream.size();
+    c.stream.resize(offset + packet_header_size + size);
+    writePacketHeader(c.stream.data() + offset, size);
+    for (int i = 0; i < size; i++) c.stream[offset + packet_header_size + i] = (char)sim.random(256);
+}
+
+static void sendSome(SimNetwork &sim, SimConnection &c, bool all){
+    if (c.expect_close) return;
+    if (c.sent == c.stream.size()) appendPacket(sim, c);
+    size_t n = c.stream.size() - c.sent;
+    if (!all) n = 1 + (size_t)sim.random(n);
+    sim.clientSend(c.socket, c.stream.data() + c.sent, (int)n);
+    c.sent += n;
+}
+
+static void readEcho(SimNetwork &sim, SimConnection &c){
+    char buffer[4096];
+    while (!c.server_closed){
+        int n = sim.clientRecv(c.socket, buffer, sizeof(buffer));
+        if (n < 0) return;
+        if (n == 0){
+            c.server_closed = true;
+            if (!c.expect_close && c.id < rejected.size() && rejected[c.id]){
+                // Never served, nothing gets echoed
+                c.expect_close = true;
+                c.echo_limit = 0;
+            }
+            if (!c.expect_close && budget){
+                // Shed for holding too much, checked against the pools' count in the end
+                c.expect_close = true;
+                c.echo_limit = c.sent;
+                budget_closes++;
+            }
+            if (!c.expect_close) fail("server closed connection on socket %d", (int)c.socket);
+            if (c.received > c.echo_limit) fail("socket %d: echoed bytes after the connection was rejected", (int)c.socket);
+            return;
+        }
+        size_t limit = c.expect_close ? c.echo_limit : c.sent;
+        if (c.received + n > limit || memcmp(buffer, c.stream.data() + c.received, n) != 0){
+            fail("socket %d: wrong echo at byte %llu", (int)c.socket, (unsigned long long)c.received);
+            return;
+        }
+        c.received += n;
+    }
+}
+
+static void sendOversize(SimNetwork &sim, SimConnection &c){
+    if (c.expect_close) return;
+    // Finish the packet in flight, the server may echo everything before the bad header
+    sendSome(sim, c, true);
+    c.echo_limit = c.stream.size();
+    char header[packet_header_size];
+    writePacketHeader(header, max_packet_size + 1 + (unsigned int)sim.random(1 << 20));
+    c.stream.insert(c.stream.end(), header, header + packet_header_size);
+    sim.clientSend(c.socket, header, packet_header_size);
+    c.sent = c.stream.size();
+    c.expect_close = true;
+}
+
+
+static bool huge_pages = false;
+
+static SimResult runSeed(unsigned long long seed, unsigned long long steps, int pools, int max_clients, bool reuse_handles){
+    SimResult result;
+    failure.clear();
+    packets_handled = 0;
+    rejected.clear();
+    budget_closes = 0;
+
+    SimNetwork sim(seed);
+    sim.reuse_handles = reuse_handles;
+    SimNetwork::current = &sim;
+    SimAcceptor *acceptor = new SimAcceptor(simEcho, "127.0.0.1", sim_port, pools, 4096, huge_pages);
+    if (budget) acceptor->setMemoryBudget(sim_budget_bytes, sim_client_quota);
+    acceptor->startRequestTracing(4);
+
+    unsigned long long weights[NUM_ACTIONS], total_weight = 0;
+    for (int i = 0; i < NUM_ACTIONS; i++){
+        weights[i] = 1 + sim.random(10);
+        total_weight += weights[i];
+    }
+
+    std::vector<SimConnection> connections;
+    unsigned long long step = 0;
+    for (; step < steps && failure.empty(); step++){
+        sim.advance(1 + sim.random(100));
+        unsigned long long r = sim.random(total_weight);
+        int action = 0;
+        while (r >= weights[action]){
+            r -= weights[action];
+            action++;
+        }
+        SimConnection *c = connections.empty() ? nullptr : &connections[(size_t)sim.random(connections.size())];
+        if (verbose) fprintf(stderr, "step %llu: %s %d\n", step, action_names[action], c != nullptr ? (int)c->socket : -1);
+
+        switch (action){
+        case ACCEPTOR:
+            acceptor->serveOnce(0);
+            break;
+        case POOL:
+            acceptor->pools()[(size_t)sim.random(pools)]->serveOnce(0);
+            break;
+        case CONNECT:
+            if ((int)connections.size() < max_clients){
+                SimConnection n;
+                n.id = (size_t)result.connections;
+                n.socket = sim.connect(sim_port);
+                if (n.socket == INVALID_SOCKET) fail("connect failed");
+                connections.push_back(n);
+                result.connections++;
+            }
+            break;
+        case SEND:
+            if (c != nullptr) sendSome(sim, *c, false);
+            break;
+        case READ:
+            if (c != nullptr) readEcho(sim, *c);
+            break;
+        case CLOSE:
+        case RESET:
+            // Rarer than the other actions, connections should live long enough to send something
+            if (c != nullptr && sim.random(4) == 0){
+                sim.clientClose(c->socket, action == RESET);
+                *c = connections.back();
+                connections.pop_back();
+            }
+            break;
+        case OVERSIZE:
+            // Rarer than the other actions
+            if (c != nullptr && sim.random(4) == 0) sendOversize(sim, *c);
+            break;
+        }
+    }
+    result.failed_step = step;
+
+    // Everyone sends the rest of their stream, then run until nothing moves anymore
+    for (SimConnection &c : connections){
+        if (c.sent < c.stream.size()) sendSome(sim, c, true);
+    }
+    // Clients paused over the global budget only move again once the pools start shedding
+    int max_idle_rounds = budget ? 2*MemoryBudget::shed_after_ms : 50;
+    int idle_rounds = 0;
+    for (int round = 0; failure.empty() && idle_rounds < max_idle_rounds && round < 100000; round++){
+        unsigned long long before = sim.trace_hash;
+        sim.advance(1000);
+        acceptor->serveOnce(0);
+        for (ConnectionPool *p : acceptor->pools()) p->serveOnce(0);
+        for (SimConnection &c : connections) readEcho(sim, c);
+        idle_rounds = sim.trace_hash == before ? idle_rounds + 1 : 0;
+    }
+    for (SimConnection &c : connections){
+        if (!failure.empty()) break;
+        if (c.expect_close){
+            // readEcho() checked that nothing past echo_limit came back
+            if (!c.server_closed) fail("socket %d sent an oversize packet and was not disconnected", (int)c.socket);
+        }
+        else if (c.received != c.stream.size()){
+            fail("socket %d: %llu of %llu bytes echoed", (int)c.socket, (unsigned long long)c.received, (unsigned long long)c.stream.size());
+        }
+    }
+
+    // Connections the server should have let go of by now
+    int registered = 0;
+    for (ConnectionPool *p : acceptor->pools()) registered += p->size;
+    if (failure.empty() && registered != sim.openServerSockets()){
+        fail("%d pool registrations for %d open connections", registered, sim.openServerSockets());
+    }
+    // Every pool ran since its last close, so everything it retired has been freed
+    int partial = 0, outbound_clients = 0, paused_clients = 0;
+    unsigned long long shed_clients = 0;
+    for (ConnectionPool *p : acceptor->pools()){
+        PoolStats stats = p->getStats();
+        partial += stats.partial_buffers;
+        outbound_clients += stats.outbound_clients;
+        paused_clients += stats.paused_clients;
+        shed_clients += stats.shed_clients;
+    }
+    if (failure.empty() && Client::live_count != registered){
+        fail("%d Clients alive for %d registered connections, %lld retired and not freed", (int)Client::live_count, registered, acceptor->pendingReclaims());
+    }
+    else if (failure.empty() && partial != 0){
+        fail("%d clients hold a receive buffer with every packet complete", partial);
+    }
+    else if (failure.empty() && outbound_clients != 0){
+        fail("%d clients have queued output after every echo was read", outbound_clients);
+    }
+    else if (failure.empty() && paused_clients != 0){
+        fail("%d clients still paused with nothing held", paused_clients);
+    }
+    else if (failure.empty() && budget_closes > shed_clients){
+        fail("server closed %llu connections, only %llu were shed by the memory budget", budget_closes, shed_clients);
+    }
+
+    int retained_packets = 0;
+    for (ConnectionPool *p : acceptor->pools()) retained_packets += p->getStats().retained_packets;
+    if (failure.empty() && retained_packets != (int)retained.size()){
+        fail("pools count %d retained packets, handlers hold %d", retained_packets, (int)retained.size());
+    }
+    for (Packet *p : retained) Packet::release(p);
+    retained.clear();
+
+    // Echoes queued by a sampled request's handler are timed until they are sent
+    for (RequestTracer *t : acceptor->requestTracers()){
+        for (const TraceSample &s : t->getSamples()){
+            if (!failure.empty() || s.reply_queued_us == 0) continue;
+            if (s.reply_queued_us < s.packet_us || s.reply_queued_us > s.handler_end_us){
+                fail("client %d: reply queued at %llu us, outside its handler (%llu to %llu us)", s.client_id, s.reply_queued_us, s.packet_us, s.handler_end_us);
+            }
+            else if (s.reply_flushed_us != 0 && s.reply_flushed_us < s.handler_end_us){
+                fail("client %d: reply flushed at %llu us, before its handler returned at %llu us", s.client_id, s.reply_flushed_us, s.handler_end_us);
+            }
+        }
+    }
+
+    delete acceptor;
+    if (failure.empty() && Client::live_count != 0) fail("%d Clients not deleted with the acceptor", (int)Client::live_count);
+    if (failure.empty() && SharedPayload::live_count != 0) fail("%d shared payloads not released", (int)SharedPayload::live_count);
+
+    result.failure = failure;
+    result.packets = packets_handled;
+    result.trace_hash = sim.trace_hash;
+    SimNetwork::current = nullptr;
+    return result;
+}
+
+
+int main(int argc, char **argv){
+    BenchArgs args(argc, argv);
+    unsigned long long first_seed = args.getInt("seed", 1);
+    unsigned long long seeds = args.getInt("seeds", 100);
+    unsigned long long steps = args.getInt("steps", 5000);
+    int pools = (int)args.getInt("pools", 4);
+    int max_clients = (int)args.getInt("clients", 32);
+    bool reuse_handles = args.getInt("handle-reuse", 1) != 0;
+    huge_pages = args.getInt("huge-pages", 0) != 0;
+    budget = args.getInt("budget", 0) != 0;
+    verbose = args.getInt("verbose", 0) != 0;
+    if (pools < 1) pools = 1;
+
+    // The server logs every connection, keep it out of the way unless asked for
+    if (!verbose){
+#ifdef _WIN32
+        freopen("NUL", "w", stdout);
+#else
+        freopen("/dev/null", "w", stdout);
+#endif
+    }
+    else setvbuf(stdout, nullptr, _IONBF, 0);
+
+    unsigned long long start_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    unsigned long long total_steps = 0, total_connections = 0, total_packets = 0, first_trace_hash = 0;
+    for (unsigned long long seed = first_seed; seed < first_seed + seeds; seed++){
+        SimResult result = runSeed(seed, steps, pools, max_clients, reuse_handles);
+        if (seed == first_seed) first_trace_hash = result.trace_hash;
+        if (seed == first_seed && result.failure.empty()){
+            SimResult again = runSeed(seed, steps, pools, max_clients, reuse_handles);
+            if (again.trace_hash != result.trace_hash){
+                fprintf(stderr, "seed %llu is not deterministic: trace hash %016llx, then %016llx\n", seed, result.trace_hash, again.trace_hash);
+                return 1;
+            }
+        }
+        if (!result.failure.empty()){
+            fprintf(stderr, "seed %llu failed at step %llu: %s\n", seed, result.failed_step, result.failure.c_str());
+            fprintf(stderr, "rerun with: simulate --seed %llu --seeds 1 --steps %llu --pools %d --clients %d --handle-reuse %d --huge-pages %d --budget %d --verbose 1\n",
+                seed, steps, pools, max_clients, reuse_handles ? 1 : 0, huge_pages ? 1 : 0, budget ? 1 : 0);
+            return 1;
+        }
+        total_steps += steps;
+        total_connections += result.connections;
+        total_packets += result.packets;
+    }
+
+    unsigned long long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - start_us;
+    double seconds = elapsed_us > 0 ? elapsed_us / 1e6 : 1e-6;
+    fprintf(stderr, "%llu seeds passed: %llu steps, %llu connections, %llu packets in %.2f s (%.0f steps/s)\n",
+        seeds, total_steps, total_connections, total_packets, seconds, total_steps / seconds);
+    fprintf(stderr, "trace hash of seed %llu: %016llx\n", first_seed, first_trace_hash);
+    return 0;
+}
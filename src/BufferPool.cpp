@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "BufferPool.h"
+
+BufferPool::BufferPool(size_t max_cached_bytes, int node){
+    this->max_cached_bytes = max_cached_bytes;
+    this->node = node;
+    // Regions are only worth their cost in TLB entries, on normal pages new[] touched by the pool thread is as local
+    if (hugePagesEnabled()) this->region_size = hugePageSize();
+}
+
+BufferPool::~BufferPool(){
+    for (int c = 0; c < num_classes; c++){
+        if (this->fromRegions(min_class_size << c)) continue;
+        for (char *b : this->free_lists[c]) delete[] b;
+    }
+    for (auto &region : this->regions) freePages(region.second.pages);
+}
+
+int BufferPool::classOf(int capacity){
+    /* Smallest size class holding capacity bytes, -1 if there is none */
+    if (capacity > max_class_size) return -1;
+    int c = 0;
+    while ((min_class_size << c) < capacity) c++;
+    return c;
+}
+
+bool BufferPool::fromRegions(int class_size) const{
+    return (size_t)class_size < this->region_size;
+}
+
+bool BufferPool::addRegion(int c){
+    /* Splits a new region into buffers of class c, on the free list from the start of the region */
+    PageAllocation pages = allocatePages(this->region_size, this->node);
+    if (pages.data == nullptr) return false;
+    int class_size = min_class_size << c;
+    int count = (int)(pages.size / class_size);
+    this->regions[pages.data] = {pages, c, count, count};
+    this->region_bytes += pages.size;
+    std::vector<char *> &list = this->free_lists[c];
+    for (int i = count; i > 0; i--) list.push_back(pages.data + (size_t)(i - 1) * class_size);
+    this->cached_bytes += (size_t)count * class_size;
+    return true;
+}
+
+BufferPool::Region *BufferPool::regionOf(const char *data){
+    auto it = this->regions.upper_bound(data);
+    if (it == this->regions.begin()) return nullptr;
+    --it;
+    Region &region = it->second;
+    return data < region.pages.data + region.pages.size ? &region : nullptr;
+}
+
+void BufferPool::freeRegion(Region *region){
+    /* Rare, only when a whole region drains while the cache is over its limit, a scan of the list is fine */
+    const char *start = region->pages.data, *end = start + region->pages.size;
+    std::vector<char *> &list = this->free_lists[region->size_class];
+    list.erase(std::remove_if(list.begin(), list.end(), [&](char *b){ return b >= start && b < end; }), list.end());
+    this->cached_bytes -= (size_t)region->buffers * (min_class_size << region->size_class);
+    this->region_bytes -= region->pages.size;
+    PageAllocation pages = region->pages;
+    this->regions.erase(pages.data);
+    freePages(pages);
+}
+
+bool BufferPool::reserve(PooledBuffer &b, int capacity){
+    /* Moves the contents to a buffer of a larger class if b is too small */
+    if (b.data != nullptr && b.capacity >= capacity) return true;
+    int c = classOf(capacity);
+    if (c < 0) return false;
+
+    char *data;
+    std::vector<char *> &list = this->free_lists[c];
+    int class_size = min_class_size << c;
+    bool paged = this->fromRegions(class_size);
+    if (list.empty() && paged && !this->addRegion(c)) return false;
+    if (!list.empty()){
+        data = list.back();
+        list.pop_back();
+        this->cached_bytes -= class_size;
+        if (paged){
+            Region *region = this->regionOf(data);
+            if (region != nullptr) region->free--;
+        }
+    }
+    else {
+        data = new (std::nothrow) char[class_size];
+        if (data == nullptr) return false;
+    }
+
+    int size = 0;
+    if (b.data != nullptr){
+        size = b.size;
+        memcpy(data, b.data, size);
+        this->release(b);
+    }
+    b.data = data;
+    b.capacity = class_size;
+    b.size = size;
+    b.paged = paged;
+    this->in_use_bytes += class_size;
+    this->in_use++;
+    return true;
+}
+
+void BufferPool::release(PooledBuffer &b){
+    if (b.data == nullptr) return;
+    this->forget(b);
+    if (b.paged){
+        // Part of a region, can't be freed on its own, only with the whole region
+        this->free_lists[classOf(b.capacity)].push_back(b.data);
+        this->cached_bytes += b.capacity;
+        Region *region = this->regionOf(b.data);
+        if (region != nullptr && ++region->free == region->buffers && this->cached_bytes > this->max_cached_bytes){
+            this->freeRegion(region);
+        }
+    }
+    else if (this->cached_bytes + b.capacity <= this->max_cached_bytes){
+        this->free_lists[classOf(b.capacity)].push_back(b.data);
+        this->cached_bytes += b.capacity;
+    }
+    else delete[] b.data;
+    b = PooledBuffer();
+}
+void BufferPool::forget(const PooledBuffer &b){
+    if (b.data == nullptr) return;
+    this->in_use_bytes -= b.capacity;
+    this->in_use--;
+}
+
+void BufferPool::adopt(const PooledBuffer &b){
+    if (b.data == nullptr) return;
+    this->in_use_bytes += b.capacity;
+    this->in_use++;
+}
@@ -0,0 +1,95 @@
+#ifndef _BUFFER_POOL_H
+#define _BUFFER_POOL_H
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include "HugePages.h"
+
+// Memory taken from a BufferPool. data is nullptr while nothing is held.
+struct PooledBuffer{
+	char *data = nullptr;
+	int capacity = 0;
+	// Bytes in use
+	int size = 0;
+	// Carved from a region of its BufferPool instead of new[]
+	bool paged = false;
+};
+
+/*  Receive buffers in power of two size classes (min_class_size .. max_class_size), one pool per ConnectionPool.
+    Clients only hold a buffer while they have a partial packet and give it back as soon as it is dispatched,
+    so idle connections cost no buffer memory however large the packets they may send.
+
+    Released buffers are kept on a free list per size class, up to max_cached_bytes in total, and reused LIFO
+    (the last one released is most likely still cached). Buffers are plain new[] allocations, one that
+    outlives its pool can still be freed with delete[].
+
+    With huge pages enabled (see HugePages.h) classes smaller than a huge page are carved from regions of
+    one huge page each instead, on the pool's NUMA node (see Numa.h), so the buffers of thousands of clients
+    share a few TLB entries. Those buffers are marked paged and go back to their free list. The free buffers of regions count against
+    max_cached_bytes too: once every buffer of a region is free and more than max_cached_bytes are cached,
+    the region is freed, so a burst of partial packets doesn't keep its peak of locked pages for good.
+    Larger classes, and every class without huge pages, stay on new[]: the pool thread touching them first
+    places them on its node, and they are bounded by the cache limit alone.
+    Not thread safe, only the pool thread uses it. */
+class BufferPool{
+public:
+	static const int min_class_size = 256;
+	static const int num_classes = 18;
+	static const int max_class_size = min_class_size << (num_classes - 1);	// 32 MB
+
+	// node is the NUMA node to allocate huge page regions on, -1 for none
+	BufferPool(size_t max_cached_bytes = 4*1024*1024, int node = -1);
+	~BufferPool();
+	BufferPool(const BufferPool &) = delete;
+	BufferPool &operator=(const BufferPool &) = delete;
+
+	// Makes b hold at least capacity bytes, keeping its contents. Returns false if capacity is more than
+	// max_class_size or out of memory, b is unchanged then.
+	bool reserve(PooledBuffer &b, int capacity);
+	// Gives b's memory back, b is empty afterwards
+	void release(PooledBuffer &b);
+
+	// For clients moving between pools, see ConnectionPool::removeFromList()/addToList(). A paged buffer
+	// still points into its old pool's region, which is fine as long as pools are destroyed together.
+	void forget(const PooledBuffer &b);
+	void adopt(const PooledBuffer &b);
+
+	// Bytes held by clients / kept for reuse (including unused parts of regions)
+	size_t bytesInUse() const{ return this->in_use_bytes; }
+	size_t bytesCached() const{ return this->cached_bytes; }
+	int buffersInUse() const{ return this->in_use; }
+	// Bytes of huge page regions, part of the two above
+	size_t bytesInRegions() const{ return this->region_bytes; }
+
+protected:
+	static int classOf(int capacity);
+	bool fromRegions(int class_size) const;
+	struct Region{
+		PageAllocation pages;
+		int size_class;
+		int buffers;
+		// Buffers of the region on the free list
+		int free;
+	};
+	// Carves a new region into buffers of class c
+	bool addRegion(int c);
+	// Region of this pool holding data, nullptr for a buffer from another pool (see forget())
+	Region *regionOf(const char *data);
+	// Takes the region's buffers off their free list and frees it, all of them must be free
+	void freeRegion(Region *region);
+
+	std::vector<char *> free_lists[num_classes];
+	// By start address
+	std::map<const char *, Region> regions;
+	// Set when constructed, huge pages are enabled before any pool exists. 0 for no regions.
+	size_t region_size = 0;
+	int node;
+	size_t region_bytes = 0;
+	size_t max_cached_bytes;
+	size_t cached_bytes = 0;
+	size_t in_use_bytes = 0;
+	int in_use = 0;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "EpochReclaimer.h"
+
+EpochReclaimer::EpochReclaimer(int num_participants) : participants(num_participants > 0 ? num_participants : 1){
+}
+
+EpochReclaimer::~EpochReclaimer(){
+    for (Participant &p : this->participants){
+        for (Retired &r : p.retired) r.destroy(r.object);
+        this->pending -= (long long)p.retired.size();
+        p.retired.clear();
+    }
+}
+
+void EpochReclaimer::enter(int participant){
+    /* Announces the current epoch. Sequentially consistent so that a thread advancing the epoch
+       either sees the announcement or this participant sees the new epoch. */
+    this->participants[participant].epoch.store(this->global_epoch.load());
+}
+
+void EpochReclaimer::exit(int participant){
+    this->participants[participant].epoch.store(0, std::memory_order_release);
+}
+
+void EpochReclaimer::retire(int participant, void *object, destroyFunction_t destroy){
+    this->participants[participant].retired.push_back({object, destroy, this->global_epoch.load()});
+    this->pending.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool EpochReclaimer::tryAdvance(){
+    /* Moves the epoch on if every participant inside has seen the current one */
+    unsigned long long epoch = this->global_epoch.load();
+    for (Participant &p : this->participants){
+        unsigned long long seen = p.epoch.load();
+        if (seen != 0 && seen != epoch) return false;
+    }
+    return this->global_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+void EpochReclaimer::reclaim(int participant){
+    /* An object retired in epoch e may still be held by participants that entered in e (or e - 1 if they
+       read the epoch just before it moved), all of them have exited once the epoch reaches e + 2 */
+    std::vector<Retired> &retired = this->participants[participant].retired;
+    if (retired.empty()) return;
+    // Twice, a lone participant can free what it retired right away
+    if (this->tryAdvance()) this->tryAdvance();
+
+    unsigned long long epoch = this->global_epoch.load();
+    size_t freed = 0;
+    // Retired in epoch order
+    while (freed < retired.size() && retired[freed].epoch + 2 <= epoch){
+        retired[freed].destroy(retired[freed].object);
+        freed++;
+    }
+    if (freed == 0) return;
+    retired.erase(retired.begin(), retired.begin() + freed);
+    this->pending.fetch_sub((long long)freed, std::memory_order_relaxed);
+}
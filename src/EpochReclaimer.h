@@ -0,0 +1,62 @@
+#ifndef _EPOCH_RECLAIMER_H
+#define _EPOCH_RECLAIMER_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/*  Epoch based reclamation of objects shared between threads, used for Clients.
+
+    Every thread that can hold pointers to such objects is a participant with a fixed index (pools use their
+    id). A participant enters before it touches any and exits when it holds none anymore, for a pool that
+    is one event loop iteration: between two iterations it only keeps the clients of its own list, which
+    aren't retired. An object is retired once no new reader can find it (a pool retires a client after
+    removing it from its list) and freed once every participant has exited at least once since, i.e. the
+    global epoch moved on twice.
+
+    Participants only write their own slot and retire list, freeing is done by the participant that
+    retired the object. Blocked participants (a pool in epoll_wait) are outside and never hold up others.
+    Timers or cross pool messages holding client pointers would simply be more participants. */
+class EpochReclaimer{
+public:
+	using destroyFunction_t = void(*)(void *);
+
+	EpochReclaimer(int num_participants);
+	// Frees everything still retired, every participant must have stopped
+	~EpochReclaimer();
+	EpochReclaimer(const EpochReclaimer &) = delete;
+	EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+	void enter(int participant);
+	void exit(int participant);
+	// destroy(object) runs on this participant's thread once nobody can hold object anymore
+	void retire(int participant, void *object, destroyFunction_t destroy);
+	// Frees what this participant retired that is safe by now. Call outside enter()/exit().
+	void reclaim(int participant);
+
+	unsigned long long getEpoch(){ return this->global_epoch.load(std::memory_order_relaxed); }
+	// Retired objects not freed yet, safe to call from any thread
+	long long getPendingCount(){ return this->pending.load(std::memory_order_relaxed); }
+
+protected:
+	bool tryAdvance();
+
+	struct Retired{
+		void *object;
+		destroyFunction_t destroy;
+		unsigned long long epoch;
+	};
+	// One cache line each, a participant's slot is written twice per loop iteration
+	struct alignas(64) Participant{
+		// Epoch seen when entering, 0 while outside
+		std::atomic<unsigned long long> epoch = 0;
+		// Only touched by the participant
+		std::vector<Retired> retired;
+	};
+
+	std::vector<Participant> participants;
+	alignas(64) std::atomic<unsigned long long> global_epoch = 1;
+	std::atomic<long long> pending = 0;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+
+#include "HandlerWatchdog.h"
+#include "clock.h"
+
+
+void HandlerSlot::begin(int client_id, const char *buffer, int num_bytes){
+    unsigned long long words[num_saved_bytes / 8] = {0};
+    memcpy(words, buffer, num_bytes < num_saved_bytes ? num_bytes : num_saved_bytes);
+
+    unsigned int s = this->seq.load(std::memory_order_relaxed);
+    this->seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    this->client_id.store(client_id, std::memory_order_relaxed);
+    this->num_bytes.store(num_bytes, std::memory_order_relaxed);
+    for (int i = 0; i < num_saved_bytes / 8; i++){
+        this->first_bytes[i].store(words[i], std::memory_order_relaxed);
+    }
+    this->call_count.store(this->call_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    this->start_us.store(getMonotonicTimeUS(), std::memory_order_relaxed);
+
+    this->seq.store(s + 2, std::memory_order_release);
+}
+
+void HandlerSlot::end(){
+    unsigned int s = this->seq.load(std::memory_order_relaxed);
+    this->seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->start_us.store(0, std::memory_order_relaxed);
+    this->seq.store(s + 2, std::memory_order_release);
+}
+
+
+HandlerWatchdog::HandlerWatchdog(int num_pools, int budget_ms) : slots(num_pools), last_reported(num_pools, 0){
+    this->budget_ms = budget_ms;
+    this->monitor_thread = std::thread(&HandlerWatchdog::monitor, this);
+}
+
+HandlerWatchdog::~HandlerWatchdog(){
+    this->running = false;
+    if (this->monitor_thread.joinable()) this->monitor_thread.join();
+}
+
+void HandlerWatchdog::monitor(){
+    /* Polls every pool's slot a few times per budget and reports calls that exceeded it. */
+    int interval_ms = this->budget_ms / 4 > 0 ? this->budget_ms / 4 : 1;
+    unsigned long long budget_us = (unsigned long long)this->budget_ms * 1000;
+
+    while (this->running){
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        unsigned long long now = getMonotonicTimeUS();
+
+        for (int pool_id = 0; pool_id < (int)this->slots.size(); pool_id++){
+            HandlerSlot &slot = this->slots[pool_id];
+
+            unsigned int s1 = slot.seq.load(std::memory_order_acquire);
+            // Pool is writing the slot, check again next round
+            if (s1 & 1) continue;
+
+            unsigned long long start = slot.start_us.load(std::memory_order_relaxed);
+            unsigned long long call = slot.call_count.load(std::memory_order_relaxed);
+            int client_id = slot.client_id.load(std::memory_order_relaxed);
+            int num_bytes = slot.num_bytes.load(std::memory_order_relaxed);
+            unsigned long long words[HandlerSlot::num_saved_bytes / 8];
+            for (int i = 0; i < HandlerSlot::num_saved_bytes / 8; i++){
+                words[i] = slot.first_bytes[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Slot changed while reading it
+            if (slot.seq.load(std::memory_order_relaxed) != s1) continue;
+
+            if (start == 0 || now < start || now - start < budget_us) continue;
+            // Already reported this call
+            if (this->last_reported[pool_id] == call) continue;
+            this->last_reported[pool_id] = call;
+
+            this->report(pool_id, client_id, now - start, num_bytes, (const unsigned char *)words);
+        }
+    }
+}
+
+void HandlerWatchdog::report(int pool_id, int client_id, unsigned long long running_us, int num_bytes, const unsigned char *bytes){
+    unsigned long long count;
+    {
+        std::lock_guard<std::mutex> lock(this->counts_mutex);
+        count = ++this->slow_call_counts[client_id];
+    }
+    this->total_slow_calls++;
+
+    char hex[HandlerSlot::num_saved_bytes * 3 + 1] = {0};
+    int n = num_bytes < HandlerSlot::num_saved_bytes ? num_bytes : HandlerSlot::num_saved_bytes;
+    for (int i = 0; i < n; i++){
+        snprintf(hex + i*3, 4, "%02x ", bytes[i]);
+    }
+
+    printf("[Watchdog] Slow handler on pool %d: client %d running for %llu ms (budget %d ms, slow calls for client: %llu), packet %d bytes: %s\n",
+        pool_id, client_id, running_us / 1000, this->budget_ms, count, num_bytes, hex);
+}
+
+std::unordered_map<int, unsigned long long> HandlerWatchdog::getSlowCallCounts(){
+    std::lock_guard<std::mutex> lock(this->counts_mutex);
+    return this->slow_call_counts;
+}
@@ -0,0 +1,62 @@
+#ifndef _HANDLER_WATCHDOG_H
+#define _HANDLER_WATCHDOG_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+/*  Slot where a pool publishes the handler call it is currently running.
+    Written only by its pool thread and read by the watchdog thread, using a sequence
+    counter (seqlock) so the pool never takes a lock or a locked instruction. */
+struct alignas(64) HandlerSlot{
+	static const int num_saved_bytes = 32;
+
+	// Called by the pool thread around handle_function
+	void begin(int client_id, const char *buffer, int num_bytes);
+	void end();
+
+	// Odd while the pool thread is writing the slot
+	std::atomic<unsigned int> seq = 0;
+	// Monotonic start time of the current handler call, 0 when no handler is running
+	std::atomic<unsigned long long> start_us = 0;
+	std::atomic<unsigned long long> call_count = 0;
+	std::atomic<int> client_id = 0;
+	std::atomic<int> num_bytes = 0;
+	// First bytes of the packet being handled
+	std::atomic<unsigned long long> first_bytes[num_saved_bytes / 8];
+};
+
+/*  Monitor thread flagging handler calls running longer than a budget.
+    Every slow call is reported once with its pool id, client id and first bytes of the packet,
+    and counted per client. */
+class HandlerWatchdog{
+public:
+	HandlerWatchdog(int num_pools, int budget_ms);
+	~HandlerWatchdog();
+
+	HandlerSlot *getSlot(int pool_id){ return &this->slots[pool_id]; }
+	// Number of slow handler calls per client id. Safe to call from any thread.
+	std::unordered_map<int, unsigned long long> getSlowCallCounts();
+	unsigned long long getTotalSlowCalls(){ return this->total_slow_calls; }
+
+	int budget_ms;
+
+protected:
+	void monitor();
+	void report(int pool_id, int client_id, unsigned long long running_us, int num_bytes, const unsigned char *bytes);
+
+	std::vector<HandlerSlot> slots;
+	// Last call_count reported per slot, only touched by the monitor thread
+	std::vector<unsigned long long> last_reported;
+
+	std::mutex counts_mutex;
+	std::unordered_map<int, unsigned long long> slow_call_counts;
+	std::atomic<unsigned long long> total_slow_calls = 0;
+
+	std::atomic<bool> running = true;
+	std::thread monitor_thread;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <windows.h>
+#include <atomic>
+#include <cstdio>
+#include "HugePages.h"
+
+static const size_t normal_page_size = 4096;
+
+// Only written by enableHugePages(), before pools exist
+static bool huge_enabled = false;
+static size_t huge_page_size = 0;
+
+static std::atomic<size_t> huge_bytes = 0;
+static std::atomic<size_t> normal_bytes = 0;
+static std::atomic<int> fallbacks = 0;
+
+static bool enableLockMemoryPrivilege(){
+    /* Large pages need SeLockMemoryPrivilege enabled in the process token, holding the right isn't enough */
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) return false;
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+        // Succeeds with ERROR_NOT_ALL_ASSIGNED if the user doesn't hold the right
+        && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return enabled;
+}
+
+bool enableHugePages(){
+    if (huge_enabled) return true;
+    size_t page_size = GetLargePageMinimum();
+    if (page_size == 0){
+        printf("[Warning] Huge pages are not supported on this system, using normal pages\n");
+        return false;
+    }
+    if (!enableLockMemoryPrivilege()){
+        printf("[Warning] Huge pages need the \"Lock pages in memory\" user right (SeLockMemoryPrivilege), using normal pages\n");
+        return false;
+    }
+    huge_page_size = page_size;
+    huge_enabled = true;
+    return true;
+}
+
+bool hugePagesEnabled(){
+    return huge_enabled;
+}
+
+size_t hugePageSize(){
+    return huge_page_size;
+}
+
+static char *virtualAlloc(size_t size, DWORD type, int node){
+    if (node < 0) return (char *)VirtualAlloc(NULL, size, type, PAGE_READWRITE);
+    return (char *)VirtualAllocExNuma(GetCurrentProcess(), NULL, size, type, PAGE_READWRITE, (DWORD)node);
+}
+
+PageAllocation allocatePages(size_t size, int node, bool allow_huge){
+    PageAllocation a;
+    if (size == 0) size = 1;
+    if (huge_enabled && allow_huge){
+        size_t rounded = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+        a.data = virtualAlloc(rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, node);
+        if (a.data != nullptr){
+            a.size = rounded;
+            a.huge = true;
+            huge_bytes += rounded;
+            return a;
+        }
+        // Not enough physically contiguous memory left
+        if (fallbacks++ == 0) printf("[Warning] Out of huge pages (error %d), falling back to normal pages\n", (int)GetLastError());
+    }
+    size_t rounded = (size + normal_page_size - 1) / normal_page_size * normal_page_size;
+    a.data = virtualAlloc(rounded, MEM_RESERVE | MEM_COMMIT, node);
+    if (a.data == nullptr) return PageAllocation();
+    a.size = rounded;
+    normal_bytes += rounded;
+    return a;
+}
+
+void freePages(PageAllocation &a){
+    if (a.data == nullptr) return;
+    VirtualFree(a.data, 0, MEM_RELEASE);
+    if (a.huge) huge_bytes -= a.size;
+    else normal_bytes -= a.size;
+    a = PageAllocation();
+}
+
+HugePageStats getHugePageStats(){
+    HugePageStats s;
+    s.enabled = huge_enabled;
+    s.page_size = huge_page_size;
+    s.huge_pages = huge_enabled ? huge_bytes.load() / huge_page_size : 0;
+    s.normal_bytes = normal_bytes.load();
+    s.fallbacks = fallbacks.load();
+    return s;
+}
+
+void printHugePageStats(){
+    HugePageStats s = getHugePageStats();
+    if (!s.enabled){
+        printf("Huge pages: off, %llu KB on normal pages\n", (unsigned long long)s.normal_bytes / 1024);
+        return;
+    }
+    printf("Huge pages: %llu x %llu KB in use (%llu MB), %llu KB on normal pages, %d fallback(s)\n",
+        (unsigned long long)s.huge_pages, (unsigned long long)s.page_size / 1024,
+        (unsigned long long)(s.huge_pages * s.page_size) / (1024 * 1024), (unsigned long long)s.normal_bytes / 1024, s.fallbacks);
+}
@@ -0,0 +1,50 @@
+#ifndef _HUGE_PAGES_H
+#define _HUGE_PAGES_H
+
+#include <cstddef>
+
+/*  Page granular memory for long lived storage that every event touches somewhere: ClientSlab chunks and
+    BufferPool regions. With hundreds of thousands of clients that memory spans millions of 4 KB pages and
+    TLB misses show up, on large pages (2 MB on x64) it needs a few hundred TLB entries instead.
+
+    Large pages are off until enableHugePages() is called (TcpConnectionAcceptor does when constructed with
+    huge_pages). Windows has no transparent huge pages, they are always explicit: the process needs the
+    "Lock pages in memory" user right (SeLockMemoryPrivilege), the memory is never paged out and has to be
+    physically contiguous. An allocation that can't get large pages falls back to normal pages. */
+struct PageAllocation{
+	char *data = nullptr;
+	// Bytes allocated, the requested size rounded up to whole pages
+	size_t size = 0;
+	bool huge = false;
+};
+
+struct HugePageStats{
+	bool enabled = false;
+	// Size of one large page, 0 if they aren't enabled
+	size_t page_size = 0;
+	// Large pages allocated right now
+	size_t huge_pages = 0;
+	// Bytes allocatePages() put on normal pages, because large pages are off or ran out
+	size_t normal_bytes = 0;
+	// Allocations that wanted large pages and fell back to normal pages
+	int fallbacks = 0;
+};
+
+// Enables large pages for allocatePages(). Call before creating any pool. Returns false and prints why if
+// they are unavailable, allocations stay on normal pages then.
+bool enableHugePages();
+bool hugePagesEnabled();
+// Size of one large page, 0 if they aren't enabled
+size_t hugePageSize();
+
+// Zeroed memory of at least size bytes, on large pages if enabled and allow_huge is set (rounded up to whole
+// large pages), normal pages otherwise. Placed on NUMA node node if it is >= 0 (see Numa.h), wherever the
+// first thread touching it runs otherwise. data is nullptr if out of memory. Safe to call from any thread.
+PageAllocation allocatePages(size_t size, int node = -1, bool allow_huge = true);
+// Frees a and clears it
+void freePages(PageAllocation &a);
+
+HugePageStats getHugePageStats();
+void printHugePageStats();
+
+#endif
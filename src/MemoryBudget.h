@@ -0,0 +1,48 @@
+#ifndef _MEMORY_BUDGET_H
+#define _MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include "SharedPayload.h"
+
+/*  Limits on the memory clients can pin, set with TcpConnectionAcceptor::setMemoryBudget().
+
+    A client holds the bytes of its partial packet and its queued output (see ConnectionPool::send()). Its
+    pool checks both against client_quota whenever they change:
+        over the quota                  the pool stops reading from the client (no EPOLLIN) until its output
+                                        drains, so it can't make the server produce more for it. If the peer
+                                        finishes sending meanwhile its output is still sent, the rest of what
+                                        it sent and its EOF are read once reading resumes.
+        over twice the quota, or a      the client is disconnected
+        packet announced larger than
+        the quota
+    Give clients at least the largest packet they may send.
+
+    Process wide, used() adds up the partial packet buffers of every pool and every live SharedPayload, a
+    broadcast counts once however many clients it is queued to. Once used() exceeds global_limit every pool
+    stops reading from all its clients holding memory. Reading resumes once used() is below 90% of the limit,
+    if that takes longer than shed_after_ms the pool disconnects the client holding the most, one per loop
+    iteration, until it is.
+
+    Pools report their partial buffers once per loop iteration, the limits are read only. */
+class MemoryBudget{
+public:
+	MemoryBudget(size_t global_limit, size_t client_quota) : global_limit(global_limit), client_quota(client_quota){}
+
+	const size_t global_limit;
+	const size_t client_quota;
+	static const int shed_after_ms = 1000;
+
+	// Change in bytes of a pool's partial packet buffers, any thread
+	void add(long long bytes){ this->partial_bytes.fetch_add(bytes, std::memory_order_relaxed); }
+	size_t used() const{
+		long long used = this->partial_bytes.load(std::memory_order_relaxed) + SharedPayload::live_bytes.load(std::memory_order_relaxed);
+		return used > 0 ? (size_t)used : 0;
+	}
+	bool overLimit() const{ return this->used() > this->global_limit; }
+
+private:
+	std::atomic<long long> partial_bytes{0};
+};
+
+#endif
@@ -0,0 +1,23 @@
+#include <windows.h>
+#include "Numa.h"
+
+int getNumaNodeCount(){
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest)) return 1;
+    return (int)highest + 1;
+}
+
+bool bindThreadToNumaNode(int node){
+    /* Node numbers can have gaps, a node without processors can't take a thread */
+    GROUP_AFFINITY affinity = {};
+    if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0) return false;
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != 0;
+}
+
+int getCurrentNumaNode(){
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+    USHORT node = 0;
+    if (!GetNumaProcessorNodeEx(&processor, &node)) return 0;
+    return node;
+}
@@ -0,0 +1,17 @@
+#ifndef _NUMA_H
+#define _NUMA_H
+
+/*  NUMA topology for placing pools. On a machine with several nodes TcpConnectionAcceptor spreads the pools
+    over them round robin: a pool's thread only runs on its node's processors and its clients and arena are
+    allocated there (allocatePages() with the pool's node), so the pool thread never reads memory through the
+    interconnect. Partial packet buffers are new[] first touched by the pool thread, or huge page regions on
+    the node when huge pages are on. Machines with one node skip all of it. */
+
+// Number of NUMA nodes, 1 on machines without NUMA
+int getNumaNodeCount();
+// Restricts the calling thread to the processors of node. Returns false if the node has none.
+bool bindThreadToNumaNode(int node);
+// Node of the processor the calling thread is running on
+int getCurrentNumaNode();
+
+#endif
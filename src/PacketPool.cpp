@@ -0,0 +1,132 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "PacketPool.h"
+
+PacketPool::PacketPool(int node, size_t max_cached_bytes){
+    this->node = node;
+    this->max_cached_bytes = max_cached_bytes;
+    for (int c = 0; c < num_classes; c++) this->returned_buffers[c] = nullptr;
+}
+
+PacketPool::~PacketPool(){
+    int retained = this->in_use.load(std::memory_order_acquire);
+    if (retained != 0){
+        // Their nodes go with the pool, releasing one later would write freed memory
+        printf("[Error] Packet pool destroyed with %d retained packets, release them before the acceptor is destroyed\n", retained);
+        abort();
+    }
+    for (int c = 0; c < num_classes; c++){
+        for (char *b : this->free_buffers[c]) delete[] b;
+        for (char *b = this->returned_buffers[c].load(std::memory_order_acquire); b != nullptr; ){
+            char *next;
+            memcpy(&next, b, sizeof(next));
+            delete[] b;
+            b = next;
+        }
+    }
+    for (PageAllocation &chunk : this->chunks) freePages(chunk);
+}
+
+int PacketPool::classOf(int size){
+    int c = 0;
+    while ((min_buffer_size << c) < size) c++;
+    return c;
+}
+
+void PacketPool::grow(int count){
+    /* Adds at least count nodes, as many as the pages of the new chunk hold. Never on huge pages, a few
+       hundred nodes would lock a whole 2 MB page. */
+    PageAllocation chunk = allocatePages((size_t)count * sizeof(Slot), this->node, false);
+    if (chunk.data == nullptr) return;
+    this->chunks.push_back(chunk);
+    Slot *slots = (Slot *)chunk.data;
+    count = (int)(chunk.size / sizeof(Slot));
+    this->total += count;
+    // Room for every node up front, taking over returned nodes never allocates
+    this->free_slots.reserve(this->total);
+    for (int i = count - 1; i >= 0; i--) this->free_slots.push_back(&slots[i]);
+}
+
+PacketPool::Slot *PacketPool::takeSlot(){
+    if (this->free_slots.empty()){
+        // Take over everything released since the last time
+        for (Slot *slot = this->returned.exchange(nullptr, std::memory_order_acquire); slot != nullptr; ){
+            Slot *next = slot->next;
+            this->free_slots.push_back(slot);
+            slot = next;
+        }
+    }
+    if (this->free_slots.empty()) this->grow(this->total > 0 ? this->total : initial_nodes);
+    if (this->free_slots.empty()) return nullptr;
+    Slot *slot = this->free_slots.back();
+    this->free_slots.pop_back();
+    return slot;
+}
+
+char *PacketPool::takeBuffer(int c){
+    size_t class_size = (size_t)min_buffer_size << c;
+    if (this->free_buffers[c].empty()){
+        for (char *b = this->returned_buffers[c].exchange(nullptr, std::memory_order_acquire); b != nullptr; ){
+            char *next;
+            memcpy(&next, b, sizeof(next));
+            if (this->cached_bytes + class_size <= this->max_cached_bytes){
+                this->free_buffers[c].push_back(b);
+                this->cached_bytes += class_size;
+            }
+            else delete[] b;
+            b = next;
+        }
+    }
+    if (this->free_buffers[c].empty()) return new (std::nothrow) char[class_size];
+    char *b = this->free_buffers[c].back();
+    this->free_buffers[c].pop_back();
+    this->cached_bytes -= class_size;
+    return b;
+}
+
+Packet *PacketPool::create(const char *payload, int size){
+    Slot *slot = this->takeSlot();
+    if (slot == nullptr) return nullptr;
+    Packet *p = new (slot) Packet();
+    p->pool = this;
+    if (size <= Packet::inline_capacity){
+        p->data = p->inline_data;
+    }
+    else if (size <= max_buffer_size){
+        p->buffer_class = (unsigned char)classOf(size);
+        p->data = this->takeBuffer(p->buffer_class);
+        p->storage = Packet::POOLED;
+    }
+    else {
+        p->data = new (std::nothrow) char[size];
+        p->storage = Packet::HEAP;
+    }
+    if (p->data == nullptr){
+        p->~Packet();
+        this->free_slots.push_back(slot);
+        return nullptr;
+    }
+    memcpy(p->data, payload, size);
+    p->size = size;
+    this->in_use.fetch_add(1, std::memory_order_relaxed);
+    return p;
+}
+
+void PacketPool::destroy(Packet *p){
+    if (p->storage == Packet::POOLED){
+        std::atomic<char *> &list = this->returned_buffers[p->buffer_class];
+        char *b = p->data;
+        char *head = list.load(std::memory_order_relaxed);
+        do{
+            memcpy(b, &head, sizeof(head));
+        } while (!list.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+    }
+    p->~Packet();
+    Slot *slot = (Slot *)p;
+    slot->next = this->returned.load(std::memory_order_relaxed);
+    while (!this->returned.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed));
+    // Release, the destructor must see the node pushed before the count drops
+    this->in_use.fetch_sub(1, std::memory_order_release);
+}
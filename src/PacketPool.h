@@ -0,0 +1,70 @@
+#ifndef _PACKET_POOL_H
+#define _PACKET_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include "HugePages.h"
+#include "client.h"
+
+/*  Storage for packets kept past their handler (Packet::retain()), one per ConnectionPool.
+    Every retained packet is a fixed size node holding payloads up to Packet::inline_capacity inline, so
+    retaining a small message allocates nothing once the pool is warm. Larger payloads take a buffer from
+    power of two classes (min_buffer_size .. max_buffer_size), beyond that they go on the heap.
+
+    Packets are created by the pool thread only and released by whichever thread consumed them, which
+    pushes the node (and buffer) on a lock free list that create() takes over in one exchange when its own
+    free list runs dry, like ClientSlab. Nodes come in chunks from allocatePages() on the pool's NUMA node,
+    on normal pages even with huge pages on, the first when the first packet is retained. Nodes are kept until the pool is destroyed, buffers up to
+    max_cached_bytes. */
+class PacketPool{
+public:
+	static const int min_buffer_size = 256;
+	static const int num_classes = 9;
+	static const int max_buffer_size = min_buffer_size << (num_classes - 1);	// 64 KB
+	static const int initial_nodes = 256;
+
+	// node is the NUMA node of the owning pool, -1 for none
+	PacketPool(int node = -1, size_t max_cached_bytes = 1024*1024);
+	// Every packet of this pool must have been released, aborts otherwise
+	~PacketPool();
+	PacketPool(const PacketPool &) = delete;
+	PacketPool &operator=(const PacketPool &) = delete;
+
+	// Pool thread only. Returns nullptr if out of memory.
+	Packet *create(const char *payload, int size);
+	// Any thread
+	void destroy(Packet *p);
+
+	// Retained packets not released yet
+	int inUse(){ return this->in_use.load(std::memory_order_relaxed); }
+	int capacity(){ return this->total; }
+
+protected:
+	struct alignas(Packet) Slot{
+		union{
+			unsigned char bytes[sizeof(Packet)];
+			// Next slot on the returned list
+			Slot *next;
+		};
+	};
+	static int classOf(int size);
+	void grow(int count);
+	Slot *takeSlot();
+	char *takeBuffer(int c);
+
+	std::vector<PageAllocation> chunks;
+	int node;
+	// Pool thread only, last freed first
+	std::vector<Slot *> free_slots;
+	std::vector<char *> free_buffers[num_classes];
+	size_t cached_bytes = 0;
+	size_t max_cached_bytes;
+	int total = 0;
+	std::atomic<int> in_use = 0;
+	// Released by any thread, pushed one by one and taken all at once. A buffer's first bytes link it.
+	alignas(64) std::atomic<Slot *> returned = nullptr;
+	std::atomic<char *> returned_buffers[num_classes];
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _REQUEST_ARENA_H
+#define _REQUEST_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "HugePages.h"
+
+/*  Bump pointer arena for memory that only has to live while one batch of events is handled.
+    Every pool owns one and resets it after each epoll_wait batch (ConnectionPool::serveOnce()).
+    Packets are copied into it and handlers reach it through Packet::arena for their scratch memory,
+    so a request/response handler doesn't need the heap at all.
+
+    Nothing is destructed on reset, only put trivially destructible data here. Anything that must
+    outlive the batch goes on the heap as before, Packet::detach() copies a payload there.
+
+    Allocation never frees: a batch that doesn't fit adds blocks, and the next reset() replaces all of
+    them with one block large enough for that batch. A steady workload settles on a single block and
+    stops calling malloc. A batch needing more than max_retained (a few large packets) doesn't pin that
+    much memory, the arena goes back to its initial size after it. Blocks are whole pages from allocatePages(),
+    on the NUMA node given (the pool's). Not thread safe, only the pool thread uses it. */
+class RequestArena{
+public:
+	RequestArena(size_t initial_size = 64*1024, size_t max_retained = 1024*1024, int node = -1){
+		this->initial_size = initial_size;
+		this->max_retained = max_retained;
+		this->node = node;
+		this->addBlock(initial_size);
+	}
+	~RequestArena(){
+		for (PageAllocation &b : this->blocks) freePages(b);
+	}
+	RequestArena(const RequestArena &) = delete;
+	RequestArena &operator=(const RequestArena &) = delete;
+
+	// Returns nullptr if out of memory. align must be a power of two.
+	void *allocate(size_t size, size_t align = alignof(std::max_align_t)){
+		uintptr_t base = this->blocks.empty() ? 0 : (uintptr_t)this->blocks.back().data;
+		uintptr_t start = (base + this->used + align - 1) & ~(uintptr_t)(align - 1);
+		if (this->blocks.empty() || start + size > base + this->block_size){
+			size_t grow = this->block_size * 2 > size + align ? this->block_size * 2 : size + align;
+			if (!this->addBlock(grow)) return nullptr;
+			base = (uintptr_t)this->blocks.back().data;
+			start = (base + align - 1) & ~(uintptr_t)(align - 1);
+		}
+		this->used = start + size - base;
+		this->allocated += size;
+		return (void *)start;
+	}
+
+	template<class T>
+	T *allocateArray(size_t count){
+		return (T *)this->allocate(count * sizeof(T), alignof(T));
+	}
+
+	// Copy of size bytes of src, nullptr if out of memory
+	char *copy(const char *src, size_t size){
+		char *dst = (char *)this->allocate(size, 1);
+		if (dst != nullptr && size > 0) memcpy(dst, src, size);
+		return dst;
+	}
+
+	// Invalidates everything allocated since the last reset
+	void reset(){
+		if (this->blocks.size() > 1 || this->reserved > this->max_retained){
+			size_t total = this->reserved <= this->max_retained ? this->reserved : this->initial_size;
+			for (PageAllocation &b : this->blocks) freePages(b);
+			this->blocks.clear();
+			this->reserved = 0;
+			this->addBlock(total);
+		}
+		this->used = 0;
+		this->allocated = 0;
+	}
+
+	// Bytes held by the arena
+	size_t capacity() const{ return this->reserved; }
+	// Bytes handed out since the last reset
+	size_t bytesAllocated() const{ return this->allocated; }
+
+protected:
+	bool addBlock(size_t size){
+		// Never on huge pages, every block would be rounded up to one
+		PageAllocation b = allocatePages(size, this->node, false);
+		if (b.data == nullptr) return false;
+		this->blocks.push_back(b);
+		this->block_size = b.size;
+		this->reserved += b.size;
+		this->used = 0;
+		return true;
+	}
+
+	// The last block is the one being filled
+	std::vector<PageAllocation> blocks;
+	size_t initial_size, max_retained;
+	int node;
+	size_t block_size = 0;
+	size_t used = 0;
+	size_t reserved = 0;
+	size_t allocated = 0;
+};
+
+#endif
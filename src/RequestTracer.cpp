@@ -0,0 +1,65 @@
+#include <cstdio>
+#include "RequestTracer.h"
+
+
+RequestTracer::RequestTracer(int pool_id, int sample_every, int capacity){
+    this->pool_id = pool_id;
+    this->sample_every = sample_every > 0 ? sample_every : 1;
+    // Preallocate so recording never allocates
+    this->samples.resize(capacity > 0 ? capacity : 1);
+}
+
+void RequestTracer::record(const TraceSample &sample){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->samples[this->next] = sample;
+    this->next++;
+    if (this->next == (int)this->samples.size()){
+        this->next = 0;
+        this->wrapped = true;
+    }
+}
+
+std::vector<TraceSample> RequestTracer::getSamples(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->wrapped) return std::vector<TraceSample>(this->samples.begin(), this->samples.begin() + this->next);
+
+    std::vector<TraceSample> result(this->samples.begin() + this->next, this->samples.end());
+    result.insert(result.end(), this->samples.begin(), this->samples.begin() + this->next);
+    return result;
+}
+
+static void writeSpan(FILE *f, bool &first, const char *name, const TraceSample &s, unsigned long long start, unsigned long long end){
+    if (end < start) end = start;
+    fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"args\":{\"client\":%d,\"bytes\":%d}}",
+        first ? "" : ",", name, s.pool_id, start, end - start, s.client_id, s.num_bytes);
+    first = false;
+}
+
+bool RequestTracer::exportChromeTrace(const std::vector<TraceSample> &samples, const char *path){
+    FILE *f = fopen(path, "w");
+    if (f == nullptr){
+        printf("Could not open %s for writing request trace\n", path);
+        return false;
+    }
+
+    bool first = true;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (const TraceSample &s : samples){
+        // Parent span first so viewers nest the stages below it
+        unsigned long long end_us = s.reply_flushed_us > s.handler_end_us ? s.reply_flushed_us : s.handler_end_us;
+        writeSpan(f, first, "request", s, s.readable_us, end_us);
+        writeSpan(f, first, "queued", s, s.readable_us, s.recv_start_us);
+        writeSpan(f, first, "recv", s, s.recv_start_us, s.recv_end_us);
+        writeSpan(f, first, "packet", s, s.recv_end_us, s.packet_us);
+        writeSpan(f, first, "handler", s, s.packet_us, s.handler_end_us);
+        if (s.reply_queued_us != 0 && s.reply_flushed_us != 0){
+            // Starts inside the handler, at the first send the socket didn't take completely
+            writeSpan(f, first, "reply queued", s, s.reply_queued_us, s.reply_flushed_us);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
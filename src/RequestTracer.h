@@ -0,0 +1,44 @@
+#ifndef _REQUEST_TRACER_H
+#define _REQUEST_TRACER_H
+
+#include <mutex>
+#include <vector>
+
+// Timestamps (getMonotonicTimeUS) of one sampled request as it moves through ConnectionPool::serveForever
+struct TraceSample{
+	int pool_id = 0;
+	int client_id = 0;
+	int num_bytes = 0;
+	unsigned long long readable_us = 0;		// epoll_wait returned with the socket readable
+	unsigned long long recv_start_us = 0;	// recv_* and readable_us are those of the recv completing the packet
+	unsigned long long recv_end_us = 0;
+	unsigned long long packet_us = 0;		// Packet complete and ready for the handler
+	unsigned long long handler_end_us = 0;
+	unsigned long long reply_queued_us = 0;	// The socket didn't take the whole reply, 0 if it did (or there was none)
+	unsigned long long reply_flushed_us = 0;	// Last queued byte of the reply sent, 0 if the connection closed first
+};
+
+/*  Fixed size ring of sampled requests for one pool. Only sampled requests (1 in sample_every)
+    reach record(), so the lock is never taken on the unsampled path. */
+class RequestTracer{
+public:
+	RequestTracer(int pool_id, int sample_every, int capacity = 16384);
+
+	void record(const TraceSample &sample);
+	// Copy of the recorded samples, oldest first
+	std::vector<TraceSample> getSamples();
+
+	// Writes samples as Chrome trace-event JSON (chrome://tracing, Perfetto). Returns false if the file couldn't be written.
+	static bool exportChromeTrace(const std::vector<TraceSample> &samples, const char *path);
+
+	int pool_id;
+	int sample_every;
+
+protected:
+	std::mutex mutex;
+	std::vector<TraceSample> samples;
+	int next = 0;
+	bool wrapped = false;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#include <cstring>
+#include <new>
+#include "SharedPayload.h"
+#include "client.h"
+
+std::atomic<int> SharedPayload::live_count = 0;
+std::atomic<long long> SharedPayload::live_bytes = 0;
+
+SharedPayload *SharedPayload::allocate(int size){
+    /* Header and bytes in one block */
+    void *memory = ::operator new(sizeof(SharedPayload) + (size_t)size, std::nothrow);
+    if (memory == nullptr) return nullptr;
+    live_count.fetch_add(1, std::memory_order_relaxed);
+    live_bytes.fetch_add(size, std::memory_order_relaxed);
+    return new (memory) SharedPayload(size);
+}
+
+SharedPayload *SharedPayload::allocatePacket(int payload_size){
+    if (payload_size < 0 || payload_size > max_packet_size) return nullptr;
+    SharedPayload *p = allocate(packet_header_size + payload_size);
+    if (p != nullptr) writePacketHeader((char *)p->data(), payload_size);
+    return p;
+}
+
+SharedPayload *SharedPayload::createPacket(const char *payload, int payload_size){
+    SharedPayload *p = allocatePacket(payload_size);
+    if (p != nullptr) memcpy(p->payload(), payload, payload_size);
+    return p;
+}
+
+SharedPayload *SharedPayload::copyBytes(const char *data, int size){
+    SharedPayload *p = allocate(size);
+    if (p != nullptr) memcpy((char *)p->data(), data, size);
+    return p;
+}
+
+char *SharedPayload::payload(){
+    return (char *)this->data() + packet_header_size;
+}
+
+void SharedPayload::release(){
+    /* acq_rel so that whoever frees the payload sees every use by the other threads as done */
+    if (this->references.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    live_count.fetch_sub(1, std::memory_order_relaxed);
+    live_bytes.fetch_sub(this->bytes, std::memory_order_relaxed);
+    this->~SharedPayload();
+    ::operator delete((void *)this);
+}
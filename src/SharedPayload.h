@@ -0,0 +1,47 @@
+#ifndef _SHARED_PAYLOAD_H
+#define _SHARED_PAYLOAD_H
+
+#include <atomic>
+
+/*  Immutable bytes sent to any number of clients, e.g. one world update broadcast to thousands of them.
+    The packet is framed once, in one allocation, and every send queues a reference instead of a copy
+    (Client::send(), ConnectionPool::broadcast()). The reference count is atomic, pools on different
+    threads hold the same payload, and the last release() frees it.
+
+    Usage: allocatePacket(), fill payload(), send it to whoever needs it, then release() the creator's
+    reference. Nothing may write to it once it has been sent. */
+class SharedPayload{
+public:
+	// Packet (header + payload_size bytes) with the header written, the payload is left for the caller.
+	// Returns nullptr if out of memory. Starts with one reference held by the caller.
+	static SharedPayload *allocatePacket(int payload_size);
+	// Packet holding a copy of payload
+	static SharedPayload *createPacket(const char *payload, int payload_size);
+	// Copy of raw bytes without framing, for the unsent rest of a Client::send()
+	static SharedPayload *copyBytes(const char *data, int size);
+
+	void acquire(){ this->references.fetch_add(1, std::memory_order_relaxed); }
+	// Frees the payload when the last reference goes
+	void release();
+	int referenceCount() const{ return this->references.load(std::memory_order_relaxed); }
+
+	// Bytes on the wire
+	const char *data() const{ return (const char *)(this + 1); }
+	int size() const{ return this->bytes; }
+	// Payload after the header, writable until it is first sent
+	char *payload();
+
+	// Payloads alive and their bytes, for leak checks and stats
+	static std::atomic<int> live_count;
+	static std::atomic<long long> live_bytes;
+
+private:
+	SharedPayload(int size) : bytes(size){}
+	static SharedPayload *allocate(int size);
+
+	std::atomic<int> references{1};
+	int bytes;
+	// The bytes follow
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include <cstring>
+#include <algorithm>
+#include "SimNetwork.h"
+#include "clock.h"
+
+// Handles are multiples of 4 like WinSock socket handles
+static const SOCKET first_handle = 1000;
+
+struct SimSocket{
+	bool listening = false;
+	int port = 0;
+	// Accept order for accepted server side sockets, -1 otherwise
+	int accept_index = -1;
+	// Other end of the connection, INVALID_SOCKET once it is closed
+	SOCKET peer = INVALID_SOCKET;
+	std::deque<char> inbound;
+	// The peer closed gracefully, recv returns 0 once inbound is empty
+	bool peer_closed = false;
+	// The peer reset the connection
+	bool reset = false;
+	// Server side sockets waiting to be accepted
+	std::deque<SOCKET> backlog;
+	std::vector<SimPoller *> pollers;
+};
+
+struct SimPoller{
+	struct Registration{
+		SOCKET socket;
+		struct epoll_event event;
+	};
+	std::vector<Registration> registrations;
+};
+
+SimNetwork *SimNetwork::current = nullptr;
+
+
+SimNetwork::SimNetwork(unsigned long long seed) : rng(seed){
+}
+
+SimNetwork::~SimNetwork(){
+    for (SimSocket *s : this->sockets) delete s;
+    for (SimPoller *p : this->pollers) delete p;
+    if (SimNetwork::current == this) SimNetwork::current = nullptr;
+}
+
+
+void SimNetwork::trace(unsigned long long value){
+    // FNV-1a over 8 byte values
+    this->trace_hash = (this->trace_hash ^ value) * 1099511628211ull;
+}
+
+SimSocket *SimNetwork::getSocket(SOCKET s){
+    if (s == INVALID_SOCKET || s < first_handle || (s - first_handle) % 4 != 0) return nullptr;
+    size_t index = (size_t)((s - first_handle) / 4);
+    return index < this->sockets.size() ? this->sockets[index] : nullptr;
+}
+
+SOCKET SimNetwork::newSocket(){
+    /* Hands out the most recently released handle first, which is what makes stale handles show up */
+    SOCKET s;
+    if (this->reuse_handles && !this->free_handles.empty()){
+        s = this->free_handles.back();
+        this->free_handles.pop_back();
+    }
+    else {
+        s = first_handle + (SOCKET)this->sockets.size() * 4;
+        this->sockets.push_back(nullptr);
+    }
+    this->sockets[(size_t)((s - first_handle) / 4)] = new SimSocket();
+    this->trace(s);
+    return s;
+}
+
+void SimNetwork::releaseHandle(SOCKET s){
+    size_t index = (size_t)((s - first_handle) / 4);
+    delete this->sockets[index];
+    this->sockets[index] = nullptr;
+    this->free_handles.push_back(s);
+}
+
+
+SOCKET SimNetwork::socket(){
+    return this->newSocket();
+}
+
+int SimNetwork::bind(SOCKET s, const struct sockaddr *addr, int addr_len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr || addr_len < (int)sizeof(struct sockaddr_in)){
+        this->last_error = WSAENOTSOCK;
+        return SOCKET_ERROR;
+    }
+    int port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+    for (SimSocket *other : this->sockets){
+        if (other != nullptr && other != sock && other->port == port){
+            this->last_error = WSAEADDRINUSE;
+            return SOCKET_ERROR;
+        }
+    }
+    sock->port = port;
+    return 0;
+}
+
+int SimNetwork::listen(SOCKET s, int backlog){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr || sock->port == 0){
+        this->last_error = WSAEINVAL;
+        return SOCKET_ERROR;
+    }
+    sock->listening = true;
+    return 0;
+}
+
+SOCKET SimNetwork::accept(SOCKET s, struct sockaddr *addr, int *addr_len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr || !sock->listening){
+        this->last_error = WSAEINVAL;
+        return INVALID_SOCKET;
+    }
+    if (sock->backlog.empty()){
+        this->last_error = WSAEWOULDBLOCK;
+        return INVALID_SOCKET;
+    }
+    SOCKET accepted = sock->backlog.front();
+    sock->backlog.pop_front();
+    this->getSocket(accepted)->accept_index = this->accepted++;
+    this->open_server_sockets++;
+
+    if (addr != nullptr && addr_len != nullptr && *addr_len >= (int)sizeof(struct sockaddr_in)){
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        memset(in, 0, sizeof(*in));
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = inet_addr("127.0.0.1");
+        *addr_len = sizeof(struct sockaddr_in);
+    }
+    this->trace(accepted);
+    return accepted;
+}
+
+int SimNetwork::recv(SOCKET s, char *buffer, int len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr){
+        this->last_error = WSAENOTSOCK;
+        return SOCKET_ERROR;
+    }
+    if (sock->reset){
+        this->last_error = WSAECONNRESET;
+        return SOCKET_ERROR;
+    }
+    if (sock->inbound.empty()){
+        if (sock->peer_closed) return 0;
+        this->last_error = WSAEWOULDBLOCK;
+        return SOCKET_ERROR;
+    }
+    int n = (int)std::min<size_t>((size_t)len, sock->inbound.size());
+    // Sometimes deliver less than is available, as TCP may
+    if (this->random(4) == 0) n = 1 + (int)this->random(n);
+    std::copy(sock->inbound.begin(), sock->inbound.begin() + n, buffer);
+    sock->inbound.erase(sock->inbound.begin(), sock->inbound.begin() + n);
+    this->trace(((unsigned long long)s << 32) | (unsigned int)n);
+    return n;
+}
+
+int SimNetwork::send(SOCKET s, const char *buffer, int len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr){
+        this->last_error = WSAENOTSOCK;
+        return SOCKET_ERROR;
+    }
+    SimSocket *peer = this->getSocket(sock->peer);
+    if (sock->reset || peer == nullptr){
+        this->last_error = WSAECONNRESET;
+        return SOCKET_ERROR;
+    }
+    // Bytes the client hasn't read count against the send buffer
+    if (peer->inbound.size() >= (size_t)send_buffer_size){
+        this->last_error = WSAEWOULDBLOCK;
+        return SOCKET_ERROR;
+    }
+    int n = (int)std::min<size_t>((size_t)len, send_buffer_size - peer->inbound.size());
+    // Sometimes accept only part of the data, as a nearly full send buffer would
+    if (n > 1 && this->random(8) == 0) n = 1 + (int)this->random(n);
+    peer->inbound.insert(peer->inbound.end(), buffer, buffer + n);
+    this->trace(((unsigned long long)s << 32) | (unsigned int)n);
+    return n;
+}
+
+int SimNetwork::closesocket(SOCKET s){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr){
+        this->last_error = WSAENOTSOCK;
+        return SOCKET_ERROR;
+    }
+    this->closeSocket(s, false);
+    return 0;
+}
+
+int SimNetwork::getsockopt(SOCKET s, int level, int name, char *value, int *len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr){
+        this->last_error = WSAENOTSOCK;
+        return SOCKET_ERROR;
+    }
+    if (level == SOL_SOCKET && name == SO_ERROR && *len >= (int)sizeof(int)){
+        int error = sock->reset ? WSAECONNRESET : 0;
+        memcpy(value, &error, sizeof(int));
+        *len = sizeof(int);
+    }
+    return 0;
+}
+
+
+HANDLE SimNetwork::epollCreate(){
+    SimPoller *p = new SimPoller();
+    this->pollers.push_back(p);
+    return (HANDLE)p;
+}
+
+int SimNetwork::epollClose(HANDLE ephnd){
+    auto it = std::find(this->pollers.begin(), this->pollers.end(), (SimPoller *)ephnd);
+    if (it == this->pollers.end()) return -1;
+    SimPoller *p = *it;
+    for (const SimPoller::Registration &r : p->registrations){
+        SimSocket *sock = this->getSocket(r.socket);
+        if (sock != nullptr) sock->pollers.erase(std::find(sock->pollers.begin(), sock->pollers.end(), p));
+    }
+    this->pollers.erase(it);
+    delete p;
+    return 0;
+}
+
+int SimNetwork::epollCtl(HANDLE ephnd, int op, SOCKET s, struct epoll_event *event){
+    auto it = std::find(this->pollers.begin(), this->pollers.end(), (SimPoller *)ephnd);
+    SimSocket *sock = this->getSocket(s);
+    if (it == this->pollers.end() || sock == nullptr) return -1;
+    SimPoller *p = *it;
+
+    auto registration = std::find_if(p->registrations.begin(), p->registrations.end(),
+        [s](const SimPoller::Registration &r){ return r.socket == s; });
+    if (op == EPOLL_CTL_ADD){
+        if (registration != p->registrations.end()) return -1;
+        p->registrations.push_back({s, *event});
+        sock->pollers.push_back(p);
+    }
+    else if (op == EPOLL_CTL_MOD){
+        if (registration == p->registrations.end()) return -1;
+        registration->event = *event;
+    }
+    else if (op == EPOLL_CTL_DEL){
+        if (registration == p->registrations.end()) return -1;
+        p->registrations.erase(registration);
+        sock->pollers.erase(std::find(sock->pollers.begin(), sock->pollers.end(), p));
+    }
+    return 0;
+}
+
+int SimNetwork::epollWait(HANDLE ephnd, struct epoll_event *events, int max_events){
+    /* Never blocks, the simulation driver decides when a thread runs */
+    auto it = std::find(this->pollers.begin(), this->pollers.end(), (SimPoller *)ephnd);
+    if (it == this->pollers.end() || max_events <= 0) return -1;
+
+    std::vector<struct epoll_event> ready;
+    for (const SimPoller::Registration &r : (*it)->registrations){
+        SimSocket *sock = this->getSocket(r.socket);
+        uint32_t state = 0;
+        if (sock->listening){
+            if (!sock->backlog.empty()) state = EPOLLIN;
+        }
+        else if (sock->reset) state = EPOLLERR | EPOLLHUP;
+        else {
+            if (!sock->inbound.empty() || sock->peer_closed) state = EPOLLIN;
+            if (sock->peer_closed) state |= EPOLLRDHUP;
+            // Once the peer is gone a send doesn't block either, it fails
+            SimSocket *peer = this->getSocket(sock->peer);
+            if (peer == nullptr || peer->inbound.size() < (size_t)send_buffer_size) state |= EPOLLOUT;
+        }
+
+        // Errors are reported whether asked for or not
+        state &= r.event.events | EPOLLERR | EPOLLHUP;
+        if (state != 0){
+            struct epoll_event e = r.event;
+            e.events = state;
+            ready.push_back(e);
+        }
+    }
+
+    // Ready order is up to the scheduler
+    for (size_t i = ready.size(); i > 1; i--){
+        std::swap(ready[i - 1], ready[(size_t)this->random(i)]);
+    }
+    int n = (int)std::min<size_t>(ready.size(), (size_t)max_events);
+    for (int i = 0; i < n; i++){
+        events[i] = ready[i];
+        this->trace(events[i].data.u64);
+    }
+    return n;
+}
+
+
+SOCKET SimNetwork::connect(int port){
+    SimSocket *listener = nullptr;
+    for (SimSocket *s : this->sockets){
+        if (s != nullptr && s->listening && s->port == port) listener = s;
+    }
+    if (listener == nullptr){
+        this->last_error = WSAECONNREFUSED;
+        return INVALID_SOCKET;
+    }
+    SOCKET client = this->newSocket();
+    SOCKET server = this->newSocket();
+    this->getSocket(client)->peer = server;
+    this->getSocket(server)->peer = client;
+    listener->backlog.push_back(server);
+    return client;
+}
+
+void SimNetwork::clientSend(SOCKET s, const char *data, int len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr) return;
+    // Data sent to a closed connection is lost
+    SimSocket *peer = this->getSocket(sock->peer);
+    if (peer != nullptr) peer->inbound.insert(peer->inbound.end(), data, data + len);
+    this->trace(((unsigned long long)s << 32) | (unsigned int)len);
+}
+
+int SimNetwork::clientRecv(SOCKET s, char *buffer, int len){
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr) return 0;
+    if (sock->inbound.empty()) return sock->peer_closed || sock->reset ? 0 : -1;
+    int n = (int)std::min<size_t>((size_t)len, sock->inbound.size());
+    std::copy(sock->inbound.begin(), sock->inbound.begin() + n, buffer);
+    sock->inbound.erase(sock->inbound.begin(), sock->inbound.begin() + n);
+    return n;
+}
+
+void SimNetwork::clientClose(SOCKET s, bool reset){
+    this->closeSocket(s, reset);
+}
+
+void SimNetwork::closeSocket(SOCKET s, bool reset){
+    /* Closes either end of a connection. The socket leaves every poller and its handle is released. */
+    SimSocket *sock = this->getSocket(s);
+    if (sock == nullptr) return;
+    this->trace(((unsigned long long)s << 1) | (reset ? 1 : 0));
+
+    for (SimPoller *p : sock->pollers){
+        p->registrations.erase(std::find_if(p->registrations.begin(), p->registrations.end(),
+            [s](const SimPoller::Registration &r){ return r.socket == s; }));
+    }
+    SimSocket *peer = this->getSocket(sock->peer);
+    if (peer != nullptr){
+        if (reset) peer->reset = true;
+        else peer->peer_closed = true;
+        peer->peer = INVALID_SOCKET;
+    }
+    // Connections nobody accepted yet are refused
+    std::deque<SOCKET> backlog;
+    backlog.swap(sock->backlog);
+    if (sock->accept_index >= 0) this->open_server_sockets--;
+    this->releaseHandle(s);
+    for (SOCKET b : backlog) this->closeSocket(b, true);
+}
+
+int SimNetwork::acceptIndex(SOCKET s){
+    SimSocket *sock = this->getSocket(s);
+    return sock != nullptr ? sock->accept_index : -1;
+}
+
+
+unsigned long long simulatedTimeUS(){
+    return SimNetwork::current != nullptr ? SimNetwork::current->now_us : 0;
+}
+
+void simulatedSleepMS(int ms){
+    if (SimNetwork::current != nullptr) SimNetwork::current->advance((unsigned long long)ms * 1000);
+}
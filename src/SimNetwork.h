@@ -0,0 +1,90 @@
+#ifndef _SIM_NETWORK_H
+#define _SIM_NETWORK_H
+
+#include <winsock2.h>
+#include "imports/wepoll/wepoll.h"
+#include <vector>
+#include <deque>
+#include <random>
+
+struct SimSocket;
+struct SimPoller;
+
+/*  In-memory sockets, poller and clock for deterministic simulation (TCPSERVER_SIMULATION builds).
+    The server reaches it through netapi.h and clock.h, the simulation driver plays the client side
+    through connect()/clientSend()/clientRecv()/clientClose() and decides which thread runs next.
+    Everything that could differ between runs (ready event order, how many bytes a recv or send
+    moves, time) is drawn from one seeded generator, so a seed replays the exact same run.
+
+    Semantics follow WinSock with wepoll, level triggered:
+        EPOLLIN             data available, a connection to accept, or the peer closed (recv returns 0)
+        EPOLLOUT            the send buffer has room: less than send_buffer_size bytes the peer hasn't read,
+                            or the peer is gone (send fails)
+        EPOLLRDHUP          the peer closed gracefully
+        EPOLLERR|EPOLLHUP   connection reset by the peer (recv fails with WSAECONNRESET)
+    Closed sockets leave every poller, and their handle is handed out again like WinSock does. */
+class SimNetwork{
+public:
+	SimNetwork(unsigned long long seed);
+	~SimNetwork();
+
+	// Network the server calls go to, set by the simulation driver
+	static SimNetwork *current;
+
+	// Server side, see netapi.h
+	SOCKET socket();
+	int bind(SOCKET s, const struct sockaddr *addr, int addr_len);
+	int listen(SOCKET s, int backlog);
+	SOCKET accept(SOCKET s, struct sockaddr *addr, int *addr_len);
+	int recv(SOCKET s, char *buffer, int len);
+	int send(SOCKET s, const char *buffer, int len);
+	int closesocket(SOCKET s);
+	int getsockopt(SOCKET s, int level, int name, char *value, int *len);
+	HANDLE epollCreate();
+	int epollClose(HANDLE ephnd);
+	int epollCtl(HANDLE ephnd, int op, SOCKET s, struct epoll_event *event);
+	int epollWait(HANDLE ephnd, struct epoll_event *events, int max_events);
+	int last_error = 0;
+	// Sends fail with WSAEWOULDBLOCK while this much is waiting for the peer to read it
+	static const int send_buffer_size = 64*1024;
+
+	// Client side. connect() returns INVALID_SOCKET if nothing listens on port.
+	SOCKET connect(int port);
+	void clientSend(SOCKET s, const char *data, int len);
+	// Returns bytes read, 0 if the server closed the connection and everything was read, -1 if nothing to read yet
+	int clientRecv(SOCKET s, char *buffer, int len);
+	// Graceful close (FIN) or reset (RST)
+	void clientClose(SOCKET s, bool reset);
+
+	// Accept order of the server side socket s (0 for the first accepted connection), -1 if not accepted
+	int acceptIndex(SOCKET s);
+	// Server side sockets that are accepted and not closed yet
+	int openServerSockets(){ return this->open_server_sockets; }
+
+	// Virtual clock
+	unsigned long long now_us = 0;
+	void advance(unsigned long long us){ this->now_us += us; }
+
+	// Seeded random number in [0, n)
+	unsigned long long random(unsigned long long n){ return n > 1 ? this->rng() % n : 0; }
+	// Hash of every byte and event that went through the network, equal for equal runs
+	unsigned long long trace_hash = 14695981039346656037ull;
+	// Reuse closed socket handles, as WinSock does
+	bool reuse_handles = true;
+
+protected:
+	SimSocket *getSocket(SOCKET s);
+	SOCKET newSocket();
+	void releaseHandle(SOCKET s);
+	void closeSocket(SOCKET s, bool reset);
+	void trace(unsigned long long value);
+
+	std::mt19937_64 rng;
+	std::vector<SimSocket *> sockets;
+	std::vector<SOCKET> free_handles;
+	std::vector<SimPoller *> pollers;
+	int accepted = 0;
+	int open_server_sockets = 0;
+};
+
+#endif
@@ -17,14 +17,50 @@
 /* For wepoll documentation refer to: https://github.com/piscisaureus/wepoll */
 #include "imports/wepoll/wepoll.h"
 #include "client.h"
+#include "HandlerWatchdog.h"
+#include "probes.h"
+#include "RequestTracer.h"
+#include "EpochReclaimer.h"
+#include "HugePages.h"
+#include "Numa.h"
+#include "MemoryBudget.h"
+#include "netapi.h"
+#include "clock.h"
 
 // Global handle function for all connections made
-functionPtr_t *handle_function = nullptr;
+functionPtr_t handle_function = nullptr;
+
+#ifdef TCPSERVER_HAS_ETW_PROBES
+// Name hash GUID of "tcpserver", so sessions can enable it as *tcpserver
+TRACELOGGING_DEFINE_PROVIDER(tcpserver_provider, "tcpserver",
+    (0xf4d73232, 0x8fe7, 0x5c93, 0x5b, 0x37, 0x8e, 0x01, 0x22, 0x83, 0x55, 0x0e));
+#endif
+static std::mutex probes_mutex;
+static int probes_registrations = 0;
+
+void registerProbes(){
+    std::lock_guard<std::mutex> lock(probes_mutex);
+#ifdef TCPSERVER_HAS_ETW_PROBES
+    if (probes_registrations == 0) TraceLoggingRegister(tcpserver_provider);
+#endif
+    probes_registrations++;
+}
+
+void unregisterProbes(){
+    /* Events written while unregistered are dropped, pool threads must be gone before the last one */
+    std::lock_guard<std::mutex> lock(probes_mutex);
+    probes_registrations--;
+#ifdef TCPSERVER_HAS_ETW_PROBES
+    if (probes_registrations == 0) TraceLoggingUnregister(tcpserver_provider);
+#endif
+}
 
-TcpConnectionAcceptor::TcpConnectionAcceptor(functionPtr_t *_handle_function, const char *ip, int port, int connection_pool_size){
+TcpConnectionAcceptor::TcpConnectionAcceptor(functionPtr_t _handle_function, const char *ip, int port, int connection_pool_size, int client_capacity,
+                                             bool huge_pages){
     handle_function = _handle_function;
     acceptSocket = new_socket = 0;
     this->connection_pool_size = connection_pool_size;
+    this->client_capacity = client_capacity;
 
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = inet_addr(ip); // INADDR_ANY;
@@ -33,32 +69,32 @@ TcpConnectionAcceptor::TcpConnectionAcceptor(functionPtr_t *_handle_function, co
     this->port = port;
 
 
-    //this->acceptSocket = socket(AF_INET, SOCK_STREAM, 0);
-    this->acceptSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    //this->acceptSocket = net::socket(AF_INET, SOCK_STREAM, 0);
+    this->acceptSocket = net::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (this->acceptSocket == INVALID_SOCKET){
         printf("Could not create socket: error %d\n", WSAGetLastError());
         throw;
     }
 
 
-    if (bind(this->acceptSocket, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR){
+    if (net::bind(this->acceptSocket, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR){
         printf("Error binding accept-socket to server ip and port WSA-errcode:%d\n",  WSAGetLastError());
         throw;
     }
 
-    if (listen(this->acceptSocket, 5) == SOCKET_ERROR){
+    if (net::listen(this->acceptSocket, 5) == SOCKET_ERROR){
         printf("Error listening to connections WSA-errcode:%d\n",  WSAGetLastError());
         throw;
     }
     
     // TODO: remove if supporting tcp packets optimization.
     int val = 1;
-    int result = setsockopt(this->acceptSocket, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(int));
+    int result = net::setsockopt(this->acceptSocket, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(int));
     
 
     // Init epoll
     // parameter given doesn't matter (deprecated) but must be greater than 0.
-    this->epoll_handle = epoll_create(1);
+    this->epoll_handle = net::epoll_create(1);
     if (this->epoll_handle == nullptr){
         // Error
         printf("Couldn't create epoll handle in TcpConnectionAcceptor::TcpConnectionAcceptor()\n");
@@ -69,44 +105,56 @@ TcpConnectionAcceptor::TcpConnectionAcceptor(functionPtr_t *_handle_function, co
     // Add socket event to epoll port
     this->event.events = EPOLLIN;
     this->event.data.sock = this->acceptSocket;
-    if (epoll_ctl(this->epoll_handle, EPOLL_CTL_ADD, this->acceptSocket, &this->event) == -1){
+    if (net::epoll_ctl(this->epoll_handle, EPOLL_CTL_ADD, this->acceptSocket, &this->event) == -1){
         // error
         printf("Error adding epoll event to handle incoming requests\n");
-        epoll_close(this->epoll_handle);
+        net::epoll_close(this->epoll_handle);
         throw;
     }
 
     // Set server start time
     this->server_starttime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    
+
+    // Before any slab or buffer pool is created
+    if (huge_pages) enableHugePages();
+    registerProbes();
     this->run_threadpools();
 }
 
 static void startConnectionPool(ConnectionPool *p){
+    if (p->numa_node >= 0 && !bindThreadToNumaNode(p->numa_node)){
+        printf("[Warning] Couldn't bind server thread %d to NUMA node %d\n", p->id, p->numa_node);
+    }
     printf("Running server thread %d\n", p->id);
     p->serveForever();
     printf("Shutdown server on thread %d\n", p->id);
 }
 
 void TcpConnectionAcceptor::run_threadpools(){
+    // Pools are the reclaimer's participants, pool i is participant i
+    this->reclaimer = new EpochReclaimer(this->connection_pool_size);
+
+    // Pools are spread over the NUMA nodes round robin, each one's memory is allocated on its node
+    int numa_nodes = getNumaNodeCount();
+
     // Initialize thread connection pools (each pool runs on a different thread)
     for (int i = 0; i < this->connection_pool_size; i++){
 
-        ConnectionPool *p = new ConnectionPool(i, "Login server");
+        int node = numa_nodes > 1 ? i % numa_nodes : -1;
+        ConnectionPool *p = new ConnectionPool(i, "Login server", node);
+        p->reclaimer = this->reclaimer;
         this->thread_connectionpool.push_back(p);
-        std::thread t(startConnectionPool, std::ref(p));
-        t.detach();
-        // Sleep a few MS in order to let thread fully initialize 
-        // otherwise it might lose the connectionPool reference given to it.
-        // TODO: fix better
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        this->client_slabs.push_back(new ClientSlab(this->client_capacity / this->connection_pool_size, node));
+#ifndef TCPSERVER_SIMULATION
+        // Simulation builds have no pool threads, they run pools through ConnectionPool::serveOnce()
+        this->pool_threads.emplace_back(startConnectionPool, p);
+#endif
     }
 
     printf("Server online (%s:%d) with %d thread(s)\n", ip, port, connection_pool_size);
-}
-
-TcpConnectionAcceptor::~TcpConnectionAcceptor(){
-    epoll_close(this->epoll_handle);
+    if (numa_nodes > 1) printf("Pools spread over %d NUMA nodes\n", numa_nodes);
+    // Client slabs so far, buffer pools take their huge pages as they fill
+    if (hugePagesEnabled()) printHugePageStats();
 }
 
 int TcpConnectionAcceptor::getTimeMS(){
@@ -116,64 +164,67 @@ int TcpConnectionAcceptor::getTimeMS(){
 
 
 void TcpConnectionAcceptor::serveForever(){
+    int timeout_ms = 10000;
+    while (this->running) {
+        this->serveOnce(timeout_ms);
+    }
+}
 
-   
+void TcpConnectionAcceptor::serveOnce(int timeout_ms){
+    /* One iteration of serveForever(): runs update() and accepts connections that are ready */
     int c = sizeof(struct sockaddr_in);
-
     int socketError = false;
-    int timeout_ms = 10000;
-
-    while (this->running) {
-        // Update global server state here
-        this->update();
 
+    // Update global server state here
+    this->update();
 
-        /*  Timeout values for epoll_wait:
-            <0  block indefinitely.
-            0   report any events that are already waiting, but don't block.
-            >=1 block for at most N milliseconds
+    /*  Timeout values for epoll_wait:
+        <0  block indefinitely.
+        0   report any events that are already waiting, but don't block.
+        >=1 block for at most N milliseconds
 
-            Return values:
-            -1  error occurred
-            0   timed out without any events to report
-            >=1 number of events stored in the epoll_evnt buffer
-        */
-        int eventCount = epoll_wait(this->epoll_handle, this->epoll_events, this->num_epoll_events, timeout_ms);
+        Return values:
+        -1  error occurred
+        0   timed out without any events to report
+        >=1 number of events stored in the epoll_evnt buffer
+    */
+    int eventCount = net::epoll_wait(this->epoll_handle, this->epoll_events, this->num_epoll_events, timeout_ms);
 
-        // Timed out
-        if (eventCount == 0) continue;
+    // Timed out
+    if (eventCount == 0){
+        return;
+    }
 
-        else if (eventCount > 0){
-            for (int i = 0; i < eventCount; i++){
+    else if (eventCount > 0){
+        for (int i = 0; i < eventCount; i++){
 
-                if (this->epoll_events[i].events != EPOLLIN){
-                    // Socket closed, hang-up, socket error
-                    socketError = true;
-                    break;
-                }
-                else {
-                    
-                    // Incoming data available, or incoming connection ready to be accepted
-                    new_socket = accept(this->acceptSocket, (struct sockaddr *)&client, &c);
-                    if (new_socket == INVALID_SOCKET)
-                    {
-                        printf("accept failed with error code : %d\n" , WSAGetLastError());
-                        continue;
-                    }
-
-                    this->handleNewConnection(new_socket, ((struct sockaddr *)&client));
-                }
+            if (this->epoll_events[i].events != EPOLLIN){
+                // Socket closed, hang-up, socket error
+                socketError = true;
+                break;
             }
-            if (socketError){
-                // TODO: handle error
+            else {
+                
+                // Incoming data available, or incoming connection ready to be accepted
+                new_socket = net::accept(this->acceptSocket, (struct sockaddr *)&client, &c);
+                if (new_socket == INVALID_SOCKET)
+                {
+                    printf("accept failed with error code : %d\n" , net::lastError());
+                    continue;
+                }
+
+                TCPSERVER_PROBE2(accept, (int)new_socket, this->connectionCount);
+                this->handleNewConnection(new_socket, ((struct sockaddr *)&client));
             }
         }
-        else if (eventCount <= -1){
-            // Error occurred
-            printf("error occurred in epoll_wait()\n");
+        if (socketError){
+            // TODO: handle error
         }
     }
-    
+    else if (eventCount <= -1){
+        // Error occurred
+        printf("error occurred in epoll_wait()\n");
+    }
 }
 
 
@@ -184,13 +235,12 @@ void TcpConnectionAcceptor::handleNewConnection(SOCKET newSocket, struct sockadd
             Sleeps if over set accept rate.
     */
     int startms = getTimeMS();
-    Client *client = new Client(newSocket, newSockAddr, this->connectionCount);
-
-    // New client has been connected, so we add it to unauthorized client list
-    connections.push_back(client);
 
-    // Get thread with least connections
+    // Get thread with least connections, the client lives in that pool's slab (on the pool's NUMA node)
     ConnectionPool *cp = this->getConnectionPool();
+    Client *client = this->client_slabs[cp->id]->create(newSocket, newSockAddr, this->connectionCount);
+
+    // The pool owns the client from here on
     client->connection_pool = cp; 
     cp->addNewConnection(client);
     this->connectionCount++;
@@ -199,49 +249,154 @@ void TcpConnectionAcceptor::handleNewConnection(SOCKET newSocket, struct sockadd
         // Calculate time to sleep based on accept rate. 
         // Subtract time it takes to add new connection.
         int ms_sleep = (int)max((1000 / accept_rate) - (getTimeMS() - startms), 0);
-        std::this_thread::sleep_for(std::chrono::milliseconds(ms_sleep));
+        sleepForMS(ms_sleep);
     }
 }
 
 TcpConnectionAcceptor::~TcpConnectionAcceptor(){
     int sumClosed = 0;
-    // First set running to false and let all threads gracefully exit
-    // TODO: fix better
+    net::epoll_close(this->epoll_handle);
+
+    for (auto cp : this->thread_connectionpool){
+        cp->tracer = nullptr;
+    }
+
+    // First set running to false and wait for every pool thread to finish its last batch
     for (auto cp : this->thread_connectionpool){
         cp->running = false;
     }
-    // Sleep for 2 seconds
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000*2));
+    for (std::thread &t : this->pool_threads){
+        t.join();
+    }
 
     // Loop again and shut down completely
     for (auto cp : this->thread_connectionpool){
         sumClosed += cp->shutdown();
         delete cp;
     }
-    int sumDeleted = 0, total = this->connections.size();
-    for (auto c : this->connections){
-        if (c->referenceCount <= 0){
-            sumDeleted++;
-            delete c;
-        }
+    // Pool threads are gone, frees every client the pools retired
+    int sumDeleted = this->reclaimer != nullptr ? (int)this->reclaimer->getPendingCount() : 0;
+    delete this->reclaimer;
+    this->reclaimer = nullptr;
+    for (auto slab : this->client_slabs){
+        delete slab;
+    }
+
+    // Pools are gone, nothing can write a watchdog slot, record into the tracers or charge the budget anymore
+    delete this->watchdog;
+    this->watchdog = nullptr;
+    for (auto t : this->tracers){
+        delete t;
     }
+    delete this->budget;
+    unregisterProbes();
 
     if (sumClosed > 0)
         printf("Successfully shutdown %d clients\n", sumClosed);
     if (sumDeleted > 0){
-        printf("Successfully deleted %d/%d clients\n", sumDeleted, total);
+        printf("Successfully deleted %d clients\n", sumDeleted);
     }
 }
 
 
 
+std::vector<PoolStats> TcpConnectionAcceptor::getPoolStats(){
+    std::vector<PoolStats> stats;
+    for (auto cp : this->thread_connectionpool){
+        stats.push_back(cp->getStats());
+    }
+    return stats;
+}
+
+void TcpConnectionAcceptor::printPoolStats(){
+    /* Prints one line per pool. A busy ratio close to 1 or a growing lag means the pool is saturated. */
+    for (const PoolStats &s : this->getPoolStats()){
+        printf("[pool %d] clients %d, busy %.1f%%, %.0f wakeups/s, %.2f events/wakeup, lag avg %llu us max %llu us\n",
+            s.id, s.size, s.busy_ratio*100, s.wakeups_per_second, s.events_per_wakeup, s.lag_avg_us, s.lag_max_us);
+        if (this->budget != nullptr){
+            printf("[pool %d] %llu bytes queued for %d clients, %d clients paused, %llu shed\n",
+                s.id, s.outbound_bytes, s.outbound_clients, s.paused_clients, s.shed_clients);
+        }
+    }
+    if (this->budget != nullptr){
+        printf("[memory] %llu of %llu KB used\n", (unsigned long long)this->budget->used() / 1024, (unsigned long long)this->budget->global_limit / 1024);
+    }
+}
+
+std::vector<TopKEntry> TcpConnectionAcceptor::getHeavyHitters(bool by_bytes, int n){
+    TopKSketch merged;
+    for (auto cp : this->thread_connectionpool){
+        merged.merge(by_bytes ? cp->getHeavyHittersByBytes() : cp->getHeavyHittersByRequests());
+    }
+    return merged.top(n);
+}
+
+void TcpConnectionAcceptor::printHeavyHitters(int n){
+    /* Counts are upper bounds, the true count is at least count - error. */
+    for (const TopKEntry &e : this->getHeavyHitters(false, n)){
+        printf("[heavy hitter] client %d: %llu requests (+-%llu)\n", e.client_id, e.count, e.error);
+    }
+    for (const TopKEntry &e : this->getHeavyHitters(true, n)){
+        printf("[heavy hitter] client %d: %llu bytes (+-%llu)\n", e.client_id, e.count, e.error);
+    }
+}
+
+void TcpConnectionAcceptor::startHandlerWatchdog(int budget_ms){
+    if (this->watchdog != nullptr || budget_ms <= 0) return;
+    this->watchdog = new HandlerWatchdog(this->connection_pool_size, budget_ms);
+    for (auto cp : this->thread_connectionpool){
+        cp->watchdog_slot.store(this->watchdog->getSlot(cp->id), std::memory_order_release);
+    }
+    printf("Handler watchdog running with budget %d ms\n", budget_ms);
+}
+
+void TcpConnectionAcceptor::startRequestTracing(int sample_every){
+    if (!this->tracers.empty() || sample_every <= 0) return;
+    for (auto cp : this->thread_connectionpool){
+        RequestTracer *t = new RequestTracer(cp->id, sample_every);
+        this->tracers.push_back(t);
+        cp->tracer = t;
+    }
+    printf("Tracing 1 in %d requests\n", sample_every);
+}
+
+bool TcpConnectionAcceptor::exportRequestTrace(const char *path){
+    std::vector<TraceSample> samples;
+    for (auto t : this->tracers){
+        std::vector<TraceSample> s = t->getSamples();
+        samples.insert(samples.end(), s.begin(), s.end());
+    }
+    return RequestTracer::exportChromeTrace(samples, path);
+}
+
+void TcpConnectionAcceptor::setMemoryBudget(size_t global_bytes, size_t client_bytes){
+    if (this->budget != nullptr || global_bytes == 0 || client_bytes == 0) return;
+    this->budget = new MemoryBudget(global_bytes, client_bytes);
+    for (auto cp : this->thread_connectionpool){
+        cp->budget = this->budget;
+    }
+    printf("Memory budget %llu MB, %llu KB per client\n", (unsigned long long)global_bytes / (1024*1024), (unsigned long long)client_bytes / 1024);
+}
+
+size_t TcpConnectionAcceptor::getMemoryUsage(){
+    return this->budget != nullptr ? this->budget->used() : 0;
+}
+
+void TcpConnectionAcceptor::broadcast(SharedPayload *payload){
+    /* Clients belong to their pool's thread, so every pool sends to its own */
+    for (ConnectionPool *cp : this->thread_connectionpool) cp->broadcast(payload);
+}
+
 ConnectionPool *TcpConnectionAcceptor::getConnectionPool(){
-    // Get thread with least connections in its pool
+    // Get thread with least connections in its pool. Connections still waiting in a pool's queue count too,
+    // otherwise a burst of accepts all goes to the same pool before it wakes up to register them.
     int idx = 0;
     int maxc = INT32_MAX;
     for (int i = 0; i < this->connection_pool_size; i++){
-        if (this->thread_connectionpool[i]->size < maxc){
-            maxc = this->thread_connectionpool[i]->size;
+        ConnectionPool *cp = this->thread_connectionpool[i];
+        int load = cp->size + (int)cp->newConnectionsQueue->size_approx();
+        if (load < maxc){
+            maxc = load;
             idx = i;
         }
     }
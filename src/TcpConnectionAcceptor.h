@@ -5,10 +5,19 @@
 #include <windows.h>
 #include "imports/wepoll/wepoll.h"
 #include <vector>
+#include <thread>
+#include "TopKSketch.h"
 
 class ConnectionPool;
+class HandlerWatchdog;
+class RequestTracer;
+struct PoolStats;
 class Client;
+class ClientSlab;
+class EpochReclaimer;
 class Packet;
+class SharedPayload;
+class MemoryBudget;
 
 
 using functionPtr_t = void(*)(Client *, Packet *);
@@ -17,12 +26,36 @@ extern functionPtr_t handle_function;
 
 class TcpConnectionAcceptor{
 public:
-    TcpConnectionAcceptor(functionPtr_t *handle_function, const char *ip, int port, int connection_pool_size);
-    ~TcpConnectionAcceptor();
+    // client_capacity Client objects are preallocated, split over the pools. huge_pages puts client slabs and
+    // buffer pools on huge pages if the system allows it (see HugePages.h).
+    TcpConnectionAcceptor(functionPtr_t handle_function, const char *ip, int port, int connection_pool_size, int client_capacity = 4096,
+                          bool huge_pages = false);
+    virtual ~TcpConnectionAcceptor();
     void shutdown() {this->running = false;}
     void serveForever();
+    // One iteration of serveForever(), lets a simulation drive the acceptor without blocking
+    void serveOnce(int timeout_ms);
     // Returns time in MS since server start
     int getTimeMS();
+    // Event loop utilization of every connection pool
+    std::vector<PoolStats> getPoolStats();
+    void printPoolStats();
+    // Clients with the most requests (or bytes) across all pools, merged from every pool's sketch
+    std::vector<TopKEntry> getHeavyHitters(bool by_bytes, int n);
+    void printHeavyHitters(int n);
+    // Starts a thread reporting handle_function calls running longer than budget_ms
+    void startHandlerWatchdog(int budget_ms);
+    // Traces 1 in sample_every requests on every pool
+    void startRequestTracing(int sample_every);
+    // Writes traced requests of all pools as Chrome trace-event JSON
+    bool exportRequestTrace(const char *path);
+    // Sends payload to every connected client, each pool queues a reference on its own thread (see SharedPayload)
+    void broadcast(SharedPayload *payload);
+    // Limits the memory all clients together and each client can hold, see MemoryBudget.h. client_bytes must fit
+    // the largest packet clients send.
+    void setMemoryBudget(size_t global_bytes, size_t client_bytes);
+    // Bytes counted against the budget, 0 without one
+    size_t getMemoryUsage();
     
 
     /*  Define abstract function to be overridden ( = 0)
@@ -59,8 +92,17 @@ protected:
 
     // List of server thread pools running
     std::vector<ConnectionPool *> thread_connectionpool;
-    // List of all accepted connections
-    std::vector<Client *> connections;
+    // Thread of every pool, same index as thread_connectionpool. Joined by the destructor before the pools are freed.
+    std::vector<std::thread> pool_threads;
+    // Client storage of every pool, same index as thread_connectionpool
+    std::vector<ClientSlab *> client_slabs;
+    int client_capacity = 4096;
+    // Clients are only held by their pool after handoff, pools retire them here when they close
+    EpochReclaimer *reclaimer = nullptr;
+
+    HandlerWatchdog *watchdog = nullptr;
+    std::vector<RequestTracer *> tracers;
+    MemoryBudget *budget = nullptr;
 };
 
 
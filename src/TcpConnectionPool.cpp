@@ -1,23 +1,48 @@
 #include <mutex>
+#include <cstring>
+#include <new>
 #include "TcpConnectionPool.h"
 #include "client.h"
 //#include "packet.h"
 #include "TcpConnectionAcceptor.h"
+#include "clock.h"
+#include "HandlerWatchdog.h"
+#include "probes.h"
+#include "RequestTracer.h"
+#include "netapi.h"
+#include "EpochReclaimer.h"
+#include "SharedPayload.h"
+#include "MemoryBudget.h"
 
 
 
-ConnectionPool::ConnectionPool(int id, const char *serverName){
+// Counters are only written by the pool thread, so a relaxed load + store is enough
+// and avoids a locked instruction per update.
+static inline void addStat(std::atomic<unsigned long long> &stat, unsigned long long value){
+    stat.store(stat.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+ConnectionPool::ConnectionPool(int id, const char *serverName, int numa_node)
+    : arena(64*1024, 1024*1024, numa_node), packets(numa_node), buffers(4*1024*1024, numa_node){
 	this->running = true;
     this->id = id;
+    this->numa_node = numa_node;
     this->serverName = serverName;
 
     // Thread safe lock free queue with fixed size 100
     // Only thread safe with 2 threads (1 enqueue 1 dequeue)
     this->newConnectionsQueue = new moodycamel::ReaderWriterQueue<Client *>(100);
 
+    // Packets that don't fit are reassembled over several recv calls, see processReceived()
+    this->recv_buffer_pages = allocatePages(recv_buffer_size, numa_node, false);
+    this->recv_buffer = this->recv_buffer_pages.data;
+    this->stat_buffer_bytes = recv_buffer_size;
+    this->stat_arena_bytes = this->arena.capacity();
+    this->loop.window_start = this->loop.heavy_hitter_window_start = getMonotonicTimeUS();
+
     // Init epoll
     // parameter given doesn't matter (deprecated) but must be greater than 0.
-    this->epoll_handle = epoll_create(1);
+    this->epoll_handle = net::epoll_create(1);
     if (this->epoll_handle == nullptr){
         // Error
         printf("[%s] Couldn't create epoll handle in ConnectionPool::ConnectionPool()\n", this->serverName);
@@ -29,16 +54,23 @@ ConnectionPool::ConnectionPool(int id, const char *serverName){
 ConnectionPool::~ConnectionPool(){
     this->shutdown();
     delete this->newConnectionsQueue;
-    
+    freePages(this->recv_buffer_pages);
+    for (SharedPayload *p : this->broadcasts) p->release();
+
 }
 
 void ConnectionPool::addNewConnection(Client *client){
     /* Adds new connection to this pool. Uses thread safe queue to pass client along. */
 
-    client->referenceCount++; // Pool thread will have a reference to this client (atomic variable)
+    TCPSERVER_PROBE2(add_new_connection, client->client_id, this->id);
 
     if (!this->newConnectionsQueue->try_enqueue(client)){
         printf("[Error] Connection queue is full for %s\n", this->serverName);
+        // Nobody will serve this connection. No other thread has seen the client, so close it directly
+        // instead of through Client::close() (which touches the pool's list) and free it right away.
+        client->closed = true;
+        net::closesocket(client->client_socket);
+        Client::destroy(client);
     }
 }
 
@@ -49,16 +81,20 @@ void ConnectionPool::checkNewConnections(){
     Client *client;
     // try_dequeue will return false when queue is empty
     while (this->newConnectionsQueue->try_dequeue(client)){
-        // Does not need to add referenceCount to this new client. It has already been 
-        // added for this thread by another as the client was transitioned into 'newConnectionsQueue'.
-        this->clients.push_back(client);
+        // A client that doesn't read must not stall the pool, output its socket doesn't take is queued (see send())
+        u_long non_blocking = 1;
+        net::ioctlsocket(client->client_socket, FIONBIO, &non_blocking);
         // Add connection on this socket for this pool
         this->event.data.sock = client->client_socket;
-        if (epoll_ctl(this->epoll_handle, EPOLL_CTL_ADD, client->client_socket, &this->event) == -1){
+        if (net::epoll_ctl(this->epoll_handle, EPOLL_CTL_ADD, client->client_socket, &this->event) == -1){
             printf("[%s] Error could not add new connection in ConnectionPool::checkNewConnections()\n", this->serverName);
+            // Not in the list, so this only closes the socket
             client->close();
+            this->closed_clients.push_back(client);
         }
         else {
+            this->clients.push_back(client);
+            TCPSERVER_PROBE3(register_connection, client->client_id, this->id, (int)client->client_socket);
             printf("[%s] Added new connection: socket %d\n", this->serverName, (int)client->client_socket);
             // TODO: create function
             // this->onConnectionInit();
@@ -66,57 +102,101 @@ void ConnectionPool::checkNewConnections(){
             // Increase size atomically, cause it might be read by acceptor thread
             // such that it can be able to determine which thread has the lowest workload.
             this->size++;
+            this->updateMemoryStats();
         }
     }
 }
 
 
+void ConnectionPool::update(){
+    /* Called by the pool thread after every epoll_wait. Overrides should call this to keep accepting clients. */
+    this->checkNewConnections();
+    this->sendBroadcasts();
+    this->enforceBudget();
+}
+
+
 int ConnectionPool::shutdown(){
     /* Shuts down all connections and stops running. Returns number of clients shut down */
 	this->running = false;
     int count = 0;
-    for (Client *c : this->clients){
-        count += this->closeConnection(c);
+    // closeConnection() removes the client from the list
+    while (!this->clients.empty()){
+        count += this->closeConnection(this->clients.back());
     }
+    // Connections handed over by the acceptor but never registered
+    Client *client;
+    while (this->newConnectionsQueue->try_dequeue(client)){
+        client->close();
+        this->closed_clients.push_back(client);
+        count++;
+    }
+    this->retireClosedClients();
 
-    if (this->epoll_handle != nullptr) epoll_close(this->epoll_handle);
+    if (this->epoll_handle != nullptr) net::epoll_close(this->epoll_handle);
+    // The destructor shuts down again
+    this->epoll_handle = nullptr;
     return count;
 }
 
 int ConnectionPool::closeConnection(Client *c){
-    /* Closes connection with given client, returns 1 if closed successfully, 0 otherwise. */
+    /* Closes connection with given client and removes it from this pool, returns 1 if closed successfully,
+       0 if the client isn't in this pool. Pool thread only, Client::close() ends up here. */
     //if (c->isClosed()) return 0;
     for (int i = 0; i < this->clients.size(); i++) {
         if (c == this->clients[i]) {
             // Remove from list
             this->clients.erase(this->clients.begin()+i);
             // Remove client from the epoll set explictly
-            epoll_ctl(this->epoll_handle, EPOLL_CTL_DEL, c->client_socket, nullptr);
-            
-
-            // Reduce reference count to this client as we no longer store a reference to it.
-            c->referenceCount--;
+            net::epoll_ctl(this->epoll_handle, EPOLL_CTL_DEL, c->client_socket, nullptr);
+            c->closed = true;
+            net::closesocket(c->client_socket);
+            this->buffers.release(c->recv_partial);
+            if (c->output_pending) this->dropOutput(c);
+            if (c->reads_paused) this->resumeReads(c);
+
+            // The caller may still be using the client (a handler closing its own connection),
+            // it is retired once the current loop iteration is done.
+            this->closed_clients.push_back(c);
             // Reduce current pool size
             this->size--;
+            this->updateMemoryStats();
             
+            TCPSERVER_PROBE2(close, c->client_id, this->id);
             printf("[%s] Closed client connection\n", this->serverName);
             return 1;
         }
     }
     return 0;
 }
+void ConnectionPool::retireClosedClients(){
+    /* Hands clients closed since the last call to the reclaimer, which frees them once no thread can hold them.
+       Without a reclaimer whoever created the clients frees them. */
+    EpochReclaimer *r = this->reclaimer;
+    if (r != nullptr){
+        for (Client *c : this->closed_clients){
+            r->retire(this->id, c, Client::destroy);
+        }
+    }
+    this->closed_clients.clear();
+}
 void ConnectionPool::removeFromList(Client *c){
-    /* Removes client from pool of clients. Does not close the connection with the client (useful when migrating servers). */
+    /* Removes client from pool of clients. Does not close the connection with the client (useful when migrating servers).
+       The client stays allocated, the caller hands it to its new pool. */
     //if (c->isClosed()) return;
     for (int i = 0; i < this->clients.size(); i++) {
         if (c == this->clients[i]) {
             // Remove from list
             this->clients.erase(this->clients.begin()+i);
 
-            // Reduce reference count to this client as we no longer store a reference to it.
-            c->referenceCount--;
+            // Its partial packet buffer moves along, addToList() accounts it to the new pool
+            this->buffers.forget(c->recv_partial);
+            // Queued output doesn't, it belongs to this pool's epoll registration
+            if (c->output_pending) this->dropOutput(c);
+            if (c->reads_paused) this->resumeReads(c);
             // Reduce current pool size
             this->size--;
+            this->updateMemoryStats();
             return;
         }
     }
@@ -126,103 +206,622 @@ void ConnectionPool::addToList(Client *c){
     /* Adds client to list */
     //if (c->isClosed()) return;
     this->clients.push_back(c);
+    this->buffers.adopt(c->recv_partial);
     // Add counts
-    c->referenceCount++;
     this->size++;
+    this->updateMemoryStats();
 }
 
 
 void ConnectionPool::serveForever(){
-    // TODO: ensure this is enough bytes for all types of packets
-    int buffer_size = 4096*10;
-    char *recv_buffer = new char[buffer_size]();
-    int num_bytes = 0;
     int timeout_ms = 500;
-
     while (this->running){
+        this->serveOnce(timeout_ms);
+    }
+}
 
-        int eventCount = epoll_wait(this->epoll_handle, this->epoll_events, this->num_epoll_events, timeout_ms);
+void ConnectionPool::serveOnce(int timeout_ms){
+    /* One event loop iteration: waits up to timeout_ms for events, handles them and runs update().
+       Event loop accounting is published through getStats(). */
+    unsigned long long wait_start, wait_end, process_end, update_end;
+
+    wait_start = getMonotonicTimeUS();
+    if (this->loop.deadline != 0){
+        // Scheduling lag: how late we came back to epoll_wait compared to its timeout,
+        // caused either by a late timer or by event processing and update() overrunning it.
+        unsigned long long lag = wait_start > this->loop.deadline ? wait_start - this->loop.deadline : 0;
+        this->loop.window_lag_sum += lag;
+        this->loop.window_lag_count++;
+        if (lag > this->loop.window_lag_max) this->loop.window_lag_max = lag;
+    }
+    this->loop.deadline = wait_start + (unsigned long long)timeout_ms*1000;
+
+    int eventCount = net::epoll_wait(this->epoll_handle, this->epoll_events, this->num_epoll_events, timeout_ms);
+
+    wait_end = getMonotonicTimeUS();
+    // Clients are only touched between enter() and exit(), see EpochReclaimer
+    if (this->reclaimer != nullptr) this->reclaimer->enter(this->id);
+    addStat(this->stat_wait_us, wait_end - wait_start);
+    if (eventCount > 0){
+        addStat(this->stat_wakeups, 1);
+        addStat(this->stat_events, eventCount);
+        this->loop.window_wakeups++;
+        this->loop.window_events += eventCount;
+    }
+
+    // Sampled frames take the times of the recv completing them, only read the clock for those while tracing
+    bool tracing = this->tracer.load(std::memory_order_relaxed) != nullptr;
+    this->recv_readable_us = wait_end;
 
-        // Timed out
-        if (eventCount == 0);
+    // Timed out
+    if (eventCount == 0);
 
-        else if (eventCount > 0){
-            // Received events up to max of 'num_epoll_events'
-            for (int i = 0; i < eventCount; i++){
+    else if (eventCount > 0){
+        // Received events up to max of 'num_epoll_events'
+        for (int i = 0; i < eventCount; i++){
+
+            SOCKET client_socket = this->epoll_events[i].data.sock;
+            Client *client = this->getClientFromSocket(client_socket);
+            if (client == nullptr){
+                // Closed by a handler earlier in this batch, the rest of its events are stale
+                continue;
+            }
 
-                SOCKET client_socket = this->epoll_events[i].data.sock;
-                Client *client = this->getClientFromSocket(client_socket);
-                if (client == nullptr){
-                    // Should never happen
-                    printf("[%s] getClientFromSocket() returned nullptr with socket: %d in ConnectionPool::serveForever()\n", this->serverName, (int)client_socket);
+            uint32_t events = this->epoll_events[i].events;
+            if (events & ~(EPOLLIN | EPOLLOUT | EPOLLRDHUP)){
+                // Socket closed, hang-up, socket error
+                client->close();
+                continue;
+            }
+            if (events & EPOLLRDHUP){
+                // A paused client's peer is done sending, it may still read its queued output. Reading resumes
+                // as usual and ends with the EOF, stop polling for the hang-up until then.
+                client->peer_closed = true;
+                this->updateInterest(client);
+            }
+            if (events & EPOLLOUT){
+                // Room for output queued earlier
+                if (this->flushOutput(client) < 0){
+                    printf("[%s] Error when sending queued data. WSAGetLastError = %d, client socket: %d\n", this->serverName, net::lastError(), (int)client_socket);
+                    client->close();
                     continue;
                 }
-
-                if (this->epoll_events[i].events != EPOLLIN){
-                    // Socket closed, hang-up, socket error
+                // Paused clients are read again once their output drains
+                if (!this->enforceQuota(client)) continue;
+            }
+            // Paused earlier in this batch
+            if ((events & EPOLLIN) && !client->reads_paused){
+                if (tracing) this->recv_start_us = getMonotonicTimeUS();
+
+                // Incoming recv data available
+                int num_bytes = net::recv(client_socket, this->recv_buffer, recv_buffer_size, 0);
+                if (num_bytes == 0){
+                    // Client closed the connection gracefully
                     client->close();
                     continue;
                 }
-                else {
-                    // Incoming recv data available
-                    num_bytes = recv(client_socket, (char *)recv_buffer, buffer_size, 0);
-                    if (num_bytes <= -1){
-                        // Error in recv
-                        int error_code;
-                        int error_code_size = sizeof(error_code);
-                        // Reset socket
-                        getsockopt(client_socket, SOL_SOCKET, SO_ERROR, (char *)&error_code, &error_code_size);
-                        printf("[%s] Error when receiving data. Socket error code %d, WSAGetLastError = %d, client socket: %d\n", this->serverName, error_code, (int)WSAGetLastError(), (int)client_socket);
-                        client->close();
-                        continue;
-                    }
-
-                    if (num_bytes >= buffer_size){
-                        // Packet is too big for our allocated buffer
-                        printf("[%s] Error: Packet size %d is more than allocated buffer size %d in ConnectionPool::serveForever()\n", this->serverName, num_bytes, buffer_size);
-                        client->close();
-                        break;
-                    }
-
-                    // Update number of requests this client has received
-                    client->request_count++;
-
-                    //if (print)
-                    //printf("[%s] Received %d/%d bytes for client %d\n", this->serverName, packetLength+buffer_offset, num_bytes, (int)client->client_id);
-
-                    Packet *p = nullptr;
-                    try{
-                        // -4 to skip packet header
-                        p = new Packet((char *)recv_buffer, num_bytes);
-                        // TODO: remove this try catch
-                    } catch (...){
-                        printf("[%s] Error allocating packet with size: %d\n", this->serverName, num_bytes);
-                        client->close();
-                        break;
-                    }
-                    // Handle packet request
-                    try{
-                        handle_function(client, p);
-                    } catch (...){
-                        printf("[%s] Could not handle packet, closed connection with %d\n", this->serverName, (int)client->client_id);
-                        client->close();
-                        delete p;
-                        break;
-                    }
-
-                    delete p;
+                if (num_bytes <= -1 && net::lastError() == WSAEWOULDBLOCK){
+                    // Readiness was stale, nothing to read after all
+                    continue;
+                }
+                if (num_bytes <= -1){
+                    // Error in recv
+                    int error_code;
+                    int error_code_size = sizeof(error_code);
+                    // Reset socket
+                    net::getsockopt(client_socket, SOL_SOCKET, SO_ERROR, (char *)&error_code, &error_code_size);
+                    printf("[%s] Error when receiving data. Socket error code %d, WSAGetLastError = %d, client socket: %d\n", this->serverName, error_code, net::lastError(), (int)client_socket);
+                    client->close();
+                    continue;
+                }
+
+                TCPSERVER_PROBE3(recv, client->client_id, this->id, num_bytes);
+                if (tracing) this->recv_end_us = getMonotonicTimeUS();
+
+                if (this->processReceived(client, this->recv_buffer, num_bytes) < 0){
+                    client->close();
                 }
+                else this->enforceQuota(client);
             }
-            
         }
-        else if (eventCount <= -1){
-            // Error occurred
-            printf("[%s] Error occurred in epoll_wait()\n", this->serverName);
+        
+    }
+    else if (eventCount <= -1){
+        // Error occurred
+        printf("[%s] Error occurred in epoll_wait()\n", this->serverName);
+    }
+    process_end = getMonotonicTimeUS();
+
+    // Update any events
+    this->update();
+    // Nothing of this iteration refers to closed clients or arena memory anymore
+    this->retireClosedClients();
+    if (this->reclaimer != nullptr){
+        this->reclaimer->exit(this->id);
+        this->reclaimer->reclaim(this->id);
+    }
+    this->arena.reset();
+    this->stat_arena_bytes.store(this->arena.capacity(), std::memory_order_relaxed);
+    this->stat_buffer_bytes.store(recv_buffer_size + this->buffers.bytesInUse() + this->buffers.bytesCached(), std::memory_order_relaxed);
+    this->stat_partial_buffers.store(this->buffers.buffersInUse(), std::memory_order_relaxed);
+    this->stat_outbound_bytes.store(this->outbound_bytes, std::memory_order_relaxed);
+    this->stat_outbound_clients.store((int)this->outbound.size(), std::memory_order_relaxed);
+    this->stat_paused_clients.store((int)this->paused_clients.size(), std::memory_order_relaxed);
+
+    update_end = getMonotonicTimeUS();
+    addStat(this->stat_process_us, process_end - wait_end);
+    addStat(this->stat_update_us, update_end - process_end);
+    this->loop.window_busy_us += update_end - wait_end;
+
+    if (update_end - this->loop.window_start >= (unsigned long long)stats_window_ms*1000){
+        // Publish stats for the window that just ended
+        unsigned long long elapsed = update_end - this->loop.window_start;
+        this->window_busy_permille = (int)(this->loop.window_busy_us*1000 / elapsed);
+        this->window_events_per_wakeup_milli = this->loop.window_wakeups > 0 ? (int)(this->loop.window_events*1000 / this->loop.window_wakeups) : 0;
+        this->window_wakeups_per_second = (int)(this->loop.window_wakeups*1000000 / elapsed);
+        this->window_lag_avg_us = this->loop.window_lag_count > 0 ? this->loop.window_lag_sum / this->loop.window_lag_count : 0;
+        this->window_lag_max_us = this->loop.window_lag_max;
+
+        this->loop.window_start = update_end;
+        this->loop.window_wakeups = this->loop.window_events = this->loop.window_busy_us = 0;
+        this->loop.window_lag_sum = this->loop.window_lag_count = this->loop.window_lag_max = 0;
+
+        bool rotate = update_end - this->loop.heavy_hitter_window_start >= (unsigned long long)heavy_hitter_window_ms*1000;
+        if (rotate) this->loop.heavy_hitter_window_start = update_end;
+        this->publishHeavyHitters(rotate);
+    }
+}
+
+
+void ConnectionPool::updateMemoryStats(){
+    /* Publishes memory held by this pool's client registry. Called by the pool thread whenever it changes. */
+    this->stat_registry_bytes.store(this->clients.capacity() * sizeof(Client *), std::memory_order_relaxed);
+}
+
+PoolStats ConnectionPool::getStats(){
+    /* Returns a snapshot of this pool's event loop utilization. Safe to call from any thread. */
+    PoolStats stats;
+    stats.id = this->id;
+    stats.size = this->size;
+    stats.numa_node = this->numa_node;
+    stats.wait_us = this->stat_wait_us.load(std::memory_order_relaxed);
+    stats.process_us = this->stat_process_us.load(std::memory_order_relaxed);
+    stats.update_us = this->stat_update_us.load(std::memory_order_relaxed);
+    stats.wakeups = this->stat_wakeups.load(std::memory_order_relaxed);
+    stats.events = this->stat_events.load(std::memory_order_relaxed);
+    stats.registry_bytes = this->stat_registry_bytes.load(std::memory_order_relaxed);
+    stats.buffer_bytes = this->stat_buffer_bytes.load(std::memory_order_relaxed);
+    stats.arena_bytes = this->stat_arena_bytes.load(std::memory_order_relaxed);
+    stats.partial_buffers = this->stat_partial_buffers.load(std::memory_order_relaxed);
+    stats.retained_packets = this->packets.inUse();
+    stats.outbound_bytes = this->stat_outbound_bytes.load(std::memory_order_relaxed);
+    stats.outbound_clients = this->stat_outbound_clients.load(std::memory_order_relaxed);
+    stats.paused_clients = this->stat_paused_clients.load(std::memory_order_relaxed);
+    stats.shed_clients = this->stat_shed_clients.load(std::memory_order_relaxed);
+
+    stats.busy_ratio = this->window_busy_permille.load(std::memory_order_relaxed) / 1000.0;
+    stats.events_per_wakeup = this->window_events_per_wakeup_milli.load(std::memory_order_relaxed) / 1000.0;
+    stats.wakeups_per_second = this->window_wakeups_per_second.load(std::memory_order_relaxed);
+    stats.lag_avg_us = this->window_lag_avg_us.load(std::memory_order_relaxed);
+    stats.lag_max_us = this->window_lag_max_us.load(std::memory_order_relaxed);
+    return stats;
+}
+
+
+TraceSample *ConnectionPool::beginTraceSample(TraceSample &sample, Client *client){
+    /* Called when the trace countdown runs out. Returns nullptr if tracing isn't enabled. */
+    RequestTracer *t = this->tracer.load(std::memory_order_relaxed);
+    if (t == nullptr){
+        // Check again later in case tracing gets enabled
+        this->trace_countdown = 4096;
+        return nullptr;
+    }
+    this->trace_countdown = t->sample_every;
+
+    sample = TraceSample();
+    sample.pool_id = this->id;
+    sample.client_id = client->client_id;
+    sample.readable_us = this->recv_readable_us;
+    sample.recv_start_us = this->recv_start_us;
+    sample.recv_end_us = this->recv_end_us;
+    return &sample;
+}
+
+void ConnectionPool::publishHeavyHitters(bool rotate){
+    /* Called by the pool thread. Publishes previous + current window and optionally starts a new window. */
+    TopKSketch requests = this->requests_previous;
+    requests.merge(this->requests_current);
+    TopKSketch bytes = this->bytes_previous;
+    bytes.merge(this->bytes_current);
+    {
+        std::lock_guard<std::mutex> lock(this->heavy_hitters_mutex);
+        this->requests_published = requests;
+        this->bytes_published = bytes;
+    }
+
+    if (rotate){
+        std::swap(this->requests_previous, this->requests_current);
+        std::swap(this->bytes_previous, this->bytes_current);
+        this->requests_current.clear();
+        this->bytes_current.clear();
+    }
+}
+
+TopKSketch ConnectionPool::getHeavyHittersByRequests(){
+    std::lock_guard<std::mutex> lock(this->heavy_hitters_mutex);
+    return this->requests_published;
+}
+
+TopKSketch ConnectionPool::getHeavyHittersByBytes(){
+    std::lock_guard<std::mutex> lock(this->heavy_hitters_mutex);
+    return this->bytes_published;
+}
+
+
+int ConnectionPool::processReceived(Client *client, char *data, int num_bytes){
+    /* Splits received bytes into packets and hands every complete packet to handle_function.
+       Bytes of an incomplete packet are kept on the client until the rest arrives.
+       Returns -1 if the client should be closed (packet too big or handler failed), 0 otherwise. */
+    PooledBuffer &partial = client->recv_partial;
+    char *buffer = data;
+    int size = num_bytes;
+    if (partial.data != nullptr){
+        // Continue the packet started by an earlier recv
+        if (!this->buffers.reserve(partial, partial.size + num_bytes)){
+            printf("[%s] Error allocating receive buffer of %d bytes for client %d\n", this->serverName, partial.size + num_bytes, client->client_id);
+            return -1;
+        }
+        memcpy(partial.data + partial.size, data, num_bytes);
+        partial.size += num_bytes;
+        buffer = partial.data;
+        size = partial.size;
+    }
+
+    int offset = 0;
+    while (size - offset >= packet_header_size){
+        unsigned int payload_size = readPacketHeader(buffer + offset);
+        if (payload_size > (unsigned int)max_packet_size){
+            printf("[%s] Error: Packet size %u is more than max packet size %d for client %d\n", this->serverName, payload_size, max_packet_size, client->client_id);
+            return -1;
         }
-        // Update any events
-        this->update();
+        if (size - offset - packet_header_size < (int)payload_size) break;
+
+        if (this->dispatchPacket(client, buffer + offset + packet_header_size, (int)payload_size) < 0) return -1;
+        // The handler closed the connection, drop the rest
+        if (client->closed) return -1;
+        offset += packet_header_size + payload_size;
+    }
+
+    if (offset == size){
+        // Clients without a partial packet don't hold a buffer
+        this->buffers.release(partial);
+    }
+    else if (buffer == data){
+        // Only as much as was received, a large packet's buffer grows as the rest arrives
+        if (!this->buffers.reserve(partial, size - offset)){
+            printf("[%s] Error allocating receive buffer of %d bytes for client %d\n", this->serverName, size - offset, client->client_id);
+            return -1;
+        }
+        memcpy(partial.data, data + offset, size - offset);
+        partial.size = size - offset;
+    }
+    else if (offset > 0){
+        memmove(partial.data, partial.data + offset, size - offset);
+        partial.size = size - offset;
+    }
+    return 0;
+}
+
+int ConnectionPool::dispatchPacket(Client *client, char *payload, int payload_size){
+    /* Runs handle_function for one complete packet. Returns -1 if the client should be closed. */
+
+    // Sampled request tracing, 1 in sample_every frames, unsampled frames only pay for the countdown
+    TraceSample trace_sample;
+    TraceSample *sample = nullptr;
+    if (--this->trace_countdown == 0) sample = this->beginTraceSample(trace_sample, client);
+
+    // Update number of requests this client has received
+    client->request_count++;
+    this->requests_current.add(client->client_id, 1);
+    this->bytes_current.add(client->client_id, payload_size);
+
+    // Small payloads inline, larger ones in the pool's arena until the end of this event batch
+    Packet packet(payload, payload_size, &this->arena, &this->packets);
+    if (packet.data == nullptr){
+        printf("[%s] Error allocating packet with size: %d\n", this->serverName, payload_size);
+        return -1;
+    }
+    if (sample != nullptr) sample->packet_us = getMonotonicTimeUS();
+
+    // Publish the call to the watchdog (if enabled) so slow handlers can be attributed
+    HandlerSlot *slot = this->watchdog_slot.load(std::memory_order_acquire);
+    if (slot != nullptr) slot->begin(client->client_id, payload, payload_size);
+
+    // Handle packet request
+    TCPSERVER_PROBE3(handler_entry, client->client_id, this->id, payload_size);
+    this->dispatch_sample = sample;
+    try{
+        handle_function(client, &packet);
+        this->dispatch_sample = nullptr;
+        if (slot != nullptr) slot->end();
+        TCPSERVER_PROBE3(handler_exit, client->client_id, this->id, 1);
+    } catch (...){
+        this->dispatch_sample = nullptr;
+        if (slot != nullptr) slot->end();
+        TCPSERVER_PROBE3(handler_exit, client->client_id, this->id, 0);
+        printf("[%s] Could not handle packet, closed connection with %d\n", this->serverName, (int)client->client_id);
+        return -1;
+    }
+
+    if (sample != nullptr){
+        sample->num_bytes = payload_size;
+        sample->handler_end_us = getMonotonicTimeUS();
+        auto it = sample->reply_queued_us != 0 ? this->outbound.find(client) : this->outbound.end();
+        OutboundEntry *last = it != this->outbound.end() ? &it->second.entries.back() : nullptr;
+        // A queued reply is recorded by flushOutput() once it is sent
+        bool deferred = false;
+        if (last != nullptr && last->trace == nullptr){
+            last->trace = new (std::nothrow) TraceSample(*sample);
+            deferred = last->trace != nullptr;
+        }
+        if (!deferred){
+            RequestTracer *t = this->tracer.load(std::memory_order_relaxed);
+            if (t != nullptr) t->record(*sample);
+        }
+    }
+    return 0;
+}
+
+
+bool ConnectionPool::send(Client *c, SharedPayload *payload){
+    /* Sends directly while nothing is queued, so a client keeping up never touches the queue.
+       Whatever is left is queued by reference, payload is never copied. */
+    if (c->closed) return false;
+    if (c->output_pending){
+        // Behind queued output, order matters
+        payload->acquire();
+        return this->queueOutput(c, payload, 0);
+    }
+    int n = net::send(c->client_socket, payload->data(), payload->size(), 0);
+    if (n == payload->size()) return true;
+    if (n == SOCKET_ERROR){
+        if (net::lastError() != WSAEWOULDBLOCK){
+            c->close();
+            return false;
+        }
+        n = 0;
+    }
+    payload->acquire();
+    return this->queueOutput(c, payload, n);
+}
+
+bool ConnectionPool::send(Client *c, const char *data, int size){
+    /* Like send() of a shared payload, but only the part the socket didn't take is copied */
+    if (c->closed) return false;
+    int n = 0;
+    if (!c->output_pending){
+        n = net::send(c->client_socket, data, size, 0);
+        if (n == size) return true;
+        if (n == SOCKET_ERROR){
+            if (net::lastError() != WSAEWOULDBLOCK){
+                c->close();
+                return false;
+            }
+            n = 0;
+        }
+    }
+    SharedPayload *rest = SharedPayload::copyBytes(data + n, size - n);
+    if (rest == nullptr){
+        printf("[%s] Error allocating %d bytes of output for client %d\n", this->serverName, size - n, c->client_id);
+        c->close();
+        return false;
+    }
+    return this->queueOutput(c, rest, 0);
+}
+
+bool ConnectionPool::queueOutput(Client *c, SharedPayload *payload, int offset){
+    /* The first queued entry turns on EPOLLOUT, flushOutput() turns it off once the queue is empty */
+    OutboundQueue &queue = this->outbound[c];
+    queue.entries.push_back({payload, offset, nullptr});
+    queue.bytes += payload->size() - offset;
+    this->outbound_bytes += payload->size() - offset;
+    if (!c->output_pending){
+        c->output_pending = true;
+        this->updateInterest(c);
+    }
+    // Part of the reply to a sampled request
+    TraceSample *sample = this->dispatch_sample;
+    if (sample != nullptr && sample->client_id == c->client_id && sample->reply_queued_us == 0){
+        sample->reply_queued_us = getMonotonicTimeUS();
+    }
+    return this->enforceQuota(c);
+}
+
+int ConnectionPool::flushOutput(Client *c){
+    auto it = this->outbound.find(c);
+    if (it == this->outbound.end()) return 0;
+    OutboundQueue &queue = it->second;
+    while (queue.head < queue.entries.size()){
+        OutboundEntry &entry = queue.entries[queue.head];
+        int left = entry.payload->size() - entry.offset;
+        int n = net::send(c->client_socket, entry.payload->data() + entry.offset, left, 0);
+        if (n == SOCKET_ERROR) return net::lastError() == WSAEWOULDBLOCK ? 0 : -1;
+        entry.offset += n;
+        queue.bytes -= n;
+        this->outbound_bytes -= n;
+        // Socket is full, wait for the next EPOLLOUT
+        if (n < left) return 0;
+        entry.payload->release();
+        if (entry.trace != nullptr){
+            entry.trace->reply_flushed_us = getMonotonicTimeUS();
+            this->finishTrace(entry.trace);
+        }
+        queue.head++;
+        if (queue.head >= 64 && queue.head*2 >= queue.entries.size()){
+            // Drop sent entries of a queue that never runs empty
+            queue.entries.erase(queue.entries.begin(), queue.entries.begin() + queue.head);
+            queue.head = 0;
+        }
+    }
+    this->outbound.erase(it);
+    c->output_pending = false;
+    this->updateInterest(c);
+    return 0;
+}
+
+void ConnectionPool::dropOutput(Client *c){
+    /* Releases output that will never be sent, the connection is gone */
+    auto it = this->outbound.find(c);
+    if (it != this->outbound.end()){
+        OutboundQueue &queue = it->second;
+        for (size_t i = queue.head; i < queue.entries.size(); i++){
+            OutboundEntry &entry = queue.entries[i];
+            this->outbound_bytes -= entry.payload->size() - entry.offset;
+            entry.payload->release();
+            if (entry.trace != nullptr) this->finishTrace(entry.trace);
+        }
+        this->outbound.erase(it);
+    }
+    c->output_pending = false;
+}
+
+void ConnectionPool::finishTrace(TraceSample *trace){
+    RequestTracer *t = this->tracer.load(std::memory_order_relaxed);
+    if (t != nullptr) t->record(*trace);
+    delete trace;
+}
+
+void ConnectionPool::updateInterest(Client *c){
+    struct epoll_event e = this->event;
+    // A paused client still has its hang-up noticed
+    e.events = (c->reads_paused ? (c->peer_closed ? 0 : EPOLLRDHUP) : EPOLLIN) | (c->output_pending ? EPOLLOUT : 0);
+    e.data.sock = c->client_socket;
+    net::epoll_ctl(this->epoll_handle, EPOLL_CTL_MOD, c->client_socket, &e);
+}
+
+size_t ConnectionPool::clientMemory(Client *c){
+    size_t held = c->recv_partial.size;
+    if (c->output_pending){
+        auto it = this->outbound.find(c);
+        if (it != this->outbound.end()) held += it->second.bytes;
+    }
+    return held;
+}
+
+bool ConnectionPool::enforceQuota(Client *c){
+    /* Called whenever what c holds changed */
+    MemoryBudget *b = this->budget.load(std::memory_order_relaxed);
+    if (b == nullptr || c->closed) return !c->closed;
+    size_t held = this->clientMemory(c);
+    // As announced once the header is in, not the buffer's size class
+    const PooledBuffer &partial = c->recv_partial;
+    size_t packet = partial.size >= packet_header_size ? packet_header_size + (size_t)readPacketHeader(partial.data) : (size_t)partial.size;
+    if (packet > b->client_quota){
+        // Pausing can't help, the packet only completes if we keep reading
+        this->shedClient(c, held, "partial packet over its quota");
+        return false;
+    }
+    if (held > 2*b->client_quota){
+        // Not reading its output while more keeps being queued to it (broadcasts)
+        this->shedClient(c, held, "twice its quota");
+        return false;
+    }
+    if (held > b->client_quota){
+        if (!c->reads_paused) this->pauseReads(c);
+    }
+    else if (c->reads_paused && this->budget_pressure_since == 0
+             && (held <= b->client_quota/2 || !c->output_pending)){
+        this->resumeReads(c);
+    }
+    return true;
+}
+
+void ConnectionPool::enforceBudget(){
+    /* Reports this pool's partial buffers to the budget and applies the global limit, see MemoryBudget.h */
+    MemoryBudget *b = this->budget.load(std::memory_order_relaxed);
+    if (b == nullptr) return;
+    size_t partial = this->buffers.bytesInUse();
+    b->add((long long)partial - (long long)this->budget_charged);
+    this->budget_charged = partial;
+
+    size_t used = b->used();
+    if (this->budget_pressure_since == 0){
+        if (used <= b->global_limit) return;
+        this->budget_pressure_since = getMonotonicTimeUS();
+        printf("[%s] Memory budget exceeded (%llu of %llu bytes), pausing clients holding memory\n",
+            this->serverName, (unsigned long long)used, (unsigned long long)b->global_limit);
+        for (Client *c : this->clients){
+            if (!c->reads_paused && this->clientMemory(c) > 0) this->pauseReads(c);
+        }
+    }
+    else if (used <= b->global_limit/10*9){
+        this->budget_pressure_since = 0;
+        // Backwards, resuming removes the client from the list
+        for (size_t i = this->paused_clients.size(); i-- > 0; ){
+            Client *c = this->paused_clients[i];
+            if (this->clientMemory(c) <= b->client_quota) this->resumeReads(c);
+        }
+    }
+    else if (getMonotonicTimeUS() - this->budget_pressure_since >= (unsigned long long)MemoryBudget::shed_after_ms*1000){
+        // Pausing didn't get us back under the limit, drop whoever holds the most
+        Client *worst = nullptr;
+        size_t worst_held = 0;
+        for (Client *c : this->clients){
+            size_t held = this->clientMemory(c);
+            if (held > worst_held){
+                worst = c;
+                worst_held = held;
+            }
+        }
+        if (worst != nullptr) this->shedClient(worst, worst_held, "the most while over the global budget");
+    }
+}
+
+void ConnectionPool::pauseReads(Client *c){
+    c->reads_paused = true;
+    this->paused_clients.push_back(c);
+    this->updateInterest(c);
+}
+
+void ConnectionPool::resumeReads(Client *c){
+    c->reads_paused = false;
+    for (size_t i = 0; i < this->paused_clients.size(); i++){
+        if (this->paused_clients[i] == c){
+            this->paused_clients[i] = this->paused_clients.back();
+            this->paused_clients.pop_back();
+            break;
+        }
+    }
+    if (!c->closed) this->updateInterest(c);
+}
+
+void ConnectionPool::shedClient(Client *c, size_t held, const char *reason){
+    printf("[%s] Disconnecting client %d holding %llu bytes, %s\n", this->serverName, c->client_id, (unsigned long long)held, reason);
+    addStat(this->stat_shed_clients, 1);
+    c->close();
+}
+
+void ConnectionPool::broadcast(SharedPayload *payload){
+    payload->acquire();
+    std::lock_guard<std::mutex> lock(this->broadcast_mutex);
+    this->broadcasts.push_back(payload);
+    this->has_broadcasts.store(true, std::memory_order_release);
+}
+
+void ConnectionPool::sendBroadcasts(){
+    /* Pool thread. Every client gets a reference to the same payload, nothing is copied. */
+    if (!this->has_broadcasts.load(std::memory_order_acquire)) return;
+    std::vector<SharedPayload *> pending;
+    {
+        std::lock_guard<std::mutex> lock(this->broadcast_mutex);
+        pending.swap(this->broadcasts);
+        this->has_broadcasts.store(false, std::memory_order_relaxed);
+    }
+    for (SharedPayload *p : pending){
+        // Backwards, a client failing is closed and leaves the list
+        for (size_t i = this->clients.size(); i-- > 0; ) this->send(this->clients[i], p);
+        p->release();
     }
-    delete[] recv_buffer;
 }
 
 
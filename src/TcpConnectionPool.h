@@ -3,50 +3,243 @@
 
 #include <mutex>
 #include <vector>
+#include <unordered_map>
 #include "imports/wepoll/wepoll.h"
 //#include "packet.h"
 #include <atomic>
 #include "imports/lockfreequeue/readerwriterqueue.h"
 #include <string>
+#include "TopKSketch.h"
+#include "RequestArena.h"
+#include "BufferPool.h"
+#include "PacketPool.h"
 
 class Client;
 class Packet;
+struct HandlerSlot;
+struct TraceSample;
+class RequestTracer;
+class EpochReclaimer;
+class SharedPayload;
+class MemoryBudget;
 
 using functionPtr_t = void(*)(Client *, Packet *);
 
+// Snapshot of a pool's event loop utilization, see ConnectionPool::getStats()
+struct PoolStats{
+	int id = 0;
+	int size = 0;
+	int numa_node = -1;
+
+	// Totals since the pool started (microseconds)
+	unsigned long long wait_us = 0;		// Blocked in epoll_wait
+	unsigned long long process_us = 0;	// Handling events returned by epoll_wait
+	unsigned long long update_us = 0;	// Inside update()
+	unsigned long long wakeups = 0;
+	unsigned long long events = 0;
+
+	// Values for the last completed stats window (stats_window_ms)
+	double busy_ratio = 0;			// (process + update) / total loop time, 0..1
+	double events_per_wakeup = 0;
+	double wakeups_per_second = 0;
+	unsigned long long lag_avg_us = 0;	// How late the loop came back to epoll_wait relative to its timeout
+	unsigned long long lag_max_us = 0;
+
+	// Memory held by the pool (bytes)
+	unsigned long long registry_bytes = 0;	// Client list
+	unsigned long long buffer_bytes = 0;	// Receive buffers, shared and held by clients with a partial packet
+	unsigned long long arena_bytes = 0;	// Request arena
+	int partial_buffers = 0;		// Clients holding a receive buffer
+	int retained_packets = 0;		// Packets kept past their handler (Packet::retain()) and not released yet
+	unsigned long long outbound_bytes = 0;	// Output queued for clients whose socket didn't take it yet
+	int outbound_clients = 0;		// Clients with queued output
+	// Memory budget enforcement, see MemoryBudget.h
+	int paused_clients = 0;			// Clients not read from because they hold too much
+	unsigned long long shed_clients = 0;	// Clients disconnected for holding too much, total
+};
+
 
 class ConnectionPool{
 
 public:
-	ConnectionPool(int id, const char *serverName);
-	~ConnectionPool();
+	// Memory of the pool is allocated on numa_node if it is >= 0, the pool thread should run there too
+	ConnectionPool(int id, const char *serverName, int numa_node = -1);
+	virtual ~ConnectionPool();
 	void addNewConnection(Client *client);
 	virtual int closeConnection(Client *c);
 	virtual void checkNewConnections();
 	virtual void update();
 	void serveForever();
+	// One iteration of serveForever(), lets a simulation drive the pool without its thread
+	void serveOnce(int timeout_ms);
 	void removeFromList(Client *c);
 	void addToList(Client *c);
 	int shutdown();
+	// Reassembles packets from received bytes and dispatches them, see TcpConnectionPool.cpp
+	int processReceived(Client *client, char *data, int num_bytes);
+	// Sends to c, what the socket doesn't take right away is queued and sent once it is writable. A shared
+	// payload is queued by reference, raw bytes are copied. Pool thread only, handlers use Client::send().
+	// Returns false if the connection failed, it is closed then.
+	bool send(Client *c, SharedPayload *payload);
+	bool send(Client *c, const char *data, int size);
+	// Sends payload to every client of this pool in the pool thread's next update(). Safe to call from any
+	// thread, the caller keeps its reference.
+	void broadcast(SharedPayload *payload);
+	// Safe to call from any thread
+	PoolStats getStats();
+	// Heavy hitter clients of this pool over the last heavy_hitter_window_ms..2*heavy_hitter_window_ms.
+	// Refreshed once per stats window, safe to call from any thread.
+	TopKSketch getHeavyHittersByRequests();
+	TopKSketch getHeavyHittersByBytes();
+
+	// Fields are grouped by the threads touching them so that a write by one thread doesn't
+	// invalidate a cache line another thread keeps reading (false sharing).
+
+	// Read mostly: set up front, read by the pool thread for every event
 
 	int id = 0;
+	// NUMA node of the pool thread and the pool's memory, -1 if the machine has only one
+	int numa_node = -1;
 
-	// Number of connected clients on this thread
-	std::atomic<int> size = 0;
+	int running = 1;
 
 	// Queue of new connections inserted by TcpConnectionAcceptor
 	// Thread safe lock free queue
 	// Only thread safe with 2 threads (1 enqueue 1 dequeue concurrently)
 	moodycamel::ReaderWriterQueue<Client *> *newConnectionsQueue;
 
-	int running = 1;
+	// Set by TcpConnectionAcceptor::startHandlerWatchdog(), nullptr when the watchdog is disabled
+	std::atomic<HandlerSlot *> watchdog_slot = nullptr;
+	// Set by TcpConnectionAcceptor::startRequestTracing(), nullptr when tracing is disabled
+	std::atomic<RequestTracer *> tracer = nullptr;
+	// Set by TcpConnectionAcceptor::setMemoryBudget(), nullptr for no limits
+	std::atomic<MemoryBudget *> budget = nullptr;
+	// Frees closed clients once no thread can hold them anymore, this pool is participant id. Set by
+	// TcpConnectionAcceptor before the pool runs, without one closed clients are left to their creator.
+	EpochReclaimer *reclaimer = nullptr;
+
+	// Number of connected clients on this thread. Written by the pool thread, read by the acceptor
+	// for every accepted connection, so it has a cache line to itself.
+	alignas(64) std::atomic<int> size = 0;
+	char size_padding[64 - sizeof(std::atomic<int>)];
+
+	// Scratch memory for the current event batch, reset after each epoll_wait batch.
+	// Packets are allocated from it, handlers reach it through Packet::arena. Pool thread only.
+	RequestArena arena;
+	// Packets handlers keep past their batch, see Packet::retain()
+	PacketPool packets;
 protected:
+	int dispatchPacket(Client *client, char *payload, int payload_size);
 	Client *getClientFromSocket(SOCKET s);
 	std::vector<Client *> clients;
+	// Closed during the current loop iteration, retired at its end
+	std::vector<Client *> closed_clients;
+	void retireClosedClients();
 	HANDLE epoll_handle = nullptr;
 	static const int num_epoll_events = 20; // Config::maxConcurrentRequests
 	struct epoll_event event, epoll_events[num_epoll_events];
 	const char *serverName;
+	static const int recv_buffer_size = 4096*10;
+	char *recv_buffer = nullptr;
+	PageAllocation recv_buffer_pages;
+	// Buffers for packets spanning several recv calls, see processReceived()
+	BufferPool buffers;
+
+	// Output the socket didn't take yet, in send order. Only clients with Client::output_pending have an
+	// entry, they are polled for EPOLLOUT until it is flushed. Pool thread only.
+	struct OutboundEntry{
+		SharedPayload *payload;
+		// Bytes of payload already sent
+		int offset;
+		// Sampled request whose reply ends with this entry, recorded once the entry is sent
+		TraceSample *trace;
+	};
+	struct OutboundQueue{
+		std::vector<OutboundEntry> entries;
+		// First entry not completely sent
+		size_t head = 0;
+		// Bytes not sent yet
+		size_t bytes = 0;
+	};
+	std::unordered_map<Client *, OutboundQueue> outbound;
+	unsigned long long outbound_bytes = 0;
+	// Takes over one reference to payload
+	bool queueOutput(Client *c, SharedPayload *payload, int offset);
+	// Sends queued output until the socket is full, returns -1 if the connection failed
+	int flushOutput(Client *c);
+	void dropOutput(Client *c);
+	// Polls c for EPOLLIN unless its reads are paused (then for its hang-up until seen), and for EPOLLOUT while
+	// it has queued output
+	void updateInterest(Client *c);
+	void sendBroadcasts();
+
+	// Memory budget enforcement, see MemoryBudget.h. Pool thread only.
+	// Bytes of c's partial packet plus its queued output
+	size_t clientMemory(Client *c);
+	// Pauses, resumes or disconnects c according to its quota, returns false if it was disconnected
+	bool enforceQuota(Client *c);
+	// Global limit, called from update()
+	void enforceBudget();
+	void pauseReads(Client *c);
+	void resumeReads(Client *c);
+	void shedClient(Client *c, size_t held, const char *reason);
+	// Clients with Client::reads_paused
+	std::vector<Client *> paused_clients;
+	// Partial buffer bytes last reported to the budget
+	size_t budget_charged = 0;
+	// Time the global limit was first found exceeded, 0 while it isn't
+	unsigned long long budget_pressure_since = 0;
+
+	// Event loop state carried between serveOnce() calls, only touched by the pool thread
+	struct LoopState{
+		// Time at which the previous epoll_wait would have timed out
+		unsigned long long deadline = 0;
+		unsigned long long window_start = 0, heavy_hitter_window_start = 0;
+		unsigned long long window_wakeups = 0, window_events = 0, window_busy_us = 0;
+		unsigned long long window_lag_sum = 0, window_lag_count = 0, window_lag_max = 0;
+	} loop;
+
+	// Event loop accounting. Written by the pool thread only, read by anyone through getStats().
+	// Starts a new cache line so readers don't pull the loop state above away from the pool thread.
+	static const int stats_window_ms = 1000;
+	alignas(64) std::atomic<unsigned long long> stat_wait_us = 0, stat_process_us = 0, stat_update_us = 0;
+	std::atomic<unsigned long long> stat_wakeups = 0, stat_events = 0;
+	// Published once per stats window. Ratios are stored in thousandths.
+	std::atomic<int> window_busy_permille = 0, window_events_per_wakeup_milli = 0, window_wakeups_per_second = 0;
+	std::atomic<unsigned long long> window_lag_avg_us = 0, window_lag_max_us = 0;
+	std::atomic<unsigned long long> stat_registry_bytes = 0, stat_buffer_bytes = 0, stat_arena_bytes = 0;
+	std::atomic<int> stat_partial_buffers = 0;
+	std::atomic<unsigned long long> stat_outbound_bytes = 0;
+	std::atomic<int> stat_outbound_clients = 0;
+	std::atomic<int> stat_paused_clients = 0;
+	std::atomic<unsigned long long> stat_shed_clients = 0;
+	void updateMemoryStats();
+
+	// Heavy hitter detection. Sketches are rotated every heavy_hitter_window_ms and the
+	// previous + current window is published, giving a sliding window in fixed memory.
+	static const int heavy_hitter_window_ms = 10000;
+	static const int heavy_hitter_capacity = 64;
+	void publishHeavyHitters(bool rotate);
+
+	// Frames left until the next one is traced, counted in dispatchPacket(). Only touched by the pool thread.
+	int trace_countdown = 1;
+	// readable_us and recv_*_us of the recv being processed, stamped only while tracing is enabled
+	unsigned long long recv_readable_us = 0, recv_start_us = 0, recv_end_us = 0;
+	TraceSample *beginTraceSample(TraceSample &sample, Client *client);
+	// Sample of the request whose handler is running, so queueOutput() can time its reply
+	TraceSample *dispatch_sample = nullptr;
+	// Records and frees a sample carried by an OutboundEntry
+	void finishTrace(TraceSample *trace);
+	TopKSketch requests_current{heavy_hitter_capacity}, requests_previous{heavy_hitter_capacity};
+	TopKSketch bytes_current{heavy_hitter_capacity}, bytes_previous{heavy_hitter_capacity};
+	// Locked by readers from other threads, kept away from the sketches the pool updates per request
+	alignas(64) std::mutex heavy_hitters_mutex;
+	TopKSketch requests_published{heavy_hitter_capacity}, bytes_published{heavy_hitter_capacity};
+
+	// Payloads broadcast from any thread, sent by the pool thread in update()
+	alignas(64) std::mutex broadcast_mutex;
+	std::vector<SharedPayload *> broadcasts;
+	std::atomic<bool> has_broadcasts = false;
 };
 
 
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include "TopKSketch.h"
+
+
+TopKSketch::TopKSketch(int capacity){
+    this->capacity = capacity > 0 ? capacity : 1;
+    this->entries.reserve(this->capacity);
+
+    // Keep the table at most half full so probe sequences stay short
+    unsigned int table_size = 1;
+    while (table_size < (unsigned int)this->capacity * 2) table_size <<= 1;
+    this->index.assign(table_size, -1);
+    this->mask = table_size - 1;
+}
+
+void TopKSketch::clear(){
+    this->entries.clear();
+    std::fill(this->index.begin(), this->index.end(), -1);
+    this->total = 0;
+}
+
+int TopKSketch::findEntry(int client_id) const{
+    for (unsigned int i = this->home(client_id); ; i = (i + 1) & this->mask){
+        int e = this->index[i];
+        if (e == -1) return -1;
+        if (this->entries[e].client_id == client_id) return e;
+    }
+}
+
+void TopKSketch::insertIndex(int client_id, int entry){
+    unsigned int i = this->home(client_id);
+    while (this->index[i] != -1) i = (i + 1) & this->mask;
+    this->index[i] = entry;
+}
+
+void TopKSketch::eraseIndex(int client_id){
+    /* Removes client from the table, shifting back following entries of the probe sequence. */
+    unsigned int i = this->home(client_id);
+    while (this->entries[this->index[i]].client_id != client_id) i = (i + 1) & this->mask;
+    this->index[i] = -1;
+
+    unsigned int j = i;
+    while (true){
+        j = (j + 1) & this->mask;
+        if (this->index[j] == -1) return;
+        unsigned int k = this->home(this->entries[this->index[j]].client_id);
+        // Entry at j can stay if its home slot lies cyclically in (i, j]
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (stays) continue;
+        this->index[i] = this->index[j];
+        this->index[j] = -1;
+        i = j;
+    }
+}
+
+void TopKSketch::rebuildIndex(){
+    std::fill(this->index.begin(), this->index.end(), -1);
+    for (int e = 0; e < (int)this->entries.size(); e++){
+        this->insertIndex(this->entries[e].client_id, e);
+    }
+}
+
+void TopKSketch::add(int client_id, unsigned long long weight){
+    this->total += weight;
+
+    int e = this->findEntry(client_id);
+    if (e != -1){
+        this->entries[e].count += weight;
+        return;
+    }
+
+    if ((int)this->entries.size() < this->capacity){
+        TopKEntry entry;
+        entry.client_id = client_id;
+        entry.count = weight;
+        this->entries.push_back(entry);
+        this->insertIndex(client_id, (int)this->entries.size() - 1);
+        return;
+    }
+
+    // Sketch is full, replace the counter with the lowest count. The new client inherits
+    // that count as its possible overestimation.
+    int min_e = 0;
+    for (int i = 1; i < (int)this->entries.size(); i++){
+        if (this->entries[i].count < this->entries[min_e].count) min_e = i;
+    }
+    TopKEntry &victim = this->entries[min_e];
+    this->eraseIndex(victim.client_id);
+    victim.client_id = client_id;
+    victim.error = victim.count;
+    victim.count += weight;
+    this->insertIndex(client_id, min_e);
+}
+
+unsigned long long TopKSketch::minCount() const{
+    if ((int)this->entries.size() < this->capacity) return 0;
+    unsigned long long m = this->entries[0].count;
+    for (const TopKEntry &e : this->entries){
+        if (e.count < m) m = e.count;
+    }
+    return m;
+}
+
+void TopKSketch::merge(const TopKSketch &other){
+    /* Clients missing from one sketch may still have up to that sketch's minCount(),
+       so it is added to both count and error to keep counts as upper bounds. */
+    unsigned long long this_min = this->minCount();
+    unsigned long long other_min = other.minCount();
+
+    std::vector<TopKEntry> merged;
+    merged.reserve(this->entries.size() + other.entries.size());
+    for (const TopKEntry &e : this->entries){
+        TopKEntry m = e;
+        int o = other.findEntry(e.client_id);
+        if (o != -1){
+            m.count += other.entries[o].count;
+            m.error += other.entries[o].error;
+        }
+        else {
+            m.count += other_min;
+            m.error += other_min;
+        }
+        merged.push_back(m);
+    }
+    for (const TopKEntry &e : other.entries){
+        if (this->findEntry(e.client_id) != -1) continue;
+        TopKEntry m = e;
+        m.count += this_min;
+        m.error += this_min;
+        merged.push_back(m);
+    }
+
+    std::sort(merged.begin(), merged.end(), [](const TopKEntry &a, const TopKEntry &b){ return a.count > b.count; });
+    if ((int)merged.size() > this->capacity) merged.resize(this->capacity);
+
+    this->entries = merged;
+    this->total += other.total;
+    this->rebuildIndex();
+}
+
+std::vector<TopKEntry> TopKSketch::top(int n) const{
+    std::vector<TopKEntry> result = this->entries;
+    std::sort(result.begin(), result.end(), [](const TopKEntry &a, const TopKEntry &b){ return a.count > b.count; });
+    if (n >= 0 && (int)result.size() > n) result.resize(n);
+    return result;
+}
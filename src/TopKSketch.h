@@ -0,0 +1,48 @@
+#ifndef _TOPK_SKETCH_H
+#define _TOPK_SKETCH_H
+
+#include <vector>
+
+struct TopKEntry{
+	int client_id = 0;
+	// Estimated count, never lower than the true count
+	unsigned long long count = 0;
+	// Maximum overestimation of count
+	unsigned long long error = 0;
+};
+
+/*  Space-Saving heavy hitter sketch (Metwally et al.) with a fixed number of counters.
+    Memory is bounded by capacity no matter how many distinct clients are added,
+    and any client with more than total/capacity weight is guaranteed to be tracked.
+    Not thread safe, each pool owns its own sketches and publishes copies. */
+class TopKSketch{
+public:
+	TopKSketch(int capacity = 64);
+
+	void add(int client_id, unsigned long long weight);
+	// Combines another sketch into this one (mergeable summaries), keeping at most capacity counters
+	void merge(const TopKSketch &other);
+	void clear();
+
+	// Returns up to n entries sorted by descending count
+	std::vector<TopKEntry> top(int n) const;
+	// Lower bound for counts of clients not in the sketch, 0 while the sketch isn't full
+	unsigned long long minCount() const;
+	unsigned long long totalWeight() const { return this->total; }
+
+protected:
+	int findEntry(int client_id) const;
+	void insertIndex(int client_id, int entry);
+	void eraseIndex(int client_id);
+	void rebuildIndex();
+	unsigned int home(int client_id) const { return ((unsigned int)client_id * 2654435761u) & this->mask; }
+
+	int capacity;
+	unsigned long long total = 0;
+	std::vector<TopKEntry> entries;
+	// Open addressing table (linear probing) from client id to position in entries, -1 when empty
+	std::vector<int> index;
+	unsigned int mask;
+};
+
+#endif
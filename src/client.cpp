@@ -0,0 +1,151 @@
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include "client.h"
+#include "netapi.h"
+#include "TcpConnectionPool.h"
+#include "PacketPool.h"
+
+std::atomic<int> Client::live_count = 0;
+
+static_assert(sizeof(Client) == 64, "Client should fit one cache line");
+
+Client::Client(SOCKET socket, struct sockaddr *sockAddr, int client_id){
+    this->client_socket = socket;
+    this->connection_pool = nullptr;
+    this->client_id = client_id;
+    live_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+Client::~Client(){
+    // Only left when the client never went through ConnectionPool::closeConnection(). Region buffers
+    // belong to their BufferPool.
+    if (!this->recv_partial.paged) delete[] this->recv_partial.data;
+    live_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Client::close(){
+    /* Closes the socket. A client registered with a pool is removed from it as well, otherwise a new
+       connection reusing the socket handle would be dispatched to this client. Safe to call twice. */
+    if (this->closed) return;
+    if (this->connection_pool != nullptr && this->connection_pool->closeConnection(this)) return;
+    this->closed = true;
+    net::closesocket(this->client_socket);
+}
+
+bool Client::send(SharedPayload *payload){
+    if (this->connection_pool == nullptr) return false;
+    return this->connection_pool->send(this, payload);
+}
+
+bool Client::send(const char *data, int size){
+    if (this->connection_pool == nullptr) return false;
+    return this->connection_pool->send(this, data, size);
+}
+
+void Client::destroy(void *client){
+    Client *c = (Client *)client;
+    if (c->slab != nullptr) c->slab->destroy(c);
+    else delete c;
+}
+
+
+ClientSlab::ClientSlab(int capacity, int node){
+    this->node = node;
+    this->grow(capacity > 0 ? capacity : 1);
+}
+
+ClientSlab::~ClientSlab(){
+    for (PageAllocation &chunk : this->chunks) freePages(chunk);
+}
+
+void ClientSlab::grow(int count){
+    /* Adds at least count slots, as many as the pages of the new chunk hold */
+    PageAllocation chunk = allocatePages((size_t)count * sizeof(Slot), this->node);
+    if (chunk.data == nullptr) throw std::bad_alloc();
+    this->chunks.push_back(chunk);
+    Slot *slots = (Slot *)chunk.data;
+    count = (int)(chunk.size / sizeof(Slot));
+    this->total += count;
+    // Room for every slot up front, taking over returned slots never allocates
+    this->free_slots.reserve(this->total);
+    for (int i = count - 1; i >= 0; i--) this->free_slots.push_back(&slots[i]);
+}
+
+Client *ClientSlab::create(SOCKET socket, struct sockaddr *sockAddr, int client_id){
+    if (this->free_slots.empty()){
+        // Take over everything destroyed since the last time
+        for (Slot *slot = this->returned.exchange(nullptr, std::memory_order_acquire); slot != nullptr; ){
+            Slot *next = slot->next;
+            this->free_slots.push_back(slot);
+            slot = next;
+        }
+    }
+    if (this->free_slots.empty()){
+        printf("[Warning] Client slab full with %d clients, growing\n", this->total);
+        this->grow(this->total);
+    }
+    Slot *slot = this->free_slots.back();
+    this->free_slots.pop_back();
+    Client *c = new (slot) Client(socket, sockAddr, client_id);
+    c->slab = this;
+    this->in_use.fetch_add(1, std::memory_order_relaxed);
+    return c;
+}
+
+void ClientSlab::destroy(Client *c){
+    c->~Client();
+    Slot *slot = (Slot *)c;
+    slot->next = this->returned.load(std::memory_order_relaxed);
+    while (!this->returned.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed));
+    this->in_use.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+Packet::Packet(char *buffer, int num_bytes){
+    if (num_bytes <= inline_capacity){
+        this->data = this->inline_data;
+    }
+    else {
+        this->data = new char[num_bytes];
+        this->storage = HEAP;
+    }
+    memcpy(this->data, buffer, num_bytes);
+    this->size = num_bytes;
+}
+
+Packet::Packet(char *buffer, int num_bytes, RequestArena *arena, PacketPool *pool){
+    this->arena = arena;
+    this->pool = pool;
+    if (num_bytes <= inline_capacity){
+        this->data = this->inline_data;
+        memcpy(this->data, buffer, num_bytes);
+    }
+    else {
+        this->data = arena->copy(buffer, num_bytes);
+        this->storage = ARENA;
+    }
+    this->size = this->data != nullptr ? num_bytes : 0;
+}
+
+Packet::~Packet(){
+    // Pooled buffers are given back by PacketPool::destroy()
+    if (this->storage == HEAP) delete[] this->data;
+}
+
+char *Packet::detach() const{
+    char *copy = new char[this->size];
+    memcpy(copy, this->data, this->size);
+    return copy;
+}
+
+Packet *Packet::retain() const{
+    if (this->pool != nullptr) return this->pool->create(this->data, this->size);
+    return new (std::nothrow) Packet(this->data, this->size);
+}
+
+void Packet::release(Packet *packet){
+    if (packet == nullptr) return;
+    if (packet->pool != nullptr) packet->pool->destroy(packet);
+    else delete packet;
+}
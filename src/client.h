@@ -1,26 +1,161 @@
 #pragma once
 #include <WinSock2.h>
 #include <atomic>
+#include <vector>
+#include "RequestArena.h"
+#include "BufferPool.h"
+#include "HugePages.h"
 
 class ConnectionPool;
+class ClientSlab;
+class SharedPayload;
+class PacketPool;
 
-class Client{
+/*  Once handed to a pool a client is only touched by that pool's thread. It is retired through the
+    acceptor's EpochReclaimer when its connection closes and goes back to its slab once no thread can
+    hold it anymore, so there is no shared reference count.
+    The first cache line holds everything the pool thread reads or writes for every event. */
+class alignas(64) Client{
 public:
 	Client(SOCKET socket, struct sockaddr *sockAddr, int client_id);
+	~Client();
+	// Closes the connection and leaves the pool. Call from the pool's thread (e.g. inside a handler).
 	void close();
+	// Sends to the client without blocking, output the socket can't take yet is queued by the pool and sent
+	// when it can (see ConnectionPool::send()). Pool thread only, don't mix with send() on client_socket.
+	// Returns false if the connection failed, the client is closed then.
+	bool send(SharedPayload *payload);
+	bool send(const char *data, int size);
+	// Returns a client to its slab, or deletes it if it has none. Signature of EpochReclaimer::retire().
+	static void destroy(void *client);
+
+	// Hot, pool thread only
 
 	SOCKET client_socket;
 	ConnectionPool *connection_pool;
-
+	// Bytes of a packet that has only partially been received. Taken from the pool's BufferPool
+	// and given back once the packet is complete, holds no memory otherwise.
+	PooledBuffer recv_partial;
 	// Number of requests this client has received
 	int request_count = 0;
 	// Unique id for this client
 	int client_id = 0;
-	std::atomic<int> referenceCount = 0;
+	bool closed = false;
+	// Has output queued in its pool, see ConnectionPool::send()
+	bool output_pending = false;
+	// Not read from while it holds too much memory, see MemoryBudget.h
+	bool reads_paused = false;
+	// The peer finished sending while reads were paused, what it sent and its EOF are read once they resume
+	bool peer_closed = false;
+
+	// Cold, only used when the client is created and deleted
+
+	// Slab the client was created from and goes back to, nullptr if created with new
+	ClientSlab *slab = nullptr;
+	// Client objects currently allocated, for leak checks
+	static std::atomic<int> live_count;
+};
+
+/*  Preallocated storage for Client objects, one slab per pool.
+    Clients are created by the acceptor thread only, so the free list needs no locking. They are destroyed
+    by whichever thread reclaims them (see EpochReclaimer), which pushes the slot on a lock free list that
+    create() takes over in one exchange when the free list runs dry. A full slab grows by another chunk as
+    big as everything it has so far. Chunks come from allocatePages() and fill the pages they take, on 2 MB
+    huge pages a chunk holds at least 32768 clients. The acceptor allocates them on behalf of the pool, on
+    the pool's NUMA node, so the pool thread reads its clients from local memory. */
+class ClientSlab{
+public:
+	// node is the NUMA node of the pool owning the slab, -1 for none
+	ClientSlab(int capacity, int node = -1);
+	// Every client of this slab must have been destroyed
+	~ClientSlab();
+
+	// Acceptor thread only
+	Client *create(SOCKET socket, struct sockaddr *sockAddr, int client_id);
+	// Any thread
+	void destroy(Client *c);
+
+	int capacity(){ return this->total; }
+	int inUse(){ return this->in_use.load(std::memory_order_relaxed); }
+
+protected:
+	struct alignas(Client) Slot{
+		union{
+			unsigned char bytes[sizeof(Client)];
+			// Next slot on the returned list
+			Slot *next;
+		};
+	};
+	void grow(int count);
+
+	std::vector<PageAllocation> chunks;
+	int node;
+	// Last freed first, its memory is most likely still cached
+	std::vector<Slot *> free_slots;
+	int total = 0;
+	std::atomic<int> in_use = 0;
+	// Slots destroyed by other threads, pushed one by one and taken all at once by create()
+	alignas(64) std::atomic<Slot *> returned = nullptr;
 };
 
+/*  A received payload as handed to handle_function. Payloads up to inline_capacity bytes, most of them,
+    are stored in the Packet itself, larger ones in the batch's arena or on the heap.
+    A handler keeping a packet past its batch (a work item for later) takes retain(): the copy is a fixed
+    size node of the pool's PacketPool with a small payload inline, so it needs no allocation at all, larger
+    payloads take a pooled buffer. */
 class Packet{
 public:
+	static const int inline_capacity = 128;
+
+	// Copies num_bytes from buffer, onto the heap if it doesn't fit inline
 	Packet(char *buffer, int num_bytes);
+	// Copies num_bytes from buffer, into arena if it doesn't fit inline. data is nullptr if that fails.
+	// retain() takes its copies from pool, on the heap without one.
+	Packet(char *buffer, int num_bytes, RequestArena *arena, PacketPool *pool = nullptr);
+	~Packet();
+	Packet(const Packet &) = delete;
+	Packet &operator=(const Packet &) = delete;
+
+	// Heap copy of data for keeping it past the handler, free with delete[]
+	char *detach() const;
+	// Copy of the packet that outlives the handler's batch, nullptr if out of memory. Call from the pool's
+	// thread (inside the handler), free it with release() from any thread before the acceptor is destroyed.
+	Packet *retain() const;
+	static void release(Packet *packet);
+
+	char *data = nullptr;
+	int size = 0;
+	// Arena of the current event batch, nullptr for packets outliving it. Handlers can allocate scratch
+	// memory from it, all of it is released after the batch (see RequestArena).
+	RequestArena *arena = nullptr;
 
+protected:
+	friend class PacketPool;
+	Packet(){}
+
+	enum Storage : unsigned char{ INLINE, ARENA, HEAP, POOLED };
+	Storage storage = INLINE;
+	// PacketPool size class of a POOLED buffer, size is public and handlers may change it
+	unsigned char buffer_class = 0;
+	// Pool retained copies come from, and for a retained packet the pool it goes back to
+	PacketPool *pool = nullptr;
+	char inline_data[inline_capacity];
 };
+
+/* Packets on the wire: 4 byte little endian payload length followed by the payload */
+static const int packet_header_size = 4;
+// Largest payload accepted, clients sending more are disconnected. The whole packet has to fit
+// BufferPool::max_class_size while it is being reassembled.
+static const int max_packet_size = 16*1024*1024;
+
+inline void writePacketHeader(char *dst, unsigned int payload_size){
+	dst[0] = (char)(payload_size & 0xff);
+	dst[1] = (char)((payload_size >> 8) & 0xff);
+	dst[2] = (char)((payload_size >> 16) & 0xff);
+	dst[3] = (char)((payload_size >> 24) & 0xff);
+}
+
+inline unsigned int readPacketHeader(const char *src){
+	const unsigned char *s = (const unsigned char *)src;
+	return s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24);
+}
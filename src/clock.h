@@ -0,0 +1,30 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <chrono>
+#include <thread>
+
+#ifdef TCPSERVER_SIMULATION
+
+// Simulation builds run on the virtual clock of SimNetwork, sleeping only advances it
+unsigned long long simulatedTimeUS();
+void simulatedSleepMS(int ms);
+
+inline unsigned long long getMonotonicTimeUS(){ return simulatedTimeUS(); }
+inline void sleepForMS(int ms){ simulatedSleepMS(ms); }
+
+#else
+
+// Monotonic time in microseconds. Only meaningful as a difference between two calls,
+// use TcpConnectionAcceptor::getTimeMS() for wall clock time.
+inline unsigned long long getMonotonicTimeUS(){
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void sleepForMS(int ms){
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+#endif
+
+#endif
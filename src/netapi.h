@@ -0,0 +1,60 @@
+#ifndef _NETAPI_H
+#define _NETAPI_H
+
+/*  Socket and poller calls made by the acceptor and the pools.
+    Normal builds call WinSock and wepoll directly. Simulation builds (TCPSERVER_SIMULATION) route
+    every call to the in-memory sockets and poller of SimNetwork, see SimNetwork.h. */
+
+#include <winsock2.h>
+#include "imports/wepoll/wepoll.h"
+
+#ifdef TCPSERVER_SIMULATION
+#include "SimNetwork.h"
+#endif
+
+namespace net{
+
+#ifdef TCPSERVER_SIMULATION
+
+inline SOCKET socket(int af, int type, int protocol){ return SimNetwork::current->socket(); }
+inline int bind(SOCKET s, const struct sockaddr *addr, int addr_len){ return SimNetwork::current->bind(s, addr, addr_len); }
+inline int listen(SOCKET s, int backlog){ return SimNetwork::current->listen(s, backlog); }
+inline SOCKET accept(SOCKET s, struct sockaddr *addr, int *addr_len){ return SimNetwork::current->accept(s, addr, addr_len); }
+inline int recv(SOCKET s, char *buffer, int len, int flags){ return SimNetwork::current->recv(s, buffer, len); }
+inline int send(SOCKET s, const char *buffer, int len, int flags){ return SimNetwork::current->send(s, buffer, len); }
+inline int closesocket(SOCKET s){ return SimNetwork::current->closesocket(s); }
+inline int setsockopt(SOCKET s, int level, int name, const char *value, int len){ return 0; }
+// Simulated sockets never block
+inline int ioctlsocket(SOCKET s, long cmd, u_long *arg){ return 0; }
+inline int getsockopt(SOCKET s, int level, int name, char *value, int *len){ return SimNetwork::current->getsockopt(s, level, name, value, len); }
+inline int lastError(){ return SimNetwork::current->last_error; }
+
+inline HANDLE epoll_create(int size){ return SimNetwork::current->epollCreate(); }
+inline int epoll_close(HANDLE ephnd){ return SimNetwork::current->epollClose(ephnd); }
+inline int epoll_ctl(HANDLE ephnd, int op, SOCKET s, struct epoll_event *event){ return SimNetwork::current->epollCtl(ephnd, op, s, event); }
+inline int epoll_wait(HANDLE ephnd, struct epoll_event *events, int max_events, int timeout_ms){ return SimNetwork::current->epollWait(ephnd, events, max_events); }
+
+#else
+
+inline SOCKET socket(int af, int type, int protocol){ return ::socket(af, type, protocol); }
+inline int bind(SOCKET s, const struct sockaddr *addr, int addr_len){ return ::bind(s, addr, addr_len); }
+inline int listen(SOCKET s, int backlog){ return ::listen(s, backlog); }
+inline SOCKET accept(SOCKET s, struct sockaddr *addr, int *addr_len){ return ::accept(s, addr, addr_len); }
+inline int recv(SOCKET s, char *buffer, int len, int flags){ return ::recv(s, buffer, len, flags); }
+inline int send(SOCKET s, const char *buffer, int len, int flags){ return ::send(s, buffer, len, flags); }
+inline int closesocket(SOCKET s){ return ::closesocket(s); }
+inline int setsockopt(SOCKET s, int level, int name, const char *value, int len){ return ::setsockopt(s, level, name, value, len); }
+inline int ioctlsocket(SOCKET s, long cmd, u_long *arg){ return ::ioctlsocket(s, cmd, arg); }
+inline int getsockopt(SOCKET s, int level, int name, char *value, int *len){ return ::getsockopt(s, level, name, value, len); }
+inline int lastError(){ return WSAGetLastError(); }
+
+inline HANDLE epoll_create(int size){ return ::epoll_create(size); }
+inline int epoll_close(HANDLE ephnd){ return ::epoll_close(ephnd); }
+inline int epoll_ctl(HANDLE ephnd, int op, SOCKET s, struct epoll_event *event){ return ::epoll_ctl(ephnd, op, s, event); }
+inline int epoll_wait(HANDLE ephnd, struct epoll_event *events, int max_events, int timeout_ms){ return ::epoll_wait(ephnd, events, max_events, timeout_ms); }
+
+#endif
+
+}
+
+#endif
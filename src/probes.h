@@ -0,0 +1,55 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/*  Static tracepoints on the connection paths, provider "tcpserver".
+    On Windows they are TraceLogging (ETW) events, an event is a check of the provider's enabled flag until a
+    session (tracelog, wpr, PerfView) enables the provider. Elsewhere they are USDT probes where <sys/sdt.h> is
+    available, a single nop until a tracer (perf, bpftrace, systemtap) attaches. Either way they are always
+    compiled in, define TCPSERVER_NO_PROBES to remove them. On other platforms the macros compile to nothing.
+
+    Probes and arguments (ETW fields arg0, arg1, arg2):
+        accept(socket, connection_count)
+        add_new_connection(client_id, pool_id)
+        register_connection(client_id, pool_id, socket)
+        recv(client_id, pool_id, num_bytes)
+        handler_entry(client_id, pool_id, num_bytes)
+        handler_exit(client_id, pool_id, ok)
+        close(client_id, pool_id)
+
+    The ETW provider is registered while a TcpConnectionAcceptor exists, its GUID is derived from the name:
+        tracelog -start tcpserver -guid *tcpserver -f tcpserver.etl   ...   tracelog -stop tcpserver
+    Example: bpftrace -e 'usdt:./backend-server:tcpserver:recv { @bytes[arg1] = sum(arg2); }'
+*/
+
+#if !defined(TCPSERVER_NO_PROBES) && defined(_WIN32)
+#include <winsock2.h>
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+#define TCPSERVER_HAS_ETW_PROBES 1
+#elif !defined(TCPSERVER_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TCPSERVER_HAS_PROBES 1
+#endif
+#endif
+
+#if defined(TCPSERVER_HAS_ETW_PROBES)
+TRACELOGGING_DECLARE_PROVIDER(tcpserver_provider);
+#define TCPSERVER_PROBE2(name, a, b)		TraceLoggingWrite(tcpserver_provider, #name, \
+												TraceLoggingInt64((long long)(a), "arg0"), TraceLoggingInt64((long long)(b), "arg1"))
+#define TCPSERVER_PROBE3(name, a, b, c)		TraceLoggingWrite(tcpserver_provider, #name, \
+												TraceLoggingInt64((long long)(a), "arg0"), TraceLoggingInt64((long long)(b), "arg1"), \
+												TraceLoggingInt64((long long)(c), "arg2"))
+#elif defined(TCPSERVER_HAS_PROBES)
+#define TCPSERVER_PROBE2(name, a, b)		DTRACE_PROBE2(tcpserver, name, a, b)
+#define TCPSERVER_PROBE3(name, a, b, c)		DTRACE_PROBE3(tcpserver, name, a, b, c)
+#else
+#define TCPSERVER_PROBE2(name, a, b)		do {} while (0)
+#define TCPSERVER_PROBE3(name, a, b, c)		do {} while (0)
+#endif
+
+// Register the ETW provider while at least one acceptor exists, nothing without ETW probes
+void registerProbes();
+void unregisterProbes();
+
+#endif